@@ -0,0 +1,216 @@
+/***************************************************************************//**
+
+  @file         admission.c
+
+  @author       Robert Eikmanns
+
+  @date         Monday, 19 October 2026
+
+  @brief        Admission control limiting the connections in total and per remote address.
+                Connections per address are counted in an open addressing hash table with 
+                linear probing, keyed on the address as ipv6 (ipv4 addresses are mapped)
+
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "admission.h"
+
+typedef struct {
+	uint8_t address[16];
+	uint32_t count;			// 0 marks an empty slot
+} admission_entry_t;
+
+static admission_entry_t *table = NULL;
+static uint32_t table_size = 0, table_used = 0;
+static int admitted = 0;
+static int global_limit = 0, address_limit = 0;
+static pthread_mutex_t admission_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int address_key(struct sockaddr *addr, uint8_t *key);
+static admission_entry_t *find_slot(admission_entry_t *entries, uint32_t size, uint8_t *key);
+static int grow_table(void);
+static void remove_entry(admission_entry_t *entry);
+
+/**
+ *  @brief                      set the admission limits. Should be called before the server accepts connections
+ *
+ *  @param max_connections      maximum of open connections, 0 for no limit
+ *  @param max_per_address      maximum of open connections per remote ip address, 0 for no limit
+ */
+void 
+admission_set_limits(int max_connections, int max_per_address) {
+	pthread_mutex_lock(&admission_lock);
+	global_limit = max_connections;
+	address_limit = max_per_address;
+	pthread_mutex_unlock(&admission_lock);
+}
+
+/**
+ *  @brief                  admit a new connection. Every admitted connection has to be released with admission_release
+ *
+ *  @param addr             the remote address of the connection
+ *  @return                 ADMISSION_ACCEPTED if the connection may be served, ADMISSION_GLOBAL_LIMIT or 
+ *                          ADMISSION_ADDRESS_LIMIT if it has to be rejected
+ */
+int 
+admission_acquire(struct sockaddr *addr) {
+	uint8_t key[16];
+	admission_entry_t *entry;
+
+	pthread_mutex_lock(&admission_lock);
+
+	if (global_limit > 0 && admitted >= global_limit) {
+		pthread_mutex_unlock(&admission_lock);
+		return ADMISSION_GLOBAL_LIMIT;
+	}
+
+	if (address_limit > 0 && address_key(addr, key) == 0) {
+		if ((table_used + 1) * 2 > table_size && grow_table() == -1) {
+			pthread_mutex_unlock(&admission_lock);
+			return ADMISSION_GLOBAL_LIMIT;
+		}
+
+		entry = find_slot(table, table_size, key);
+		if (entry->count >= address_limit) {
+			pthread_mutex_unlock(&admission_lock);
+			return ADMISSION_ADDRESS_LIMIT;
+		}
+
+		if (entry->count == 0) {
+			memcpy(entry->address, key, sizeof(key));
+			table_used++;
+		}
+		entry->count++;
+	}
+
+	admitted++;
+	pthread_mutex_unlock(&admission_lock);
+
+	return ADMISSION_ACCEPTED;
+}
+
+/**
+ *  @brief                  release a connection admitted with admission_acquire
+ *
+ *  @param addr             the remote address of the connection
+ */
+void 
+admission_release(struct sockaddr *addr) {
+	uint8_t key[16];
+	admission_entry_t *entry;
+
+	pthread_mutex_lock(&admission_lock);
+
+	admitted--;
+
+	if (table != NULL && address_key(addr, key) == 0) {
+		entry = find_slot(table, table_size, key);
+
+		if (entry->count > 0 && --entry->count == 0) {
+			remove_entry(entry);
+			table_used--;
+		}
+	}
+
+	pthread_mutex_unlock(&admission_lock);
+}
+
+static int 
+address_key(struct sockaddr *addr, uint8_t *key) {
+	if (addr->sa_family == AF_INET6) {
+		memcpy(key, &((struct sockaddr_in6 *) addr)->sin6_addr, 16);
+	} else if (addr->sa_family == AF_INET) {
+		memset(key, 0, 10);
+		key[10] = key[11] = 0xFF;
+		memcpy(key + 12, &((struct sockaddr_in *) addr)->sin_addr, 4);
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+static uint32_t 
+hash_key(uint8_t *key) {
+	uint32_t hash;
+
+	// FNV-1a
+	hash = 2166136261u;
+	for (int i = 0; i < 16; ++i) {
+		hash = (hash ^ key[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+/**
+ *  @brief                  find the slot holding a key, or the empty slot where it would be inserted
+ */
+static admission_entry_t *
+find_slot(admission_entry_t *entries, uint32_t size, uint8_t *key) {
+	uint32_t pos;
+
+	pos = hash_key(key) & (size - 1);
+	while (entries[pos].count != 0 && memcmp(entries[pos].address, key, 16) != 0) {
+		pos = (pos + 1) & (size - 1);
+	}
+
+	return &entries[pos];
+}
+
+static int 
+grow_table(void) {
+	admission_entry_t *grown;
+	uint32_t size;
+
+	size = (table_size == 0) ? ADMISSION_TABLE_SIZE : table_size * 2;
+	grown = (admission_entry_t *) calloc(size, sizeof(admission_entry_t));
+	if (grown == NULL) {
+		return -1;
+	}
+
+	for (uint32_t i = 0; i < table_size; ++i) {
+		if (table[i].count != 0) {
+			*find_slot(grown, size, table[i].address) = table[i];
+		}
+	}
+
+	free(table);
+	table = grown;
+	table_size = size;
+
+	return 0;
+}
+
+/**
+ *  @brief                  empty a slot and move following entries back, so no probe sequence is interrupted
+ */
+static void 
+remove_entry(admission_entry_t *entry) {
+	uint32_t hole, pos, home;
+
+	hole = entry - table;
+	pos = hole;
+
+	for (;;) {
+		pos = (pos + 1) & (table_size - 1);
+		if (table[pos].count == 0) {
+			break;
+		}
+
+		home = hash_key(table[pos].address) & (table_size - 1);
+
+		// the entry may fill the hole if the hole lies on its probe sequence
+		if (((pos - home) & (table_size - 1)) >= ((pos - hole) & (table_size - 1))) {
+			table[hole] = table[pos];
+			hole = pos;
+		}
+	}
+
+	table[hole].count = 0;
+}
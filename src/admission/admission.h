@@ -0,0 +1,35 @@
+/***************************************************************************//**
+
+  @file         admission.h
+
+  @author       Robert Eikmanns
+
+  @date         Monday, 19 October 2026
+
+  @brief        Declarations for connection admission control
+
+*******************************************************************************/
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <sys/socket.h>
+
+#define 	ADMISSION_TABLE_SIZE	1024	// initial amount of slots of the per address table, grows on demand
+
+enum admission_policy {
+	ADMISSION_REJECT_HTTP 	= 0,	// answer rejected connections with 503 Service Unavailable
+	ADMISSION_REJECT_RESET 	= 1		// reset rejected connections without sending anything
+};
+
+enum admission_result {
+	ADMISSION_ACCEPTED 		= 0,
+	ADMISSION_GLOBAL_LIMIT 	= -1,
+	ADMISSION_ADDRESS_LIMIT = -2
+};
+
+void admission_set_limits(int max_connections, int max_per_address);
+int admission_acquire(struct sockaddr *addr);
+void admission_release(struct sockaddr *addr);
+
+#endif
@@ -0,0 +1,167 @@
+/***************************************************************************//**
+
+  @file         affinity.c
+
+  @author       Robert Eikmanns
+
+  @date         Monday, 19 October 2026
+
+  @brief        cpu placement of server threads. Memory allocated by a pinned thread
+                is placed on the thread's numa node by the kernel's first touch policy
+
+*******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "affinity.h"
+
+static cpu_set_t role_cpus[THREAD_ROLE_COUNT];
+static int role_configured[THREAD_ROLE_COUNT];
+
+static int role_affinity(int role, int fd, cpu_set_t *cpus);
+
+/**
+ *  @brief                  restrict the threads of a role to a set of cpus
+ *
+ *  @param role             one of the values of enum ws_thread_role
+ *  @param cpu_list         cpus in the notation of taskset -c, e.g. "0-3,8". NULL removes the restriction
+ *  @return                 0 if successful, or -1 if the role is unknown or the list is malformed
+ */
+int 
+affinity_set_cpus(int role, char *cpu_list) {
+	cpu_set_t cpus;
+	long first, last;
+	char *pos;
+
+	if (role < 0 || role >= THREAD_ROLE_COUNT) {
+		return -1;
+	}
+
+	if (cpu_list == NULL) {
+		role_configured[role] = 0;
+		return 0;
+	}
+
+	CPU_ZERO(&cpus);
+	pos = cpu_list;
+
+	while (*pos != '\0') {
+		first = last = strtol(pos, &pos, 10);
+		if (*pos == '-') {
+			last = strtol(pos + 1, &pos, 10);
+		}
+
+		if (first < 0 || last < first || last >= CPU_SETSIZE || (*pos != ',' && *pos != '\0')) {
+			fprintf(stderr, "invalid cpu list: %s\n", cpu_list);
+			return -1;
+		}
+
+		for (; first <= last; ++first) {
+			CPU_SET(first, &cpus);
+		}
+
+		if (*pos == ',') ++pos;
+	}
+
+	role_cpus[role] = cpus;
+	role_configured[role] = CPU_COUNT(&cpus) > 0;
+
+	return 0;
+}
+
+/**
+ *  @brief                  the cpus a role is restricted to
+ *
+ *  @param role             one of the values of enum ws_thread_role
+ *  @param cpus             receives the cpus
+ *  @return                 1 if the role is restricted, or 0 if it may run on any cpu
+ */
+int 
+affinity_get_cpus(int role, cpu_set_t *cpus) {
+	return role_affinity(role, -1, cpus);
+}
+
+/**
+ *  @brief                  initialize thread attributes carrying the affinity of a role
+ *
+ *  @param attr             the attributes to initialize, to be destroyed by the caller
+ *  @param role             one of the values of enum ws_thread_role
+ *  @param fd               accepted socket of the thread or -1. If the cpu that received the connection (SO_INCOMING_CPU) 
+ *                          belongs to the role, the thread is pinned to that single cpu to stay next to the nic interrupts
+ *  @return                 0 if successful, or -1 in case of an error
+ */
+int 
+affinity_init_attr(pthread_attr_t *attr, int role, int fd) {
+	cpu_set_t cpus;
+
+	if (pthread_attr_init(attr) != 0) {
+		return -1;
+	}
+
+	if (!role_affinity(role, fd, &cpus)) {
+		return 0;
+	}
+
+	if (pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &cpus) != 0) {
+		perror("thread affinity error");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ *  @brief                  move the calling thread to the cpus of a role, e.g. a pooled thread taking over a new 
+ *                          connection
+ *
+ *  @param role             one of the values of enum ws_thread_role
+ *  @param fd               accepted socket of the thread or -1, see affinity_init_attr
+ *  @return                 0 if successful, or -1 in case of an error
+ */
+int 
+affinity_apply(int role, int fd) {
+	cpu_set_t cpus;
+
+	if (!role_affinity(role, fd, &cpus)) {
+		return 0;
+	}
+
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus) != 0) {
+		perror("thread affinity error");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ *  @brief                  the cpus a thread of a role serving a socket belongs on
+ *
+ *  @return                 1 if the role is restricted to cpus, which are stored in cpus, or 0 if it is not
+ */
+static int 
+role_affinity(int role, int fd, cpu_set_t *cpus) {
+	int incoming_cpu;
+	socklen_t len;
+
+	if (role < 0 || role >= THREAD_ROLE_COUNT || !role_configured[role]) {
+		return 0;
+	}
+
+	*cpus = role_cpus[role];
+	len = sizeof(incoming_cpu);
+
+	if (fd >= 0 && getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &incoming_cpu, &len) == 0 
+		&& incoming_cpu >= 0 && incoming_cpu < CPU_SETSIZE && CPU_ISSET(incoming_cpu, &role_cpus[role])) {
+		CPU_ZERO(cpus);
+		CPU_SET(incoming_cpu, cpus);
+	}
+
+	return 1;
+}
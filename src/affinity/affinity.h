@@ -0,0 +1,30 @@
+/***************************************************************************//**
+
+  @file         affinity.h
+
+  @author       Robert Eikmanns
+
+  @date         Monday, 19 October 2026
+
+  @brief        Declarations for cpu placement of server threads
+
+*******************************************************************************/
+
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <sched.h>
+#include <pthread.h>
+
+enum ws_thread_role {
+	THREAD_ROLE_ACCEPT 	= 0,	// listener thread accepting new connections
+	THREAD_ROLE_IO 		= 1,	// connection threads, reading frames and running the handlers
+	THREAD_ROLE_COUNT 	= 2
+};
+
+int affinity_set_cpus(int role, char *cpu_list);
+int affinity_get_cpus(int role, cpu_set_t *cpus);
+int affinity_init_attr(pthread_attr_t *attr, int role, int fd);
+int affinity_apply(int role, int fd);
+
+#endif
@@ -0,0 +1,204 @@
+/***************************************************************************//**
+
+  @file         bus.c
+
+  @author       Robert Eikmanns
+
+  @date         Monday, 19 October 2026
+
+  @brief        Shared memory broadcast bus between server shards. Every shard writes into its 
+                own ring and reads the rings of all shards, so each ring has a single writer and 
+                needs no locks across processes. Slots are guarded by a sequence number 
+                (seqlock), readers overrun by the writer notice it and skip the lost messages
+
+*******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "bus.h"
+
+typedef struct {
+	uint64_t seq;						// 2n+1 while message n is written, 2n+2 once it is complete
+	uint32_t length;
+	uint8_t type;
+	uint8_t data[BUS_SLOT_SIZE];
+} bus_slot_t;
+
+typedef struct {
+	uint64_t head;						// number of the next message
+	uint8_t pad[56];					// keep the head of one ring off the cache line of the next
+	bus_slot_t slots[BUS_SLOTS];
+} bus_ring_t;
+
+struct bus {
+	uint32_t wakeups;					// futex word, bumped after every publish
+	uint32_t rings;
+	uint8_t pad[56];
+	bus_ring_t ring[];
+};
+
+// the threads of one process take turns as the single writer of its ring
+static pthread_mutex_t publish_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ *  @brief                  map a bus shared with all processes forked afterwards
+ *
+ *  @param rings            amount of rings, one per writing process
+ *  @return                 the bus, or NULL in case of an error
+ */
+bus_t *
+bus_create(int rings) {
+	bus_t *bus;
+
+	bus = mmap(NULL, sizeof(bus_t) + sizeof(bus_ring_t) * rings, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (bus == MAP_FAILED) {
+		perror("mmap error");
+		return NULL;
+	}
+
+	// anonymous mappings are zero filled, which is an empty ring
+	bus->rings = rings;
+
+	return bus;
+}
+
+/**
+ *  @brief                  amount of rings of a bus
+ */
+int 
+bus_rings(bus_t *bus) {
+	return bus->rings;
+}
+
+/**
+ *  @brief                  append a message to a ring and wake up the consumers
+ *
+ *  @param bus              the bus
+ *  @param ring             ring of the calling process
+ *  @param type             message type passed on to the consumers
+ *  @param bytes            the payload
+ *  @param length           length of the payload, at most BUS_SLOT_SIZE
+ *  @return                 0 if successful, or -1 if the message is too large
+ */
+int 
+bus_publish(bus_t *bus, int ring, uint8_t type, uint8_t *bytes, uint32_t length) {
+	bus_ring_t *r;
+	bus_slot_t *slot;
+	uint64_t n;
+
+	if (length > BUS_SLOT_SIZE) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	r = &bus->ring[ring];
+
+	pthread_mutex_lock(&publish_lock);
+
+	n = r->head;
+	slot = &r->slots[n % BUS_SLOTS];
+
+	__atomic_store_n(&slot->seq, 2 * n + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->length = length;
+	slot->type = type;
+	memcpy(slot->data, bytes, length);
+
+	__atomic_store_n(&slot->seq, 2 * n + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&r->head, n + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&publish_lock);
+
+	__atomic_add_fetch(&bus->wakeups, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &bus->wakeups, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+	return 0;
+}
+
+/**
+ *  @brief                  start reading at the current end of every ring
+ *
+ *  @param bus              the bus
+ *  @param cursors          read position per ring, an array of as many elements as the bus has rings
+ */
+void 
+bus_cursors_init(bus_t *bus, uint64_t *cursors) {
+	for (uint32_t i = 0; i < bus->rings; ++i) {
+		cursors[i] = __atomic_load_n(&bus->ring[i].head, __ATOMIC_ACQUIRE);
+	}
+}
+
+/**
+ *  @brief                  deliver all new messages of all rings, sleeps for a while if there are none
+ *
+ *  @param bus              the bus
+ *  @param cursors          read position per ring, see bus_cursors_init
+ *  @param buffer           scratch buffer of BUS_SLOT_SIZE bytes
+ *  @param deliver          called for every message
+ *  @return                 the amount of delivered messages
+ */
+int 
+bus_consume(bus_t *bus, uint64_t *cursors, uint8_t *buffer, bus_deliver_t deliver) {
+	struct timespec timeout;
+	bus_ring_t *r;
+	bus_slot_t *slot;
+	uint64_t head, n, seq;
+	uint32_t wakeups, length;
+	uint8_t type;
+	int delivered;
+
+	// read the futex word first, a publish after it makes the wait below return at once
+	wakeups = __atomic_load_n(&bus->wakeups, __ATOMIC_ACQUIRE);
+	delivered = 0;
+
+	for (uint32_t i = 0; i < bus->rings; ++i) {
+		r = &bus->ring[i];
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+		// the writer already overwrote messages this reader did not get to, skip them
+		if (head - cursors[i] > BUS_SLOTS) {
+			cursors[i] = head - BUS_SLOTS;
+		}
+
+		for (; cursors[i] < head; ++cursors[i]) {
+			n = cursors[i];
+			slot = &r->slots[n % BUS_SLOTS];
+
+			seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+			if (seq != 2 * n + 2) {
+				continue;
+			}
+
+			length = slot->length;
+			type = slot->type;
+			memcpy(buffer, slot->data, (length > BUS_SLOT_SIZE) ? BUS_SLOT_SIZE : length);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+			// the writer lapped us while copying, the message is lost
+			if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+				continue;
+			}
+
+			deliver(type, buffer, length);
+			delivered++;
+		}
+	}
+
+	if (delivered == 0) {
+		timeout.tv_sec = 0;
+		timeout.tv_nsec = BUS_WAIT_TIMEOUT * 1000000L;
+		syscall(SYS_futex, &bus->wakeups, FUTEX_WAIT, wakeups, &timeout, NULL, 0);
+	}
+
+	return delivered;
+}
@@ -0,0 +1,33 @@
+/***************************************************************************//**
+
+  @file         bus.h
+
+  @author       Robert Eikmanns
+
+  @date         Monday, 19 October 2026
+
+  @brief        Declarations for the shared memory broadcast bus between server shards
+
+*******************************************************************************/
+
+#ifndef BUS_H
+#define BUS_H
+
+#include <stdint.h>
+
+#define 	BUS_SLOTS			256			// messages a ring holds before the oldest is overwritten
+#define 	BUS_SLOT_SIZE		0x4000		// maximum payload of a broadcast
+#define 	BUS_WAIT_TIMEOUT	100			// in milliseconds, longest sleep of a consumer without a wakeup
+
+typedef struct bus bus_t;
+
+// called by bus_consume for every message, bytes are only valid during the call
+typedef void (*bus_deliver_t)(uint8_t type, uint8_t *bytes, uint32_t length);
+
+bus_t *bus_create(int rings);
+int bus_rings(bus_t *bus);
+int bus_publish(bus_t *bus, int ring, uint8_t type, uint8_t *bytes, uint32_t length);
+void bus_cursors_init(bus_t *bus, uint64_t *cursors);
+int bus_consume(bus_t *bus, uint64_t *cursors, uint8_t *buffer, bus_deliver_t deliver);
+
+#endif
@@ -0,0 +1,158 @@
+/***************************************************************************//**
+
+  @file         capture.c
+
+  @author       Robert Eikmanns
+
+  @date         Monday, 19 October 2026
+
+  @brief        Traffic capture into a rotating set of memory mapped files (<path>.0, <path>.1, ..). 
+                Once the current file is full the oldest one is overwritten, so the log never 
+                grows beyond files * file_size. testing/replay.py plays the sessions back
+
+*******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "capture.h"
+
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static char capture_path[256];
+static uint8_t *capture_map = NULL;
+static size_t capture_file_size, capture_offset;
+static int capture_files, capture_index;
+static uint32_t capture_sample_rate, capture_connections = 0;
+
+static int map_file(int index);
+
+/**
+ *  @brief                  start capturing to <path>.0 .. <path>.<files - 1>
+ *
+ *  @param path             prefix of the capture files   
+ *  @param file_size        size of every file in bytes
+ *  @param files            amount of files to rotate through
+ *  @param sample_rate      capture one of sample_rate connections, 1 captures all
+ *  @return                 0 if successful, or -1 in case of an error
+ */
+int 
+capture_open(const char *path, size_t file_size, int files, int sample_rate) {
+	if (strlen(path) >= sizeof(capture_path) || file_size < 0x1000 || files < 1 || sample_rate < 1) {
+		return -1;
+	}
+
+	strcpy(capture_path, path);
+	capture_file_size = file_size;
+	capture_files = files;
+	capture_sample_rate = sample_rate;
+
+	return map_file(0);
+}
+
+/**
+ *  @brief                  decide whether a new connection is captured
+ *
+ *  @return                 the id of the connection in the log, or 0 if the connection is not captured
+ */
+uint32_t 
+capture_sample(void) {
+	uint32_t n;
+
+	if (capture_map == NULL) {
+		return 0;
+	}
+
+	n = __atomic_fetch_add(&capture_connections, 1, __ATOMIC_RELAXED);
+
+	return (n % capture_sample_rate == 0) ? n + 1 : 0;
+}
+
+/**
+ *  @brief                  append a record to the log, switches to the next file if the current one is full
+ *
+ *  @param connection       id returned by capture_sample
+ *  @param kind             one of the values of enum capture_kind
+ *  @param op_code          first byte of the frame header, 0 for other kinds
+ *  @param data             the payload
+ *  @param length           length of the payload, cut off if it doesn't fit into an empty file
+ */
+void 
+capture_write(uint32_t connection, uint8_t kind, uint8_t op_code, const uint8_t *data, uint32_t length) {
+	capture_record_t record;
+	struct timespec now;
+	size_t size, max_length;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	record.timestamp = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+	record.connection = connection;
+	record.original_length = length;
+	record.kind = kind;
+	record.op_code = op_code;
+	record.pad = 0;
+
+	// keep room for the terminating zeroed record
+	max_length = capture_file_size - CAPTURE_HEADER_SIZE - 2 * sizeof(capture_record_t);
+	record.length = (length > max_length) ? max_length : length;
+	size = (sizeof(record) + record.length + 7) & ~7;
+
+	pthread_mutex_lock(&capture_lock);
+
+	if (capture_map != NULL && capture_offset + size + sizeof(record) > capture_file_size) {
+		map_file((capture_index + 1) % capture_files);
+	}
+
+	if (capture_map != NULL) {
+		memcpy(capture_map + capture_offset, &record, sizeof(record));
+		memcpy(capture_map + capture_offset + sizeof(record), data, record.length);
+		capture_offset += size;
+	}
+
+	pthread_mutex_unlock(&capture_lock);
+}
+
+static int 
+map_file(int index) {
+	char file_path[sizeof(capture_path) + 12];
+	int fd;
+
+	if (capture_map != NULL) {
+		munmap(capture_map, capture_file_size);
+		capture_map = NULL;
+	}
+
+	snprintf(file_path, sizeof(file_path), "%s.%d", capture_path, index);
+
+	// truncating first zeroes the old contents, which terminates the records of the new file
+	fd = open(file_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		perror("capture open error");
+		return -1;
+	}
+
+	if (ftruncate(fd, capture_file_size) == -1) {
+		perror("capture truncate error");
+		close(fd);
+		return -1;
+	}
+
+	capture_map = mmap(NULL, capture_file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (capture_map == MAP_FAILED) {
+		perror("capture mmap error");
+		capture_map = NULL;
+		return -1;
+	}
+
+	memcpy(capture_map, CAPTURE_MAGIC, CAPTURE_HEADER_SIZE);
+	capture_index = index;
+	capture_offset = CAPTURE_HEADER_SIZE;
+
+	return 0;
+}
@@ -0,0 +1,43 @@
+/***************************************************************************//**
+
+  @file         capture.h
+
+  @author       Robert Eikmanns
+
+  @date         Monday, 19 October 2026
+
+  @brief        Declarations for the traffic capture log
+
+*******************************************************************************/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define 	CAPTURE_MAGIC		"WSCAP001"	// first bytes of every capture file
+#define 	CAPTURE_HEADER_SIZE	8
+
+enum capture_kind {
+	CAPTURE_HANDSHAKE 	= 1,	// http upgrade request as received
+	CAPTURE_FRAME 		= 2,	// unmasked payload of an inbound frame
+	CAPTURE_DISCONNECT 	= 3		// the connection has been closed, no payload
+};
+
+// followed by length payload bytes, records start at multiples of 8. A zeroed record marks the end of a file
+typedef struct {
+	uint64_t timestamp;			// CLOCK_REALTIME in nanoseconds
+	uint32_t connection;		// id of the sampled connection, unique within one server run
+	uint32_t length;			// payload bytes stored in the log
+	uint32_t original_length;	// payload bytes received, larger than length if the payload was cut off
+	uint8_t kind;
+	uint8_t op_code;			// first byte of the frame header: fin flag and op code
+	uint16_t pad;
+} capture_record_t;
+
+int capture_open(const char *path, size_t file_size, int files, int sample_rate);
+uint32_t capture_sample(void);
+void capture_write(uint32_t connection, uint8_t kind, uint8_t op_code, const uint8_t *data, uint32_t length);
+
+#endif
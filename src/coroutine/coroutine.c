@@ -0,0 +1,169 @@
+/***************************************************************************//**
+
+  @file         coroutine.c
+
+  @author       Robert Eikmanns
+
+  @date         Monday, 19 October 2026
+
+  @brief        Stackful coroutines on top of ucontext. A coroutine runs on a stack of its own 
+                until it yields back to the scheduler that resumed it, so code written for a 
+                blocking thread can be suspended in the middle of a call chain. Stacks are mapped 
+                lazily with a guard page below them and kept in a pool when a coroutine ends
+
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "coroutine.h"
+
+static void coroutine_start(void);
+
+static __thread coroutine_t *current = NULL;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static coroutine_t *pool = NULL;
+static int pool_count = 0;
+
+/**
+ *  @brief                  create a suspended coroutine. It starts running function(arg) when it is resumed the first time
+ *
+ *  @param function         the body of the coroutine. Returning from it ends the coroutine like coroutine_exit
+ *  @param arg              argument passed to function
+ *  @param stack_size       usable stack in bytes. Pages are only backed by memory once they are touched
+ *  @return                 the coroutine, or NULL if no stack could be mapped
+ */
+coroutine_t *
+coroutine_create(void (*function)(void *), void *arg, size_t stack_size) {
+	coroutine_t *co;
+	size_t page;
+
+	page = sysconf(_SC_PAGESIZE);
+	stack_size = (stack_size + page - 1) & ~(page - 1);
+
+	pthread_mutex_lock(&pool_lock);
+	co = pool;
+	if (co != NULL) {
+		pool = co->next;
+		pool_count--;
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	// the pool only holds stacks of the current size, others are dropped
+	if (co != NULL && co->stack_size != stack_size) {
+		munmap(co->stack, co->stack_size + page);
+		free(co);
+		co = NULL;
+	}
+
+	if (co == NULL) {
+		co = (coroutine_t *) malloc(sizeof(coroutine_t));
+		if (co == NULL) {
+			return NULL;
+		}
+
+		co->stack = mmap(NULL, stack_size + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (co->stack == MAP_FAILED) {
+			perror("mmap error");
+			free(co);
+			return NULL;
+		}
+
+		// an overflow hits the guard page instead of the stack below
+		mprotect(co->stack, page, PROT_NONE);
+		co->stack_size = stack_size;
+	}
+
+	co->function = function;
+	co->arg = arg;
+	co->finished = 0;
+	co->next = NULL;
+
+	getcontext(&co->context);
+	co->context.uc_stack.ss_sp = co->stack + page;
+	co->context.uc_stack.ss_size = stack_size;
+	co->context.uc_link = NULL;
+	makecontext(&co->context, coroutine_start, 0);
+
+	return co;
+}
+
+/**
+ *  @brief                  run a coroutine until it yields or ends
+ *
+ *  @param co               the coroutine
+ *  @return                 1 if the coroutine has ended and may be destroyed, 0 if it yielded
+ */
+int 
+coroutine_resume(coroutine_t *co) {
+	coroutine_t *previous;
+
+	previous = current;
+	current = co;
+	swapcontext(&co->caller, &co->context);
+	current = previous;
+
+	return co->finished;
+}
+
+/**
+ *  @brief                  suspend the calling coroutine and return to its scheduler. Resuming it continues 
+ *                          after the call
+ */
+void 
+coroutine_yield(void) {
+	coroutine_t *co;
+
+	co = current;
+	swapcontext(&co->context, &co->caller);
+}
+
+/**
+ *  @brief                  end the calling coroutine and return to its scheduler, never returns. The stack is 
+ *                          abandoned as it is, so everything the coroutine owns has to be released before
+ */
+void 
+coroutine_exit(void) {
+	current->finished = 1;
+	setcontext(&current->caller);
+}
+
+/**
+ *  @brief                  the coroutine running on the calling thread
+ *
+ *  @return                 the coroutine, or NULL when called outside of a coroutine
+ */
+coroutine_t *
+coroutine_current(void) {
+	return current;
+}
+
+/**
+ *  @brief                  release an ended or never started coroutine, its stack goes back to the pool
+ */
+void 
+coroutine_destroy(coroutine_t *co) {
+	pthread_mutex_lock(&pool_lock);
+	if (pool_count < COROUTINE_POOL_MAX) {
+		co->next = pool;
+		pool = co;
+		pool_count++;
+		co = NULL;
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	if (co != NULL) {
+		munmap(co->stack, co->stack_size + sysconf(_SC_PAGESIZE));
+		free(co);
+	}
+}
+
+static void 
+coroutine_start(void) {
+	current->function(current->arg);
+	coroutine_exit();
+}
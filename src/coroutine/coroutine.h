@@ -0,0 +1,40 @@
+/***************************************************************************//**
+
+  @file         coroutine.h
+
+  @author       Robert Eikmanns
+
+  @date         Monday, 19 October 2026
+
+  @brief        Declarations for stackful coroutines
+
+*******************************************************************************/
+
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ucontext.h>
+
+#define 	COROUTINE_POOL_MAX		1024		// stacks kept for reuse
+
+typedef struct coroutine {
+	ucontext_t context;
+	ucontext_t caller;				// context of the scheduler that resumed the coroutine
+	void (*function)(void *);
+	void *arg;
+	uint8_t *stack;					// mapping including the guard page
+	size_t stack_size;
+	uint8_t finished;
+	struct coroutine *next;			// free list of the pool
+} coroutine_t;
+
+coroutine_t *coroutine_create(void (*function)(void *), void *arg, size_t stack_size);
+int coroutine_resume(coroutine_t *co);
+void coroutine_yield(void);
+void coroutine_exit(void);
+coroutine_t *coroutine_current(void);
+void coroutine_destroy(coroutine_t *co);
+
+#endif
@@ -29,7 +29,8 @@ http_response_status_code_t http_codes[] = {
 	{ 400, "Bad Request" },
 	{ 405, "Method Not Allowed" },
 	{ 101, "Switching Protocols" },
-	{ 426, "Upgrade Required" }
+	{ 426, "Upgrade Required" },
+	{ 503, "Service Unavailable" }
 };
 
 static char *http_response_base = "HTTP/1.1 %d %s\r\n"
@@ -109,7 +110,7 @@ parse_http_request(char *request, char *method, char *http_version, http_header_
 void build_http_response(char *http_response, int status_code, http_header_t *response_headers, int hcount) {
 	int i;
 
-	if (!(status_code == 101 || status_code == 400 || status_code == 405 || status_code == 426)) {
+	if (!(status_code == 101 || status_code == 400 || status_code == 405 || status_code == 426 || status_code == 503)) {
 		return;
 	}
 
@@ -8,13 +8,58 @@
 #include <poll.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/prctl.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <signal.h>
 
 #include "../debug/debug.h"
+#include "../utf8/utf8.h"
+#include "../tuning/tuning.h"
+#include "../affinity/affinity.h"
+#include "../pool/pool.h"
+#include "../admission/admission.h"
+#include "../latency/latency.h"
+#include "../zerocopy/zerocopy.h"
+#include "../bus/bus.h"
+#include "../capture/capture.h"
+#include "../reactor/reactor.h"
+#include "../coroutine/coroutine.h"
+#include "../spill/spill.h"
+#include "../recorder/recorder.h"
 
 #define 	MAX_CON 				10
 #define 	GUID					"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 #define 	MAX_FRAME_SIZE_RCV		0x100000
 #define 	MAX_FRAME_SIZE_SND		0x0010000
+#define 	MAX_CONTROL_PAYLOAD		125
+#define 	HANDOFF_ATTEMPTS		100
+#define 	HANDOFF_RETRY_INTERVAL	100000		// in microseconds
+#define 	LISTEN_BACKLOG			1024
+#define 	ACCEPT_BATCH			64			// connections accepted per wakeup of the listener
+#define 	MAX_LISTENERS			8			// tcp and unix domain listeners of one server
+#define 	MAX_ACCEPT_CPUS			64			// cpus of the accept role with a listener thread each, see ws_server_set_cpus
+#define 	ACCEPT_ERROR_BACKOFF	10000		// in microseconds, pause after running out of file descriptors
+#define 	CONNECTION_STACK_SIZE	0x10000		// stack of a connection thread, see ws_server_set_stack_size
+#define 	WORKER_THREADS			16			// connection threads started with the server, see ws_server_set_workers
+#define 	WORKER_IDLE_MAX			256			// idle connection threads kept for the next connections
+#define 	MESSAGE_BATCH_MAX		32			// messages handed to on_messages at once
+#define 	REPLY_QUEUE_FLUSH		0x40000		// queued replies are flushed early once they reach this size
+#define 	MAX_REACTORS			64
+#define 	COALESCE_MAX_USECS		10000		// upper bound of a coalescing window, see ws_set_coalescing
+#define 	QOS_CLASSES				3
+#define 	INLINE_SEGMENTS			4			// segments of a message held in the connection, longer chains are allocated
+#define 	FLUSH_RETRY_USECS		1000		// a reply queue the socket could not take completely is tried again this late
+#define 	BROADCAST_BACKLOG_MAX	0x400000	// queued bytes of a connection that make a broadcast close it instead
 
 enum ws_status {
 	CONNECTING 	= 1,
@@ -37,23 +82,31 @@ enum ws_message_type {
 	MESSAGE_TYPE_BIN = 0x02
 };
 
+// service classes of connections, see ws_set_qos
+enum ws_qos_class {
+	QOS_DEFAULT 		= 0,	// the server wide settings
+	QOS_LOW_LATENCY 	= 1,	// interactive clients that need short tail latencies
+	QOS_BULK 			= 2		// clients moving a lot of data that can wait
+};
+
+// where the buffer of a received message lives, it decides how the buffer is released
+enum ws_storage {
+	STORAGE_HEAP 	= 0,
+	STORAGE_POOL 	= 1,
+	STORAGE_SPILL 	= 2			// mapped spill file, see ws_server_set_spill
+};
+
 typedef struct {
 	uint16_t code;
 	char *reason;
 } websocket_status_code_t;
 
-typedef struct {
-	uint32_t fd;
-	uint32_t status;
-	uint8_t close_sent;
-	uint8_t thread_id;
-	uint8_t processed_frames;
-	struct sockaddr_storage remote_addr;
-
-	uint8_t *message;
-	uint8_t message_type;
-	uint64_t message_length;
-} ws_connection_t;
+// peer address without the padding of struct sockaddr_storage
+typedef union {
+	struct sockaddr sa;
+	struct sockaddr_in in4;
+	struct sockaddr_in6 in6;
+} ws_address_t;
 
 typedef struct {
 	uint8_t fin;
@@ -64,12 +117,167 @@ typedef struct {
 	unsigned long payload_length;	
 } ws_frame_header_t;
 
+// a buffer in the chain of a fragmented message, it holds one or more consecutive fragments
+typedef struct {
+	uint8_t *data;
+	uint64_t length;
+	uint64_t capacity;
+	uint8_t storage;				// one of the values of enum ws_storage
+} ws_segment_t;
+
+// settings of a service class, see ws_server_set_qos
+typedef struct {
+	int socket_profile;				// one of the values of enum ws_socket_profile, -1 keeps the connection's
+	uint32_t send_queue;			// unsent bytes the kernel queues per connection, 0 keeps the profile's
+	uint32_t weight;				// share of a reactor round, in multiples of the byte and frame budgets
+	int nice;						// nice value of the connection threads of the class
+	int reactor;					// index of a reactor serving only this class, -1 to share all reactors
+} ws_qos_t;
+
+// fields only needed on accept and close or for rare frames, kept off the cache lines of ws_connection_t
+typedef struct {
+	uint32_t thread_id;
+	ws_address_t remote_addr;
+	struct ws_message *batch;		// messages of the current on_messages call, NULL unless batching
+	uint32_t batch_count;
+	ws_segment_t inline_segments[INLINE_SEGMENTS];
+	uint8_t control[MAX_CONTROL_PAYLOAD];
+} ws_connection_cold_t;
+
+typedef struct ws_connection {
+	// hot fields, touched for every frame
+	uint32_t fd;
+	uint32_t processed_frames;
+	uint32_t spin_budget;			// microseconds to spin on reads before blocking, 0 for plain blocking reads
+	uint32_t capture_id;			// id in the capture log, 0 if the connection is not captured
+	uint32_t recorder_id;			// id of the connection in the flight recorder
+	uint8_t status;
+	uint8_t close_sent;
+	uint8_t socket_profile;
+	uint8_t message_type;
+	uint8_t scatter_gather;			// 1 if message stays NULL for messages of several segments, see ws_message_iov
+	uint8_t *message;				// the contiguous message, NULL while it is only held as segments
+	uint64_t message_length;
+	ws_segment_t *segments;			// buffers of the message in flight, inline_segments unless the chain grew
+	uint32_t segment_count;
+	uint32_t segment_capacity;
+	int32_t spill_fd;				// file of a message being spilled, -1 otherwise
+	utf8_state_t utf8;				// validation state of a text message, carried from fragment to fragment
+	uint64_t zerocopy_threshold;	// messages of at least this size are sent with MSG_ZEROCOPY, 0 disables it
+	zerocopy_state_t zerocopy;
+
+	// frame parser, it can stop after any byte and resume with the next read
+	ws_frame_header_t frame;
+	uint8_t parse_state;			// PARSE_HEADER or PARSE_PAYLOAD
+	uint8_t header_length;			// bytes of the frame header known to be needed so far
+	uint8_t header_received;
+	uint8_t raw_header[14];
+	uint64_t payload_received;
+
+	// reactor turn, touched whenever a reactor serves the connection
+	reactor_t *reactor;				// reactor serving the connection, NULL for a connection thread
+	reactor_entry_t reactor_entry;
+	coroutine_t *coroutine;			// coroutine running the connection on its reactor, NULL otherwise
+	uint32_t turn_frames;			// frames the coroutine completed in its current turn
+	uint8_t requeue;				// 1 if the coroutine yielded with input left, 0 if it waits for its socket
+	uint8_t qos_class;				// one of the values of enum ws_qos_class
+	uint8_t move_pending;			// 1 if the coroutine yielded at qos_move_point to move to the reactor of its class
+	struct ws_connection *wait_next;	// next coroutine parked for the same send slot, see send_wait
+
+	// send scheduling: one data message at a time, control frames between its fragments
+	pthread_mutex_t send_lock;
+	pthread_cond_t send_cond;
+	uint16_t ctrl_pending;			// control frames waiting for the socket
+	uint16_t priority_pending;		// priority messages waiting for the next message boundary
+	uint8_t frame_busy;
+	uint8_t message_busy;
+	uint8_t corked;
+	struct ws_connection *send_waiters;	// coroutines parked until the send slots are released
+	uint8_t *replies;				// frames queued by ws_queue_message, sent by ws_flush
+	uint64_t replies_length;
+	uint64_t replies_capacity;
+	uint64_t replies_partial;		// bytes at the head of the queue finishing a frame a non blocking flush cut short
+	uint32_t coalesce_usecs;		// small messages wait up to this long in the reply queue, 0 sends them right away
+	uint32_t coalesce_bytes;		// the reply queue is flushed once it holds this many bytes
+	uint64_t coalesce_deadline;		// CLOCK_MONOTONIC ns by which the queue is flushed, 0 if not scheduled
+	uint64_t messages_sent;
+	uint64_t send_started;			// recorder_now when the holder of the frame slot started waiting for it
+	uint32_t pins;					// references keeping the connection from being freed, see pin_connection
+	ws_connection_cold_t *cold;		// allocated behind the connection
+
+#ifdef LATENCY_STATS
+	struct timespec rx_timestamp;	// kernel receive time (CLOCK_REALTIME) of the first frame of the message
+	uint64_t read_start;
+	uint64_t message_complete;
+#endif
+} ws_connection_t;
+
+// a complete message handed to on_messages, the buffer is released after the callback returns
+typedef struct ws_message {
+	uint8_t *data;
+	uint64_t length;
+	uint8_t type;
+	uint8_t storage;
+} ws_message_t;
+
+// produces the next chunk of a message for send_ws_message_pull
+typedef ssize_t (*ws_pull_callback_t)(void *context, uint8_t *buffer, size_t size);
+
+// gives the buffer of send_ws_message_zerocopy back to the application
+typedef zerocopy_release_t ws_release_callback_t;
+
 
 int ws_server(char *host_address, char *port);
+int ws_server_listen(char *host_address, char *port, int profile);
+int ws_server_listen_unix(char *path, int profile);
+void ws_server_set_socket_profile(int profile);
+int ws_server_set_cpus(int role, char *cpu_list);
+void ws_server_set_stack_size(size_t stack_size);
+int ws_server_set_workers(int threads, int max_idle);
+void ws_server_set_backlog(int backlog);
+void ws_server_set_zerocopy(uint64_t threshold);
+int ws_server_set_busy_poll(uint32_t spin_usecs, char *cpu_list);
+void ws_server_set_fragment_size(uint32_t size);
+void ws_server_fragment_report(FILE *out);
+void ws_server_set_coalescing(uint32_t usecs, uint32_t bytes);
+int ws_server_set_reactor(int threads, uint32_t byte_budget, uint32_t frame_budget);
+int ws_server_set_coroutines(int threads, uint32_t byte_budget, uint32_t frame_budget);
+void ws_server_coalescing_report(FILE *out);
+void ws_server_set_scatter_gather(int on);
+int ws_server_set_qos(int qos_class, ws_qos_t *qos);
+void ws_server_set_qos_header(char *header);
+int ws_server_set_spill(uint64_t threshold, uint64_t max_message, uint64_t budget, char *directory);
+void ws_server_spill_report(FILE *out);
+void ws_server_set_admission(int max_connections, int max_per_address, int policy);
+int ws_server_latency_report(FILE *out);
+int ws_server_set_capture(char *path, size_t file_size, int files, int sample_rate);
+void ws_server_set_recorder(char *prefix);
+int ws_server_inherit(char *socket_path);
+int ws_server_shards(char *host_address, char *port, int shards);
+int ws_server_embed(char *host_address, char *port);
+int ws_server_fd(void);
+int ws_server_process(int budget);
+int ws_server_handoff(char *socket_path);
+void ws_server_stop(void);
+int ws_server_drain(uint16_t close_code, int batch_size, int batch_interval, int deadline);
 ws_connection_t *accept_ws_connection(void);
 
 // "user" space functions
 void on_message(ws_connection_t *);
 void on_connection(ws_connection_t *);
+void on_messages(ws_connection_t *, ws_message_t *messages, int count) __attribute__((weak));
 int send_ws_message_txt(ws_connection_t *, uint8_t *bytes, uint64_t length);
 int send_ws_message_bin(ws_connection_t *, uint8_t *bytes, uint64_t length);
+int send_ws_message_fd(ws_connection_t *, int fd, off_t offset, uint64_t length);
+int send_ws_message_pull(ws_connection_t *, ws_pull_callback_t pull, void *context);
+int send_ws_message_zerocopy(ws_connection_t *, uint8_t *bytes, uint64_t length, uint8_t message_type, ws_release_callback_t release, void *context);
+int send_ws_message_priority(ws_connection_t *, uint8_t *bytes, uint64_t length, uint8_t message_type);
+int ws_queue_message(ws_connection_t *, uint8_t *bytes, uint64_t length, uint8_t message_type);
+int ws_flush(ws_connection_t *);
+int ws_broadcast(uint8_t *bytes, uint64_t length, uint8_t message_type);
+int ws_set_socket_profile(ws_connection_t *, int profile);
+int ws_set_zerocopy(ws_connection_t *, uint64_t threshold);
+void ws_set_coalescing(ws_connection_t *, uint32_t usecs, uint32_t bytes);
+int ws_set_qos(ws_connection_t *, int qos_class);
+int ws_message_iov(ws_connection_t *, struct iovec *iov, int count);
+uint8_t *ws_message_flatten(ws_connection_t *);
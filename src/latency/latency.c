@@ -0,0 +1,205 @@
+/***************************************************************************//**
+
+  @file         latency.c
+
+  @author       Robert Eikmanns
+
+  @date         Monday, 19 October 2026
+
+  @brief        Per stage latency histograms with logarithmic buckets (HDR style) and 
+                kernel receive timestamps (SO_TIMESTAMPING)
+
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+#include "latency.h"
+
+static uint64_t histograms[STAGE_COUNT][LATENCY_BUCKETS];
+
+static char *stage_names[STAGE_COUNT] = {
+	"queue", "parse", "utf8", "dispatch", "handler", "send"
+};
+
+/**
+ *  @brief                  monotonic time in nanoseconds
+ */
+uint64_t 
+latency_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int 
+bucket_index(uint64_t value) {
+	int shift;
+
+	if (value < (1 << LATENCY_SUB_BUCKET_BITS)) {
+		return value;
+	}
+
+	shift = 63 - __builtin_clzll(value) - LATENCY_SUB_BUCKET_BITS;
+
+	return ((shift + 1) << LATENCY_SUB_BUCKET_BITS) + ((value >> shift) & ((1 << LATENCY_SUB_BUCKET_BITS) - 1));
+}
+
+static uint64_t 
+bucket_value(int index) {
+	int shift;
+
+	if (index < (1 << LATENCY_SUB_BUCKET_BITS)) {
+		return index;
+	}
+
+	shift = (index >> LATENCY_SUB_BUCKET_BITS) - 1;
+
+	// middle of the bucket
+	return (((uint64_t) (1 << LATENCY_SUB_BUCKET_BITS) + (index & ((1 << LATENCY_SUB_BUCKET_BITS) - 1))) << shift) 
+		+ ((1ULL << shift) >> 1);
+}
+
+/**
+ *  @brief                  add a sample to the histogram of a stage. Safe to call from any thread
+ *
+ *  @param stage            one of the values of enum latency_stage
+ *  @param nanoseconds      the measured duration
+ */
+void 
+latency_record(int stage, uint64_t nanoseconds) {
+	// a clock step between two stamps must not land in the last bucket
+	if ((int64_t) nanoseconds < 0) {
+		nanoseconds = 0;
+	}
+
+	__atomic_fetch_add(&histograms[stage][bucket_index(nanoseconds)], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ *  @brief                  let the kernel stamp every received packet of a socket
+ *
+ *  @param fd               the socket
+ *  @return                 0 if successful, or -1 in case of an error
+ */
+int 
+latency_enable_timestamps(int fd) {
+	int flags;
+
+	flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+	return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+}
+
+/**
+ *  @brief                  fetch the kernel receive timestamp of the next queued byte without consuming it. Never 
+ *							waits for data, a blocking peek would hold up the busy poll of the following read
+ *
+ *  @param fd               socket with enabled timestamps
+ *  @param ts               receives the timestamp (CLOCK_REALTIME), zeroed if nothing is queued or the kernel 
+ *							delivered none
+ */
+void 
+latency_rx_timestamp(int fd, struct timespec *ts) {
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	struct scm_timestamping *stamps;
+	char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+	uint8_t byte;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(ts, 0, sizeof(struct timespec));
+
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	if (recvmsg(fd, &msg, MSG_PEEK | MSG_DONTWAIT) <= 0) {
+		return;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+			stamps = (struct scm_timestamping *) CMSG_DATA(cmsg);
+			*ts = stamps->ts[0];
+			break;
+		}
+	}
+}
+
+/**
+ *  @brief                  record the time a message spent in the kernel since its receive timestamp
+ *
+ *  @param ts               timestamp fetched with latency_rx_timestamp, ignored if zero
+ */
+void 
+latency_record_queue(struct timespec *ts) {
+	struct timespec now;
+
+	if (ts->tv_sec == 0 && ts->tv_nsec == 0) {
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	latency_record(STAGE_QUEUE, (uint64_t) (now.tv_sec - ts->tv_sec) * 1000000000 + now.tv_nsec - ts->tv_nsec);
+}
+
+/**
+ *  @brief                  print count, percentiles and maximum of every stage
+ *
+ *  @param out              the stream to print to
+ */
+void 
+latency_report(FILE *out) {
+	double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	uint64_t count, seen, values[4], max;
+	int next;
+
+	fprintf(out, "%-10s %10s %10s %10s %10s %10s %10s  (ns)\n", "stage", "count", "p50", "p90", "p99", "p999", "max");
+
+	for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+		count = 0;
+		for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+			count += __atomic_load_n(&histograms[stage][i], __ATOMIC_RELAXED);
+		}
+
+		if (count == 0) {
+			continue;
+		}
+
+		seen = 0;
+		next = 0;
+		max = 0;
+		for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+			uint64_t bucket = __atomic_load_n(&histograms[stage][i], __ATOMIC_RELAXED);
+			if (bucket == 0) {
+				continue;
+			}
+
+			seen += bucket;
+			max = bucket_value(i);
+
+			while (next < 4 && seen >= count * percentiles[next]) {
+				values[next++] = max;
+			}
+		}
+
+		while (next < 4) {
+			values[next++] = max;
+		}
+
+		fprintf(out, "%-10s %10lu %10lu %10lu %10lu %10lu %10lu\n", stage_names[stage], count, 
+			values[0], values[1], values[2], values[3], max);
+	}
+}
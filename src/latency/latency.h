@@ -0,0 +1,57 @@
+/***************************************************************************//**
+
+  @file         latency.h
+
+  @author       Robert Eikmanns
+
+  @date         Monday, 19 October 2026
+
+  @brief        Declarations for per stage latency histograms. Everything compiles 
+                to nothing unless LATENCY_STATS is defined (make stats)
+
+*******************************************************************************/
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define 	LATENCY_SUB_BUCKET_BITS		4		// 16 linear sub buckets per power of two, about 6 % precision
+#define 	LATENCY_BUCKETS				(64 << LATENCY_SUB_BUCKET_BITS)
+
+enum latency_stage {
+	STAGE_QUEUE 	= 0,	// kernel receive timestamp until the server reads the frame header
+	STAGE_PARSE 	= 1,	// first header byte read until the last frame of the message is complete
+	STAGE_UTF8 		= 2,	// validation of text messages
+	STAGE_DISPATCH 	= 3,	// message complete until the handler starts
+	STAGE_HANDLER 	= 4,	// on_message
+	STAGE_SEND 		= 5,	// send_ws_message_* until the last byte has been handed to the kernel
+	STAGE_COUNT 	= 6
+};
+
+#ifdef LATENCY_STATS
+    #define LATENCY_DECLARE(var)					uint64_t var
+    #define LATENCY_NOW(var)						var = latency_now()
+    #define LATENCY_RECORD(stage, start, end)		latency_record(stage, (end) - (start))
+    #define LATENCY_ENABLE_TIMESTAMPS(fd)			latency_enable_timestamps(fd)
+    #define LATENCY_RX_TIMESTAMP(fd, ts)			latency_rx_timestamp(fd, ts)
+    #define LATENCY_RECORD_QUEUE(ts)				latency_record_queue(ts)
+#else
+    #define LATENCY_DECLARE(var)					// do nothing
+    #define LATENCY_NOW(var)						// do nothing
+    #define LATENCY_RECORD(stage, start, end)		// do nothing
+    #define LATENCY_ENABLE_TIMESTAMPS(fd)			// do nothing
+    #define LATENCY_RX_TIMESTAMP(fd, ts)			// do nothing
+    #define LATENCY_RECORD_QUEUE(ts)				// do nothing
+#endif
+
+uint64_t latency_now(void);
+void latency_record(int stage, uint64_t nanoseconds);
+int latency_enable_timestamps(int fd);
+void latency_rx_timestamp(int fd, struct timespec *ts);
+void latency_record_queue(struct timespec *ts);
+void latency_report(FILE *out);
+
+#endif
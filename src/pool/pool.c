@@ -0,0 +1,199 @@
+/***************************************************************************//**
+
+  @file         pool.c
+
+  @author       Robert Eikmanns
+
+  @date         Monday, 19 October 2026
+
+  @brief        Pool of fixed size receive buffers. Connections only hold a buffer
+                while a message is in flight, idle connections hold none. Every thread
+                keeps a few buffers of its numa node without locking, the rest wait in
+                a list per node, so a buffer first touched on one node is never handed
+                to a thread running on another one
+
+*******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+// in front of every buffer, keeps the buffer itself aligned like malloc does
+typedef struct {
+	int node;						// numa node of the thread that allocated the buffer
+	int pad[3];
+} pool_header_t;
+
+typedef struct pool_buffer {
+	struct pool_buffer *next;
+} pool_buffer_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pool_buffer_t *free_list;
+	int free_count;
+} pool_node_t;
+
+static pool_node_t nodes[POOL_NODES];
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+
+static __thread pool_buffer_t *cache = NULL;
+static __thread int cache_count = 0;
+static __thread int cache_node = -1;
+
+static void pool_init(void);
+static int current_node(void);
+static void node_put(int node, pool_buffer_t *buffer);
+static void release_cache(void *unused);
+
+/**
+ *  @brief                  take a buffer of POOL_BUFFER_SIZE bytes from the pool
+ *
+ *  @return                 pointer to the buffer, or NULL if no memory is available
+ */
+void *
+pool_get(void) {
+	pool_buffer_t *buffer;
+	pool_header_t *header;
+	pool_node_t *pool_node;
+	int node;
+
+	node = current_node();
+
+	if (cache != NULL && cache_node == node) {
+		buffer = cache;
+		cache = buffer->next;
+		cache_count--;
+		return buffer;
+	}
+
+	pthread_once(&pool_once, pool_init);
+	pool_node = &nodes[node];
+
+	pthread_mutex_lock(&pool_node->lock);
+	buffer = pool_node->free_list;
+	if (buffer != NULL) {
+		pool_node->free_list = buffer->next;
+		pool_node->free_count--;
+	}
+	pthread_mutex_unlock(&pool_node->lock);
+
+	if (buffer != NULL) {
+		return buffer;
+	}
+
+	// first touched by this thread, so its pages come from this node
+	header = (pool_header_t *) malloc(sizeof(pool_header_t) + POOL_BUFFER_SIZE);
+	if (header == NULL) {
+		return NULL;
+	}
+
+	header->node = node;
+
+	return header + 1;
+}
+
+/**
+ *  @brief                  return a buffer taken with pool_get. It goes to the cache of the calling thread if
+ *                          that holds buffers of the same node, else to the list of its node
+ *
+ *  @param buffer           the buffer, may be NULL
+ */
+void
+pool_put(void *buffer) {
+	pool_buffer_t *pool_buffer;
+	int node;
+
+	if (buffer == NULL) {
+		return;
+	}
+
+	pool_buffer = (pool_buffer_t *) buffer;
+	node = ((pool_header_t *) buffer - 1)->node;
+
+	// the first buffer of a thread registers its cache, it is emptied when the thread exits
+	if (cache_node == -1) {
+		pthread_once(&pool_once, pool_init);
+		pthread_setspecific(cache_key, &cache);
+	}
+
+	if (cache == NULL) {
+		cache_node = node;
+	}
+
+	if (cache_node == node && cache_count < POOL_CACHE) {
+		pool_buffer->next = cache;
+		cache = pool_buffer;
+		cache_count++;
+		return;
+	}
+
+	node_put(node, pool_buffer);
+}
+
+static void
+pool_init(void) {
+	for (int i = 0; i < POOL_NODES; ++i) {
+		pthread_mutex_init(&nodes[i].lock, NULL);
+	}
+
+	pthread_key_create(&cache_key, release_cache);
+}
+
+/**
+ *  @brief                  the numa node the calling thread runs on, getcpu is answered by the vdso
+ */
+static int
+current_node(void) {
+	unsigned int cpu, node;
+
+	if (getcpu(&cpu, &node) == -1) {
+		return 0;
+	}
+
+	return node % POOL_NODES;
+}
+
+/**
+ *  @brief                  put a buffer into the list of its node, or give it back to the allocator if the
+ *                          list is full
+ */
+static void
+node_put(int node, pool_buffer_t *buffer) {
+	pool_node_t *pool_node;
+
+	pool_node = &nodes[node];
+
+	pthread_mutex_lock(&pool_node->lock);
+	if (pool_node->free_count < POOL_MAX_FREE) {
+		buffer->next = pool_node->free_list;
+		pool_node->free_list = buffer;
+		pool_node->free_count++;
+		buffer = NULL;
+	}
+	pthread_mutex_unlock(&pool_node->lock);
+
+	if (buffer != NULL) {
+		free((pool_header_t *) buffer - 1);
+	}
+}
+
+/**
+ *  @brief                  hand the cache of an exiting thread to the list of its node
+ */
+static void
+release_cache(void *unused) {
+	pool_buffer_t *buffer;
+
+	while ((buffer = cache) != NULL) {
+		cache = buffer->next;
+		node_put(cache_node, buffer);
+	}
+
+	cache_count = 0;
+}
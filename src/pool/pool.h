@@ -0,0 +1,24 @@
+/***************************************************************************//**
+
+  @file         pool.h
+
+  @author       Robert Eikmanns
+
+  @date         Monday, 19 October 2026
+
+  @brief        Declarations for the receive buffer pool
+
+*******************************************************************************/
+
+#ifndef POOL_H
+#define POOL_H
+
+#define 	POOL_BUFFER_SIZE	0x1000		// size of a pooled buffer, larger messages are allocated directly
+#define 	POOL_MAX_FREE		1024		// free buffers kept per numa node, the rest is given back to the allocator
+#define 	POOL_CACHE			32			// free buffers a thread keeps for itself
+#define 	POOL_NODES			8			// numa nodes with a list of their own, higher nodes share them
+
+void *pool_get(void);
+void pool_put(void *buffer);
+
+#endif
@@ -0,0 +1,337 @@
+/***************************************************************************//**
+
+  @file         reactor.c
+
+  @author       Robert Eikmanns
+
+  @date         Monday, 19 October 2026
+
+  @brief        epoll reactor serving its sockets by deficit round robin. Sockets with pending 
+                input wait in a ready list, each turn adds a quantum of bytes to the deficit of 
+                the socket at its head. A socket that used up its deficit before its input was 
+                drained goes to the back of the list, so a client streaming big frames gets the 
+                same share of a round as one sending small messages. Other threads put entries 
+                into the ready list through the doorbell of the reactor
+
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "reactor.h"
+
+static void reactor_append(reactor_t *reactor, reactor_entry_t *entry);
+static void reactor_answer(reactor_t *reactor);
+
+/**
+ *  @brief                  create the epoll instance of a reactor and its doorbell
+ *
+ *  @param reactor          the reactor
+ *  @param quantum          bytes added to the deficit of a ready socket per round and unit of its weight
+ *  @return                 0 if successful, or -1 if epoll_create1 or eventfd failed
+ */
+int 
+reactor_init(reactor_t *reactor, uint32_t quantum) {
+	struct epoll_event event;
+
+	reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (reactor->epoll_fd == -1) {
+		perror("epoll_create1 error");
+		return -1;
+	}
+
+	reactor->bell_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (reactor->bell_fd == -1) {
+		perror("eventfd error");
+		close(reactor->epoll_fd);
+		return -1;
+	}
+
+	// the doorbell is told apart from the entries by the reactor itself as its data
+	event.events = EPOLLIN;
+	event.data.ptr = reactor;
+
+	if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->bell_fd, &event) == -1) {
+		perror("epoll_ctl error");
+		close(reactor->bell_fd);
+		close(reactor->epoll_fd);
+		return -1;
+	}
+
+	reactor->quantum = quantum;
+	reactor->ready_count = 0;
+	reactor->head = NULL;
+	reactor->tail = NULL;
+	reactor->bell_head = NULL;
+	pthread_mutex_init(&reactor->bell_lock, NULL);
+
+	return 0;
+}
+
+/**
+ *  @brief                  watch a socket for input. May be called from any thread
+ *
+ *  @param reactor          the reactor
+ *  @param fd               the socket
+ *  @param entry            ready list entry of the socket, valid until reactor_remove
+ *  @param owner            the object served, handed back through entry->owner
+ *  @return                 0 if successful, or -1 if epoll_ctl failed
+ */
+int 
+reactor_add(reactor_t *reactor, int fd, reactor_entry_t *entry, void *owner) {
+	struct epoll_event event;
+
+	entry->owner = owner;
+	entry->next = NULL;
+	entry->deficit = 0;
+	entry->ready = 0;
+	entry->rung = 0;
+	entry->bell_next = NULL;
+
+	event.events = EPOLLIN | EPOLLRDHUP;
+	event.data.ptr = entry;
+
+	if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+		perror("epoll_ctl error");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ *  @brief                  change the events a socket is watched for, e.g. EPOLLOUT while a send waits for room
+ *
+ *  @param reactor          the reactor
+ *  @param fd               the socket
+ *  @param entry            ready list entry of the socket
+ *  @param events           EPOLLIN, EPOLLOUT or both
+ *  @return                 0 if successful, or -1 if epoll_ctl failed
+ */
+int 
+reactor_modify(reactor_t *reactor, int fd, reactor_entry_t *entry, uint32_t events) {
+	struct epoll_event event;
+
+	event.events = events | EPOLLRDHUP;
+	event.data.ptr = entry;
+
+	return epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+}
+
+/**
+ *  @brief                  watch one more socket on behalf of an entry that is served already, e.g. for a coroutine 
+ *                          waiting for the socket of another connection. The entry keeps its place and credit, 
+ *                          reactor_remove ends the watch. Only called by the reactor thread during the turn of 
+ *                          the entry
+ *
+ *  @param reactor          the reactor
+ *  @param fd               the socket, epoll tells sockets apart by descriptor, so a dup of a watched one works
+ *  @param entry            the entry made ready by the socket
+ *  @param events           EPOLLIN, EPOLLOUT or both
+ *  @return                 0 if successful, or -1 if epoll_ctl failed
+ */
+int 
+reactor_watch(reactor_t *reactor, int fd, reactor_entry_t *entry, uint32_t events) {
+	struct epoll_event event;
+
+	event.events = events | EPOLLRDHUP;
+	event.data.ptr = entry;
+
+	return epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/**
+ *  @brief                  stop watching a socket. Only called by the reactor thread while the entry is not in 
+ *                          the ready list, i.e. during its turn
+ */
+void 
+reactor_remove(reactor_t *reactor, int fd) {
+	epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/**
+ *  @brief                  append the sockets with new input to the ready list
+ *
+ *  @param reactor          the reactor
+ *  @param block            1 to block while the ready list is empty, 0 to never block
+ *  @return                 the length of the ready list, or -1 if epoll_wait failed
+ */
+int 
+reactor_wait(reactor_t *reactor, int block) {
+	struct epoll_event events[REACTOR_EVENTS];
+	reactor_entry_t *entry;
+	int count;
+
+	count = epoll_wait(reactor->epoll_fd, events, REACTOR_EVENTS, (block && reactor->head == NULL) ? -1 : 0);
+	if (count == -1) {
+		return -1;
+	}
+
+	// level triggered, sockets still in the list from the last round show up again and are skipped
+	for (int i = 0; i < count; ++i) {
+		if (events[i].data.ptr == reactor) {
+			reactor_answer(reactor);
+			continue;
+		}
+
+		entry = (reactor_entry_t *) events[i].data.ptr;
+		if (!entry->ready) {
+			entry->ready = 1;
+			reactor_append(reactor, entry);
+		}
+	}
+
+	return reactor->ready_count;
+}
+
+/**
+ *  @brief                  take the socket at the head of the ready list and grant it its quanta of this round
+ *
+ *  @return                 the entry, or NULL if the ready list is empty
+ */
+reactor_entry_t *
+reactor_next(reactor_t *reactor) {
+	reactor_entry_t *entry;
+
+	entry = reactor->head;
+	if (entry == NULL) {
+		return NULL;
+	}
+
+	reactor->head = entry->next;
+	if (reactor->head == NULL) {
+		reactor->tail = NULL;
+	}
+	reactor->ready_count--;
+
+	entry->next = NULL;
+	entry->deficit += (int64_t) reactor->quantum * entry->weight;
+
+	return entry;
+}
+
+/**
+ *  @brief                  end the turn of a socket. It goes to the back of the ready list if its input may not 
+ *                          be drained yet and leaves it otherwise, until epoll reports new input
+ *
+ *  @param reactor          the reactor
+ *  @param entry            the entry returned by reactor_next
+ *  @param pending          1 if the socket stopped because its budget ran out, 0 if it has no more input
+ */
+void 
+reactor_requeue(reactor_t *reactor, reactor_entry_t *entry, int pending) {
+	if (!pending) {
+		// an idle socket saves no credit for later bursts
+		entry->deficit = 0;
+		entry->ready = 0;
+		return;
+	}
+
+	// credit left by the frame budget carries over, but never more than one round's worth
+	if (entry->deficit > (int64_t) reactor->quantum * entry->weight) {
+		entry->deficit = (int64_t) reactor->quantum * entry->weight;
+	}
+
+	reactor_append(reactor, entry);
+}
+
+/**
+ *  @brief                  put a socket into the ready list without new input, e.g. to hand work to its owner. 
+ *                          Only called by the reactor thread outside of the turn of the socket
+ */
+void 
+reactor_wake(reactor_t *reactor, reactor_entry_t *entry) {
+	if (!entry->ready) {
+		entry->ready = 1;
+		reactor_append(reactor, entry);
+	}
+}
+
+/**
+ *  @brief                  put an entry into the ready list from any thread, e.g. to resume a coroutine parked 
+ *                          until another thread releases what it waits for. Wakes the reactor if it sleeps
+ *
+ *  @param reactor          the reactor serving the entry
+ *  @param entry            the entry, it must stay valid until its turn or reactor_forget
+ */
+void 
+reactor_ring(reactor_t *reactor, reactor_entry_t *entry) {
+	uint64_t one = 1;
+	int first;
+
+	pthread_mutex_lock(&reactor->bell_lock);
+	first = (reactor->bell_head == NULL);
+	if (!entry->rung) {
+		entry->rung = 1;
+		entry->bell_next = reactor->bell_head;
+		reactor->bell_head = entry;
+	}
+	pthread_mutex_unlock(&reactor->bell_lock);
+
+	// a list that wasn't empty has rung already and will be taken as a whole
+	if (first && write(reactor->bell_fd, &one, sizeof(one)) == -1) {
+		perror("eventfd write error");
+	}
+}
+
+/**
+ *  @brief                  take an entry out of the doorbell list before it is freed or served by another reactor. 
+ *                          Only called by the reactor thread
+ */
+void 
+reactor_forget(reactor_t *reactor, reactor_entry_t *entry) {
+	reactor_entry_t **link;
+
+	pthread_mutex_lock(&reactor->bell_lock);
+	if (entry->rung) {
+		for (link = &reactor->bell_head; *link != NULL; link = &(*link)->bell_next) {
+			if (*link == entry) {
+				*link = entry->bell_next;
+				break;
+			}
+		}
+		entry->rung = 0;
+	}
+	pthread_mutex_unlock(&reactor->bell_lock);
+}
+
+/**
+ *  @brief                  move the entries rung by other threads into the ready list
+ */
+static void 
+reactor_answer(reactor_t *reactor) {
+	reactor_entry_t *entry;
+	uint64_t count;
+
+	// read first, an entry rung after the read is either in the list taken below or rings again
+	if (read(reactor->bell_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+		perror("eventfd read error");
+	}
+
+	pthread_mutex_lock(&reactor->bell_lock);
+	while ((entry = reactor->bell_head) != NULL) {
+		reactor->bell_head = entry->bell_next;
+		entry->rung = 0;
+		reactor_wake(reactor, entry);
+	}
+	pthread_mutex_unlock(&reactor->bell_lock);
+}
+
+static void 
+reactor_append(reactor_t *reactor, reactor_entry_t *entry) {
+	entry->next = NULL;
+
+	if (reactor->tail == NULL) {
+		reactor->head = entry;
+	} else {
+		reactor->tail->next = entry;
+	}
+
+	reactor->tail = entry;
+	reactor->ready_count++;
+}
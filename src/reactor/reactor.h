@@ -0,0 +1,57 @@
+/***************************************************************************//**
+
+  @file         reactor.h
+
+  @author       Robert Eikmanns
+
+  @date         Monday, 19 October 2026
+
+  @brief        Declarations for the epoll reactor with deficit round robin
+
+*******************************************************************************/
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define 	REACTOR_EVENTS			256			// events taken from epoll per wakeup
+#define 	REACTOR_BYTE_BUDGET		0x4000		// default bytes a connection may read per turn
+#define 	REACTOR_FRAME_BUDGET	16			// default frames a connection may complete per turn
+
+// place of a socket in the ready list of its reactor, embedded in the object served
+typedef struct reactor_entry {
+	void *owner;
+	struct reactor_entry *next;
+	int64_t deficit;				// bytes the entry may still read in the current round
+	uint32_t weight;				// quanta granted per round, set by the owner and kept by reactor_add
+	uint8_t ready;					// 1 while the entry is in the ready list
+	uint8_t rung;					// 1 while the entry waits in the doorbell list
+	struct reactor_entry *bell_next;
+} reactor_entry_t;
+
+typedef struct {
+	int epoll_fd;
+	uint32_t quantum;				// bytes added to the deficit of an entry per round
+	uint32_t ready_count;
+	reactor_entry_t *head;
+	reactor_entry_t *tail;
+	int bell_fd;					// eventfd other threads wake the reactor with, see reactor_ring
+	pthread_mutex_t bell_lock;
+	reactor_entry_t *bell_head;		// entries rung since the last reactor_wait
+} reactor_t;
+
+int reactor_init(reactor_t *reactor, uint32_t quantum);
+int reactor_add(reactor_t *reactor, int fd, reactor_entry_t *entry, void *owner);
+int reactor_modify(reactor_t *reactor, int fd, reactor_entry_t *entry, uint32_t events);
+int reactor_watch(reactor_t *reactor, int fd, reactor_entry_t *entry, uint32_t events);
+void reactor_remove(reactor_t *reactor, int fd);
+void reactor_ring(reactor_t *reactor, reactor_entry_t *entry);
+void reactor_forget(reactor_t *reactor, reactor_entry_t *entry);
+int reactor_wait(reactor_t *reactor, int block);
+reactor_entry_t *reactor_next(reactor_t *reactor);
+void reactor_requeue(reactor_t *reactor, reactor_entry_t *entry, int pending);
+void reactor_wake(reactor_t *reactor, reactor_entry_t *entry);
+
+#endif
@@ -0,0 +1,285 @@
+/***************************************************************************//**
+
+  @file         recorder.c
+
+  @author       Robert Eikmanns
+
+  @date         Monday, 19 October 2026
+
+  @brief        Flight recorder: every thread appends fixed size records to its own ring in a shared
+                memory object (/dev/shm/<name>), without locks or system calls. The object outlives a
+                crash, testing/flight_dump.py reads it from a running or a dead server
+
+*******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "recorder.h"
+
+#define 	CALIBRATION_USECS	10000
+
+recorder_header_t *recorder_header = NULL;
+__thread recorder_ring_t *recorder_ring = NULL;
+static __thread void *signal_stack = NULL;
+
+static char recorder_name[64];
+static uint32_t recorder_connections = 0;
+static pthread_key_t recorder_key;
+static pthread_key_t stack_key;
+static const int crash_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+static struct sigaction previous_actions[sizeof(crash_signals) / sizeof(int)];
+
+static void calibrate(void);
+static void release_ring(void *ring);
+static void release_signal_stack(void *stack);
+static void crash_handler(int sig, siginfo_t *info, void *context);
+
+/**
+ *  @brief                  create the shared memory object and start recording. It is removed again by
+ *                          recorder_close or at exit, unless the process crashed
+ *
+ *  @param name             name of the object, starting with a slash, e.g. "/wsserver.<pid>"
+ *  @return                 0 if successful, or -1 in case of an error
+ */
+int
+recorder_open(const char *name) {
+	struct sigaction action;
+	recorder_ring_t *ring;
+	size_t size;
+	int fd;
+
+	if (recorder_header != NULL || strlen(name) >= sizeof(recorder_name)) {
+		return -1;
+	}
+
+	size = sizeof(recorder_header_t) + RECORDER_RINGS * sizeof(recorder_ring_t);
+
+	// the pages of rings no thread ever takes are never allocated
+	fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		perror("recorder open error");
+		return -1;
+	}
+
+	if (ftruncate(fd, size) == -1) {
+		perror("recorder truncate error");
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+
+	recorder_header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (recorder_header == MAP_FAILED) {
+		perror("recorder mmap error");
+		recorder_header = NULL;
+		shm_unlink(name);
+		return -1;
+	}
+
+	if (pthread_key_create(&recorder_key, release_ring) != 0 
+		|| pthread_key_create(&stack_key, release_signal_stack) != 0) {
+		munmap(recorder_header, size);
+		recorder_header = NULL;
+		shm_unlink(name);
+		return -1;
+	}
+
+	strcpy(recorder_name, name);
+	recorder_header->rings = RECORDER_RINGS;
+	recorder_header->slots = RECORDER_SLOTS;
+	recorder_header->pid = getpid();
+	calibrate();
+
+	ring = (recorder_ring_t *) (recorder_header + 1) + RECORDER_RINGS - 1;
+	ring->shared = 1;
+
+	// the magic comes last, a reader never sees a half initialized header
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(recorder_header->magic, RECORDER_MAGIC, sizeof(recorder_header->magic));
+
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = crash_handler;
+	action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+	sigemptyset(&action.sa_mask);
+
+	for (int i = 0; i < sizeof(crash_signals) / sizeof(int); ++i) {
+		sigaction(crash_signals[i], &action, &previous_actions[i]);
+	}
+
+	atexit(recorder_close);
+	recorder_signal_stack();
+
+	return 0;
+}
+
+/**
+ *  @brief                  remove the shared memory object. The mapping stays, threads still running keep
+ *                          recording into it until the process exits
+ */
+void
+recorder_close(void) {
+	if (recorder_header != NULL && recorder_header->crash_signal == 0 && recorder_name[0] != '\0') {
+		shm_unlink(recorder_name);
+		recorder_name[0] = '\0';
+	}
+}
+
+/**
+ *  @brief                  hand out the id of a new connection
+ *
+ *  @return                 an id unique within the server run, never 0
+ */
+uint32_t
+recorder_connection(void) {
+	return __atomic_add_fetch(&recorder_connections, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ *  @brief                  take a free ring for the calling thread, it is given back when the thread exits. Once
+ *                          all rings are taken the thread writes to the shared last ring
+ *
+ *  @return                 the ring, or NULL if the recorder is off
+ */
+recorder_ring_t *
+recorder_attach(void) {
+	recorder_ring_t *rings;
+	uint32_t tid, owner;
+
+	if (recorder_header == NULL) {
+		return NULL;
+	}
+
+	rings = (recorder_ring_t *) (recorder_header + 1);
+	tid = syscall(SYS_gettid);
+
+	for (int i = 0; i < RECORDER_RINGS - 1; ++i) {
+		owner = 0;
+		if (__atomic_load_n(&rings[i].owner, __ATOMIC_RELAXED) == 0
+			&& __atomic_compare_exchange_n(&rings[i].owner, &owner, tid, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			pthread_setspecific(recorder_key, &rings[i]);
+			recorder_ring = &rings[i];
+			recorder_signal_stack();
+			return recorder_ring;
+		}
+	}
+
+	recorder_ring = &rings[RECORDER_RINGS - 1];
+	recorder_signal_stack();
+
+	return recorder_ring;
+}
+
+/**
+ *  @brief                  give the calling thread an alternate stack for the crash handler, so an overflow of 
+ *                          its own stack is still recorded. It is freed when the thread exits. Does nothing if 
+ *                          the recorder is off or the thread has one already
+ *
+ *  @return                 0 if successful, or -1 in case of an error
+ */
+int
+recorder_signal_stack(void) {
+	stack_t stack;
+
+	if (recorder_header == NULL || signal_stack != NULL) {
+		return 0;
+	}
+
+	stack.ss_sp = mmap(NULL, RECORDER_SIGNAL_STACK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (stack.ss_sp == MAP_FAILED) {
+		perror("recorder signal stack error");
+		return -1;
+	}
+
+	stack.ss_size = RECORDER_SIGNAL_STACK;
+	stack.ss_flags = 0;
+
+	if (sigaltstack(&stack, NULL) == -1) {
+		perror("recorder sigaltstack error");
+		munmap(stack.ss_sp, RECORDER_SIGNAL_STACK);
+		return -1;
+	}
+
+	signal_stack = stack.ss_sp;
+	pthread_setspecific(stack_key, signal_stack);
+
+	return 0;
+}
+
+/**
+ *  @brief                  relate the ticks of recorder_now to CLOCK_REALTIME, the dump tool converts the
+ *                          timestamps of the records with it
+ */
+static void
+calibrate(void) {
+	struct timespec start, end;
+	uint64_t tsc_start, tsc_end, ns;
+
+	clock_gettime(CLOCK_REALTIME, &start);
+	tsc_start = recorder_now();
+	usleep(CALIBRATION_USECS);
+	clock_gettime(CLOCK_REALTIME, &end);
+	tsc_end = recorder_now();
+
+	ns = (end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+
+	recorder_header->tsc_base = tsc_start;
+	recorder_header->realtime_base = (uint64_t) start.tv_sec * 1000000000 + start.tv_nsec;
+	recorder_header->ticks_per_ns = (ns > 0 && tsc_end > tsc_start) ? (double) (tsc_end - tsc_start) / ns : 1.0;
+}
+
+static void
+release_ring(void *ring) {
+	recorder_ring = NULL;
+	__atomic_store_n(&((recorder_ring_t *) ring)->owner, 0, __ATOMIC_RELEASE);
+}
+
+static void
+release_signal_stack(void *memory) {
+	stack_t stack;
+
+	memset(&stack, 0, sizeof(stack));
+	stack.ss_flags = SS_DISABLE;
+	sigaltstack(&stack, NULL);
+
+	signal_stack = NULL;
+	munmap(memory, RECORDER_SIGNAL_STACK);
+}
+
+/**
+ *  @brief                  record the fatal signal and keep the object for the dump tool, then die of the
+ *                          signal with the handler that was installed before. A thread without a ring writes 
+ *                          to the shared one, taking a ring is not async signal safe
+ */
+static void
+crash_handler(int sig, siginfo_t *info, void *context) {
+	recorder_ring_t *ring;
+
+	ring = recorder_ring;
+	if (ring == NULL) {
+		ring = (recorder_ring_t *) (recorder_header + 1) + RECORDER_RINGS - 1;
+	}
+
+	recorder_write(ring, RECORDER_SIGNAL, sig, 0, (uint64_t) info->si_addr);
+	recorder_header->crash_signal = sig;
+
+	for (int i = 0; i < sizeof(crash_signals) / sizeof(int); ++i) {
+		if (crash_signals[i] == sig) {
+			sigaction(sig, &previous_actions[i], NULL);
+		}
+	}
+
+	// delivered once the handler returns, a fault also repeats when the instruction runs again
+	raise(sig);
+}
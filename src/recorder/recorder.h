@@ -0,0 +1,178 @@
+/***************************************************************************//**
+
+  @file         recorder.h
+
+  @author       Robert Eikmanns
+
+  @date         Monday, 19 October 2026
+
+  @brief        Declarations for the flight recorder
+
+*******************************************************************************/
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define 	RECORDER_MAGIC		"WSREC001"	// first bytes of the shared memory object
+#define 	RECORDER_RINGS		256			// rings of the object, the last one is shared by all threads beyond
+#define 	RECORDER_SLOTS		1024		// records per ring, a power of two
+#define 	RECORDER_STALL_NS	1000000		// sends holding the socket longer than this are recorded
+#define 	RECORDER_SIGNAL_STACK	0x10000		// alternate stack the crash handler runs on, see recorder_signal_stack
+
+enum recorder_event {
+	RECORDER_ACCEPT 		= 1,	// arg: address family, value: socket
+	RECORDER_HANDSHAKE 		= 2,	// arg: 0 upgraded, 1 request rejected, 2 connection lost
+	RECORDER_FRAME 			= 3,	// arg: first byte of the frame header, value: payload length
+	RECORDER_CLOSE_RECEIVED = 4,	// arg: status code, 0 if the frame had none
+	RECORDER_CLOSE_SENT 	= 5,	// arg: status code
+	RECORDER_SEND_STALL 	= 6,	// arg: control frames kept waiting, value: ns the sender waited for and held the socket
+	RECORDER_ERROR 			= 7,	// arg: the close code the error maps to, value: errno
+	RECORDER_DISCONNECT 	= 8,	// value: data messages sent on the connection
+	RECORDER_SIGNAL 		= 9		// arg: the signal the process died of, value: faulting address
+};
+
+typedef struct {
+	uint64_t timestamp;			// ticks of recorder_now, see recorder_header_t for the conversion
+	uint32_t sequence;			// position in the ring + 1, 0 or RECORDER_SLOTS + slot while the record is being written
+	uint16_t event;				// one of the values of enum recorder_event
+	uint16_t arg;
+	uint32_t connection;		// id of the connection, unique within one server run, 0 for none
+	uint32_t pad;
+	uint64_t value;
+} recorder_record_t;
+
+// written by a single thread without locks, readers check the sequence of every record they take
+typedef struct {
+	uint64_t head;				// records written so far, the record at head - 1 is the newest
+	uint32_t owner;				// thread id of the writer, 0 if the ring is free
+	uint32_t shared;			// 1 for the last ring, its writers claim positions and slots atomically
+	uint8_t pad[48];
+	recorder_record_t records[RECORDER_SLOTS];
+} recorder_ring_t;
+
+typedef struct {
+	char magic[8];
+	uint32_t rings;
+	uint32_t slots;
+	uint32_t pid;
+	int32_t crash_signal;		// signal the process died of, 0 while it runs
+	uint64_t tsc_base;			// recorder_now at realtime_base
+	uint64_t realtime_base;		// CLOCK_REALTIME in nanoseconds
+	double ticks_per_ns;
+	uint8_t pad[16];
+} recorder_header_t;
+
+extern recorder_header_t *recorder_header;
+extern __thread recorder_ring_t *recorder_ring;
+
+int recorder_open(const char *name);
+void recorder_close(void);
+uint32_t recorder_connection(void);
+recorder_ring_t *recorder_attach(void);
+int recorder_signal_stack(void);
+
+/**
+ *  @brief                  a cheap timestamp: the time stamp counter where there is one, else CLOCK_MONOTONIC
+ */
+static inline uint64_t
+recorder_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+/**
+ *  @brief                  convert a span of recorder_now ticks to nanoseconds
+ */
+static inline uint64_t
+recorder_ns(uint64_t ticks) {
+	return (recorder_header != NULL) ? (uint64_t) (ticks / recorder_header->ticks_per_ns) : ticks;
+}
+
+/**
+ *  @brief                  append a record to a ring, the oldest record is overwritten. Async signal safe, the 
+ *                          crash handler writes with it
+ *
+ *  @param ring             the ring of the calling thread or the shared ring
+ *  @param event            one of the values of enum recorder_event
+ *  @param arg              16 bits of detail, see enum recorder_event
+ *  @param connection       id returned by recorder_connection, 0 for none
+ *  @param value            64 bits of detail, see enum recorder_event
+ */
+static inline void
+recorder_write(recorder_ring_t *ring, uint16_t event, uint16_t arg, uint32_t connection, uint64_t value) {
+	recorder_record_t *record;
+	uint64_t position;
+	uint32_t sequence, claimed;
+
+	if (ring->shared) {
+		position = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+		record = &ring->records[position & (RECORDER_SLOTS - 1)];
+
+		// writers a whole ring apart may meet at a slot, only the one claiming its sequence writes. The claim 
+		// is a value no finished record of the slot has, readers skip it like 0
+		claimed = RECORDER_SLOTS + (position & (RECORDER_SLOTS - 1));
+		sequence = __atomic_load_n(&record->sequence, __ATOMIC_RELAXED);
+		if (sequence == claimed 
+			|| !__atomic_compare_exchange_n(&record->sequence, &sequence, claimed, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			return;
+		}
+	} else {
+		position = ring->head;
+		record = &ring->records[position & (RECORDER_SLOTS - 1)];
+
+		// a reader seeing 0 or a different position skips the record
+		__atomic_store_n(&record->sequence, 0, __ATOMIC_RELAXED);
+	}
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	record->timestamp = recorder_now();
+	record->event = event;
+	record->arg = arg;
+	record->connection = connection;
+	record->value = value;
+
+	__atomic_store_n(&record->sequence, (uint32_t) position + 1, __ATOMIC_RELEASE);
+	if (!ring->shared) {
+		__atomic_store_n(&ring->head, position + 1, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ *  @brief                  append a record to the ring of the calling thread, the oldest record is overwritten.
+ *                          Does nothing if the recorder is off
+ *
+ *  @param event            one of the values of enum recorder_event
+ *  @param arg              16 bits of detail, see enum recorder_event
+ *  @param connection       id returned by recorder_connection, 0 for none
+ *  @param value            64 bits of detail, see enum recorder_event
+ */
+static inline void
+recorder_event(uint16_t event, uint16_t arg, uint32_t connection, uint64_t value) {
+	recorder_ring_t *ring;
+
+	ring = recorder_ring;
+	if (__builtin_expect(ring == NULL, 0)) {
+		ring = recorder_attach();
+		if (ring == NULL) {
+			return;
+		}
+	}
+
+	recorder_write(ring, event, arg, connection, value);
+}
+
+#endif
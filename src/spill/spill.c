@@ -0,0 +1,227 @@
+/***************************************************************************//**
+
+  @file         spill.c
+
+  @author       Robert Eikmanns
+
+  @date         Monday, 19 October 2026
+
+  @brief        File backed storage of oversized inbound messages. A message above 
+                the in-memory threshold is received into a memfd, or an unnamed 
+                file of a spill directory, mapped into memory for the handler. All 
+                spilled messages share one budget, so large uploads can't exhaust 
+                the memory or the disk
+
+*******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "spill.h"
+
+static uint64_t spill_budget = 0;
+static char *spill_directory = NULL;
+static uint64_t page_size = 0x1000;
+
+// bytes mapped for spilled messages right now and at most, see spill_report
+static uint64_t spill_used;
+static uint64_t spill_peak;
+static uint64_t spill_count;
+static uint64_t spill_rejected;
+
+/**
+ *  @brief                  set the budget shared by all spilled messages
+ *
+ *  @param budget           bytes all spilled messages together may take
+ *  @param directory        directory to create the files in, NULL for anonymous memory files (memfd)
+ *  @return                 0 if successful, or -1 if no file can be created in the directory
+ */
+int 
+spill_init(uint64_t budget, char *directory) {
+	int fd;
+
+	if (directory != NULL) {
+		// the directory has to support unnamed files, they vanish with the last reference
+		fd = open(directory, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+		if (fd == -1) {
+			perror("spill directory error");
+			return -1;
+		}
+		close(fd);
+	}
+
+	spill_budget = budget;
+	spill_directory = directory;
+	page_size = sysconf(_SC_PAGESIZE);
+
+	return 0;
+}
+
+/**
+ *  @brief                  the size of the mapping a message of the given length occupies
+ */
+uint64_t 
+spill_size(uint64_t length) {
+	return (length + page_size - 1) & ~(page_size - 1);
+}
+
+/**
+ *  @brief                  charge bytes to the budget
+ *
+ *  @return                 0 if successful, or -1 if the budget doesn't have them left
+ */
+static int 
+spill_reserve(uint64_t bytes) {
+	uint64_t used, peak;
+
+	used = __atomic_load_n(&spill_used, __ATOMIC_RELAXED);
+	do {
+		if (used + bytes > spill_budget) {
+			__atomic_fetch_add(&spill_rejected, 1, __ATOMIC_RELAXED);
+			errno = ENOSPC;
+			return -1;
+		}
+	} while (!__atomic_compare_exchange_n(&spill_used, &used, used + bytes, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	used += bytes;
+	peak = __atomic_load_n(&spill_peak, __ATOMIC_RELAXED);
+	while (used > peak && !__atomic_compare_exchange_n(&spill_peak, &peak, used, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		;
+	}
+
+	return 0;
+}
+
+/**
+ *  @brief                  create a spill file and map it
+ *
+ *  @param size             size of the file, a multiple of the page size, see spill_size
+ *  @param fd               receives the file descriptor, needed to grow the file
+ *  @return                 the mapping, or NULL with errno ENOSPC if the budget is used up, or another errno 
+ *                          if the file could not be created
+ */
+uint8_t *
+spill_map(uint64_t size, int *fd) {
+	uint8_t *data;
+
+	if (spill_reserve(size) == -1) {
+		return NULL;
+	}
+
+	if (spill_directory != NULL) {
+		*fd = open(spill_directory, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	} else {
+		*fd = memfd_create("ws-spill", MFD_CLOEXEC);
+	}
+
+	data = MAP_FAILED;
+	if (*fd == -1 || ftruncate(*fd, size) == -1) {
+		perror("spill file error");
+	} else {
+		data = (uint8_t *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+		if (data == MAP_FAILED) {
+			perror("mmap error");
+		}
+	}
+
+	if (data == MAP_FAILED) {
+		if (*fd != -1) {
+			close(*fd);
+		}
+		__atomic_fetch_sub(&spill_used, size, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	__atomic_fetch_add(&spill_count, 1, __ATOMIC_RELAXED);
+
+	return data;
+}
+
+/**
+ *  @brief                  grow a spill file and its mapping. The pages are remapped, not copied
+ *
+ *  @param fd               the file descriptor returned by spill_map
+ *  @param data             the current mapping
+ *  @param size             the current size
+ *  @param new_size         the new size, a multiple of the page size
+ *  @return                 the new mapping, or NULL with errno set as by spill_map. The old mapping is still 
+ *                          valid then
+ */
+uint8_t *
+spill_grow(int fd, uint8_t *data, uint64_t size, uint64_t new_size) {
+	uint8_t *grown;
+
+	if (spill_reserve(new_size - size) == -1) {
+		return NULL;
+	}
+
+	if (ftruncate(fd, new_size) == -1) {
+		perror("spill file error");
+		__atomic_fetch_sub(&spill_used, new_size - size, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	grown = (uint8_t *) mremap(data, size, new_size, MREMAP_MAYMOVE);
+	if (grown == MAP_FAILED) {
+		perror("mremap error");
+		__atomic_fetch_sub(&spill_used, new_size - size, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	return grown;
+}
+
+/**
+ *  @brief                  the message is complete: give the unused tail back and close the file, the mapping 
+ *                          keeps it alive
+ *
+ *  @param fd               the file descriptor returned by spill_map
+ *  @param data             the mapping
+ *  @param size             its size
+ *  @param length           the length of the message
+ *  @return                 the size of the mapping from now on, spill_size(length)
+ */
+uint64_t 
+spill_finish(int fd, uint8_t *data, uint64_t size, uint64_t length) {
+	uint64_t used;
+
+	used = spill_size(length);
+
+	if (used < size) {
+		munmap(data + used, size - used);
+		ftruncate(fd, used);
+		__atomic_fetch_sub(&spill_used, size - used, __ATOMIC_RELAXED);
+	}
+
+	close(fd);
+
+	return used;
+}
+
+/**
+ *  @brief                  unmap a spilled message and give its size back to the budget
+ */
+void 
+spill_release(uint8_t *data, uint64_t size) {
+	munmap(data, size);
+	__atomic_fetch_sub(&spill_used, size, __ATOMIC_RELAXED);
+}
+
+/**
+ *  @brief                  print how many messages have been spilled and how much of the budget they took
+ *
+ *  @param out              the stream to print to
+ */
+void 
+spill_report(FILE *out) {
+	fprintf(out, "%-12s %12s %12s %12s\n", "spilled", "rejected", "used KB", "peak KB");
+	fprintf(out, "%-12lu %12lu %12lu %12lu\n", __atomic_load_n(&spill_count, __ATOMIC_RELAXED), 
+		__atomic_load_n(&spill_rejected, __ATOMIC_RELAXED), __atomic_load_n(&spill_used, __ATOMIC_RELAXED) >> 10,
+		__atomic_load_n(&spill_peak, __ATOMIC_RELAXED) >> 10);
+}
@@ -0,0 +1,27 @@
+/***************************************************************************//**
+
+  @file         spill.h
+
+  @author       Robert Eikmanns
+
+  @date         Monday, 19 October 2026
+
+  @brief        Declarations for file backed storage of oversized inbound messages
+
+*******************************************************************************/
+
+#ifndef SPILL_H
+#define SPILL_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+int spill_init(uint64_t budget, char *directory);
+uint64_t spill_size(uint64_t length);
+uint8_t *spill_map(uint64_t size, int *fd);
+uint8_t *spill_grow(int fd, uint8_t *data, uint64_t size, uint64_t new_size);
+uint64_t spill_finish(int fd, uint8_t *data, uint64_t size, uint64_t length);
+void spill_release(uint8_t *data, uint64_t size);
+void spill_report(FILE *out);
+
+#endif
@@ -0,0 +1,157 @@
+# Autobahn performance regression check for the test server in testing/main.c
+#
+# usage: python3 autobahn_perf.py [--server ./wsserver] [--wstest wstest] [--cases "9.*"]
+#                                 [--baseline testing/autobahn_baseline.json] [--threshold 1.5] [--update]
+#
+# Starts the echo server, runs the selected Autobahn cases with the fuzzing
+# client and compares every case with the committed baseline. Exits with 1
+# if the behavior of a case differs from the baseline, a case of the
+# baseline did not run, or a case got slower than threshold * baseline.
+# --update writes the measured results of the selected cases into the
+# baseline, a missing baseline is an error. The 12.x and 13.x cases need
+# permessage-deflate, which the server does not implement.
+#
+# Cases of the baseline without a duration only have their behavior
+# checked until the first --update on a reference machine records one.
+#
+# wstest runs in testing/autobahn, which holds the generated spec and the
+# reports. To use the docker image instead of a local installation:
+#   --wstest "docker run --rm --network host -v $PWD/testing/autobahn:/work -w /work crossbario/autobahn-testsuite wstest"
+
+import argparse
+import fnmatch
+import json
+import os
+import shlex
+import subprocess
+import sys
+import time
+
+WORK_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "autobahn")
+AGENT = "wsserver"
+
+# durations below this many milliseconds are dominated by noise and never fail the check
+MIN_DURATION = 20
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description="autobahn performance regression check")
+    parser.add_argument("--server", default="./wsserver")
+    parser.add_argument("--wstest", default="wstest")
+    parser.add_argument("--cases", default="9.*")
+    parser.add_argument("--url", default="ws://127.0.0.1:9999")
+    parser.add_argument("--baseline", default=os.path.join(os.path.dirname(WORK_DIR), "autobahn_baseline.json"))
+    parser.add_argument("--threshold", type=float, default=1.5)
+    parser.add_argument("--update", action="store_true")
+
+    return parser.parse_args()
+
+
+def write_spec(args):
+    spec = {
+        "outdir": "./reports/servers",
+        "servers": [{"agent": AGENT, "url": args.url}],
+        "cases": args.cases.split(","),
+        "exclude-cases": [],
+        "exclude-agent-cases": {}
+    }
+
+    os.makedirs(WORK_DIR, exist_ok=True)
+    with open(os.path.join(WORK_DIR, "fuzzingclient.json"), "w") as spec_file:
+        json.dump(spec, spec_file, indent=2)
+
+
+def run_cases(args):
+    server = subprocess.Popen([args.server], stdout=subprocess.DEVNULL)
+    time.sleep(0.5)
+
+    try:
+        rc = subprocess.call(shlex.split(args.wstest) + ["-m", "fuzzingclient", "-s", "fuzzingclient.json"], cwd=WORK_DIR)
+    finally:
+        server.terminate()
+        server.wait()
+
+    if rc != 0:
+        sys.exit("wstest failed with exit code %d" % rc)
+
+
+def read_durations():
+    with open(os.path.join(WORK_DIR, "reports", "servers", "index.json")) as index_file:
+        index = json.load(index_file)
+
+    durations = {}
+    for case, result in index[AGENT].items():
+        durations[case] = {"duration": result["duration"], "behavior": result["behavior"]}
+
+    return durations
+
+
+def case_key(case):
+    return [int(part) for part in case.split(".")]
+
+
+def selected(case, patterns):
+    return any(fnmatch.fnmatchcase(case, pattern) for pattern in patterns)
+
+
+def compare(baseline, durations, patterns, threshold):
+    failures = 0
+
+    for case in sorted(baseline, key=case_key):
+        if selected(case, patterns) and case not in durations:
+            print("%-10s missing, the baseline expects %s" % (case, baseline[case]["behavior"]))
+            failures += 1
+
+    for case in sorted(durations, key=case_key):
+        current = durations[case]["duration"]
+        behavior = durations[case]["behavior"]
+        if case not in baseline:
+            print("%-10s %8d ms   %s   (new)" % (case, current, behavior))
+            continue
+
+        expected = baseline[case]["behavior"]
+        if behavior != expected:
+            print("%-10s %8d ms   %s   BEHAVIOR, baseline %s" % (case, current, behavior, expected))
+            failures += 1
+            continue
+
+        previous = baseline[case]["duration"]
+        if previous is None:
+            print("%-10s %8d ms   %s   (no baseline duration)" % (case, current, behavior))
+            continue
+
+        ratio = current / previous if previous > 0 else 1.0
+        slower = current > MIN_DURATION and ratio > threshold
+
+        print("%-10s %8d ms   baseline %8d ms   x%.2f%s" % (case, current, previous, ratio, "   REGRESSION" if slower else ""))
+        failures += slower
+
+    return failures
+
+
+if __name__ == "__main__":
+    args = parse_args()
+    patterns = args.cases.split(",")
+
+    baseline = {}
+    if os.path.exists(args.baseline):
+        with open(args.baseline) as baseline_file:
+            baseline = json.load(baseline_file)
+    elif not args.update:
+        sys.exit("no baseline at %s, record one with --update" % args.baseline)
+
+    write_spec(args)
+    run_cases(args)
+    durations = read_durations()
+
+    if args.update:
+        baseline.update(durations)
+        with open(args.baseline, "w") as baseline_file:
+            json.dump(baseline, baseline_file, indent=2, sort_keys=True)
+            baseline_file.write("\n")
+        print("%d cases written to %s" % (len(durations), args.baseline))
+        sys.exit(0)
+
+    failures = compare(baseline, durations, patterns, args.threshold)
+    if failures > 0:
+        sys.exit("%d cases changed behavior, did not run or got slower than %.2fx the baseline" % (failures, args.threshold))
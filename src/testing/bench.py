@@ -0,0 +1,131 @@
+# Echo benchmark for the test server in testing/main.c
+#
+# usage: python3 bench.py [host] [port]
+#        python3 bench.py unix:<socket path>
+#
+# Measures the round trip time of small messages (p50/p99/p999) and the
+# throughput of large binary messages. Start the server with a socket
+# profile (./wsserver latency | ./wsserver throughput) or in busy poll mode
+# (./wsserver busypoll [cpu list]) to compare them. Start it with
+# WS_UNIX=<socket path> to compare loopback tcp with a unix domain socket,
+# or with WS_REACTOR=<threads> or WS_COROUTINES=<threads> to compare the
+# reactor and its coroutines with connection threads.
+
+import base64
+import os
+import socket
+import struct
+import sys
+import time
+
+HOST = sys.argv[1] if len(sys.argv) > 1 else "localhost"
+PORT = int(sys.argv[2]) if len(sys.argv) > 2 else 9999
+
+SMALL_MESSAGES = 20000
+SMALL_SIZE = 32
+LARGE_MESSAGES = 50
+LARGE_SIZE = 0x80000
+
+
+def connect():
+    if HOST.startswith("unix:"):
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.connect(HOST[5:])
+    else:
+        sock = socket.create_connection((HOST, PORT))
+    key = base64.b64encode(os.urandom(16)).decode()
+    request = ("GET / HTTP/1.1\r\nHost: %s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+               "Sec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\nOrigin: bench\r\n\r\n" % (HOST, key))
+    sock.sendall(request.encode())
+
+    response = b""
+    while b"\r\n\r\n" not in response:
+        data = sock.recv(4096)
+        if not data:
+            raise ConnectionError("connection closed during handshake")
+        response += data
+
+    return sock
+
+
+def build_frame(op_code, payload):
+    mask = os.urandom(4)
+    length = len(payload)
+
+    if length < 126:
+        header = struct.pack("!BB", 0x80 | op_code, 0x80 | length)
+    elif length <= 0xFFFF:
+        header = struct.pack("!BBH", 0x80 | op_code, 0x80 | 126, length)
+    else:
+        header = struct.pack("!BBQ", 0x80 | op_code, 0x80 | 127, length)
+
+    # xor with the repeated mask via big integers, much faster than a byte loop
+    repeated = (mask * (length // 4 + 1))[:length]
+    masked = (int.from_bytes(payload, "big") ^ int.from_bytes(repeated, "big")).to_bytes(length, "big")
+
+    return header + mask + masked
+
+
+def recv_exact(sock, count):
+    data = bytearray()
+    while len(data) < count:
+        chunk = sock.recv(count - len(data))
+        if not chunk:
+            raise ConnectionError("connection closed")
+        data += chunk
+
+    return bytes(data)
+
+
+def recv_message(sock):
+    length = 0
+    while True:
+        first, second = recv_exact(sock, 2)
+        payload_length = second & 0x7F
+        if payload_length == 126:
+            payload_length = struct.unpack("!H", recv_exact(sock, 2))[0]
+        elif payload_length == 127:
+            payload_length = struct.unpack("!Q", recv_exact(sock, 8))[0]
+
+        recv_exact(sock, payload_length)
+        length += payload_length
+        if first & 0x80:
+            return length
+
+
+def percentile(samples, p):
+    return samples[min(len(samples) - 1, int(len(samples) * p))]
+
+
+def bench_latency(sock):
+    frame = build_frame(0x02, os.urandom(SMALL_SIZE))
+    samples = []
+
+    for _ in range(SMALL_MESSAGES):
+        start = time.perf_counter_ns()
+        sock.sendall(frame)
+        recv_message(sock)
+        samples.append((time.perf_counter_ns() - start) / 1000)
+
+    samples.sort()
+    print("rtt %d B  p50 %.1f us  p99 %.1f us  p999 %.1f us" % (SMALL_SIZE, percentile(samples, 0.5),
+          percentile(samples, 0.99), percentile(samples, 0.999)))
+
+
+def bench_throughput(sock):
+    frame = build_frame(0x02, os.urandom(LARGE_SIZE))
+
+    start = time.perf_counter()
+    for _ in range(LARGE_MESSAGES):
+        sock.sendall(frame)
+        recv_message(sock)
+    elapsed = time.perf_counter() - start
+
+    print("echo %d KB  %.1f MB/s" % (LARGE_SIZE // 1024, LARGE_MESSAGES * LARGE_SIZE * 2 / elapsed / 1e6))
+
+
+if __name__ == "__main__":
+    sock = connect()
+    bench_latency(sock)
+    bench_throughput(sock)
+    sock.close()
@@ -0,0 +1,123 @@
+# Prints the last events of the flight recorder of a server
+#
+# usage: python3 flight_dump.py [--last N] [--connection ID] [PID | FILE]
+#
+# Every server keeps its recent history in /dev/shm/wsserver.<pid> (see
+# ws_server_set_recorder): accepts, handshakes, inbound frame headers,
+# close codes in both directions, sends that stalled, errors and
+# disconnects, one ring per thread. The object is removed on a clean
+# exit but stays after a crash, so this works on a running server as
+# well as on a dead one. Without an argument the newest object is read.
+
+import argparse
+import glob
+import os
+import struct
+import time
+
+MAGIC = b"WSREC001"
+HEADER = struct.Struct("<8sIIIiQQd16x")
+RING = struct.Struct("<QII48x")
+RECORD = struct.Struct("<QIHHIIQ")
+
+EVENTS = {
+    1: "accept",
+    2: "handshake",
+    3: "frame",
+    4: "close in",
+    5: "close out",
+    6: "send stall",
+    7: "error",
+    8: "disconnect",
+    9: "signal",
+}
+
+OPCODES = {0: "cont", 1: "text", 2: "binary", 8: "close", 9: "ping", 10: "pong"}
+HANDSHAKES = {0: "upgraded", 1: "rejected", 2: "connection lost"}
+
+
+def describe(event, arg, value):
+    if event == 1:
+        return "family %d  fd %d" % (arg, value)
+    if event == 2:
+        return HANDSHAKES.get(arg, str(arg))
+    if event == 3:
+        return "%s%s  %d bytes" % (OPCODES.get(arg & 0x0F, hex(arg & 0x0F)), "" if arg & 0x80 else " (more)", value)
+    if event in (4, 5):
+        return "code %d" % arg if arg else "no code"
+    if event == 6:
+        return "%.3f ms  %d control frames waiting" % (value / 1e6, arg)
+    if event == 7:
+        return "close code %d%s" % (arg, "  %s" % os.strerror(value) if value else "")
+    if event == 8:
+        return "%d messages sent" % value
+    if event == 9:
+        return "signal %d  address 0x%x" % (arg, value)
+    return "arg %d  value %d" % (arg, value)
+
+
+def read_records(path):
+    with open(path, "rb") as f:
+        data = f.read()
+
+    magic, rings, slots, pid, crash_signal, tsc_base, realtime_base, ticks_per_ns = HEADER.unpack_from(data, 0)
+    if magic != MAGIC:
+        raise ValueError("%s is not a flight recorder" % path)
+
+    records = []
+    ring_size = RING.size + slots * RECORD.size
+
+    for ring in range(rings):
+        offset = HEADER.size + ring * ring_size
+        head, owner, shared = RING.unpack_from(data, offset)
+
+        # only the last slots positions are still in the ring, a record is valid if it carries its position
+        for position in range(max(0, head - slots), head):
+            timestamp, sequence, event, arg, connection, _, value = RECORD.unpack_from(
+                data, offset + RING.size + (position % slots) * RECORD.size)
+            if sequence != (position + 1) & 0xFFFFFFFF or event == 0:
+                continue
+
+            realtime = realtime_base + (timestamp - tsc_base) / ticks_per_ns
+            records.append((realtime, ring, connection, event, arg, value))
+
+    records.sort()
+
+    return pid, crash_signal, records
+
+
+def main():
+    parser = argparse.ArgumentParser(description="dump the flight recorder of a websocket server")
+    parser.add_argument("target", nargs="?", help="pid of the server or path of the shared memory object")
+    parser.add_argument("--last", type=int, default=50, help="events to print, 0 for all")
+    parser.add_argument("--connection", type=int, help="only the events of this connection")
+    args = parser.parse_args()
+
+    if args.target is None:
+        paths = sorted(glob.glob("/dev/shm/wsserver.*"), key=os.path.getmtime)
+        if not paths:
+            print("no flight recorder found")
+            return
+        path = paths[-1]
+    elif args.target.isdigit():
+        path = "/dev/shm/wsserver.%s" % args.target
+    else:
+        path = args.target
+
+    pid, crash_signal, records = read_records(path)
+
+    if args.connection is not None:
+        records = [record for record in records if record[2] == args.connection]
+    if args.last > 0:
+        records = records[-args.last:]
+
+    print("%s  pid %d  %s" % (path, pid, "crashed with signal %d" % crash_signal if crash_signal else "no crash"))
+
+    for realtime, ring, connection, event, arg, value in records:
+        seconds = int(realtime // 1e9)
+        print("%s.%06d  ring %3d  conn %6d  %-10s  %s" % (time.strftime("%H:%M:%S", time.localtime(seconds)),
+              int(realtime % 1e9) // 1000, ring, connection, EVENTS.get(event, str(event)), describe(event, arg, value)))
+
+
+if __name__ == "__main__":
+    main()
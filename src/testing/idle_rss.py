@@ -0,0 +1,59 @@
+# Idle connection memory benchmark for the test server in testing/main.c
+#
+# usage: python3 idle_rss.py <server pid> [connections] [host] [port]
+#
+# Opens the given amount of websocket connections (default 1000), leaves them
+# idle and reports the growth of the server's resident set size per connection
+# and extrapolated to 100k connections. The file descriptor limits of both
+# processes have to allow the amount of connections (ulimit -n).
+
+import base64
+import os
+import socket
+import sys
+import time
+
+PID = int(sys.argv[1])
+CONNECTIONS = int(sys.argv[2]) if len(sys.argv) > 2 else 1000
+HOST = sys.argv[3] if len(sys.argv) > 3 else "localhost"
+PORT = int(sys.argv[4]) if len(sys.argv) > 4 else 9999
+
+
+def rss_kb():
+    with open("/proc/%d/status" % PID) as status:
+        for line in status:
+            if line.startswith("VmRSS:"):
+                return int(line.split()[1])
+
+
+def connect():
+    sock = socket.create_connection((HOST, PORT))
+    key = base64.b64encode(os.urandom(16)).decode()
+    request = ("GET / HTTP/1.1\r\nHost: %s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+               "Sec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\nOrigin: bench\r\n\r\n" % (HOST, key))
+    sock.sendall(request.encode())
+
+    response = b""
+    while b"\r\n\r\n" not in response:
+        data = sock.recv(4096)
+        if not data:
+            raise ConnectionError("connection closed during handshake")
+        response += data
+
+    return sock
+
+
+if __name__ == "__main__":
+    before = rss_kb()
+    sockets = [connect() for _ in range(CONNECTIONS)]
+
+    # let the server settle after the handshakes
+    time.sleep(1)
+    after = rss_kb()
+
+    per_connection = (after - before) * 1024 / CONNECTIONS
+    print("%d idle connections  rss +%d KB  %.0f B per connection  %.1f MB per 100k" % (CONNECTIONS, after - before,
+          per_connection, per_connection * 100000 / 1e6))
+
+    for sock in sockets:
+        sock.close()
@@ -14,25 +14,70 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <sys/signalfd.h>
 #include "ws.h"
 
+#define BUSY_POLL_SPIN 50       // microseconds a connection thread spins before it blocks
+#define BROADCAST_PREFIX "broadcast "
+#define BROADCAST_PREFIX_LEN 10
+#define CAPTURE_FILE_SIZE 0x1000000
+#define CAPTURE_FILES 4
+#define EMBED_BUDGET 64       // turns per call of ws_server_process
+
+static uint64_t zerocopy_threshold = 0;
+
+static void release_copy(void *context, uint8_t *buffer) {
+    free(buffer);
+}
+
 void on_connection(ws_connection_t *connection) {
     return;
 }
 
 void on_message(ws_connection_t *ws_connection) {
-    if (ws_connection->message_type == MESSAGE_TYPE_TXT) {
+    // with WS_SCATTER fragmented messages arrive as a chain, the echo needs them in one piece
+    uint8_t *message = ws_message_flatten(ws_connection);
+
+    if (message == NULL && ws_connection->message_length > 0) {
+        perror("flatten error");
+        return;
+    }
+
+    // "broadcast <text>" is sent to every client of every shard instead of being echoed
+    if (ws_connection->message_type == MESSAGE_TYPE_TXT && ws_connection->message_length > BROADCAST_PREFIX_LEN
+        && !memcmp(message, BROADCAST_PREFIX, BROADCAST_PREFIX_LEN)) {
+        if (ws_broadcast(message + BROADCAST_PREFIX_LEN, ws_connection->message_length - BROADCAST_PREFIX_LEN, MESSAGE_TYPE_TXT) == -1) {
+            perror("broadcast error");
+        }
+    } else if (ws_connection->message_type == MESSAGE_TYPE_TXT) {
         DEBUG_PRINT("sending text message\n");
-        if (send_ws_message_txt(ws_connection, ws_connection->message, ws_connection->message_length) == -1) {
+        if (send_ws_message_txt(ws_connection, message, ws_connection->message_length) == -1) {
             if (errno == EPIPE) {
                 printf("Error: Broken pipe (EPIPE) - the connection was closed.\n");
             } else {
                 perror("send error");
             }
         }
+    } else if (ws_connection->message_type == MESSAGE_TYPE_BIN && zerocopy_threshold > 0
+        && ws_connection->message_length >= zerocopy_threshold) {
+        // the echo hands a copy over, the server frees it once the kernel has sent it
+        uint8_t *copy = malloc(ws_connection->message_length);
+
+        if (copy == NULL) {
+            perror("malloc error");
+            return;
+        }
+        memcpy(copy, message, ws_connection->message_length);
+
+        if (send_ws_message_zerocopy(ws_connection, copy, ws_connection->message_length, MESSAGE_TYPE_BIN, release_copy, NULL) == -1) {
+            perror("send error");
+        }
     } else if (ws_connection->message_type == MESSAGE_TYPE_BIN) {
         DEBUG_PRINT("sending binary message\n");
-        if (send_ws_message_bin(ws_connection, ws_connection->message, ws_connection->message_length) == -1) {
+        if (send_ws_message_bin(ws_connection, message, ws_connection->message_length) == -1) {
             if (errno == EPIPE) {
                 printf("Error: Broken pipe (EPIPE) - the connection was closed.\n");
             } else {
@@ -42,11 +87,197 @@ void on_message(ws_connection_t *ws_connection) {
     }
 }
 
-int main() {
+#ifdef BATCH_MESSAGES
+// built with "make batch": every message that arrived in one read cycle is echoed with a single send
+void on_messages(ws_connection_t *ws_connection, ws_message_t *messages, int count) {
+    for (int i = 0; i < count; ++i) {
+        if (messages[i].type == MESSAGE_TYPE_TXT && messages[i].length > BROADCAST_PREFIX_LEN
+            && !memcmp(messages[i].data, BROADCAST_PREFIX, BROADCAST_PREFIX_LEN)) {
+            if (ws_broadcast(messages[i].data + BROADCAST_PREFIX_LEN, messages[i].length - BROADCAST_PREFIX_LEN, MESSAGE_TYPE_TXT) == -1) {
+                perror("broadcast error");
+            }
+        } else if (ws_queue_message(ws_connection, messages[i].data, messages[i].length, messages[i].type) == -1) {
+            perror("queue error");
+        }
+    }
+}
+#endif
+
+// optional listeners next to port 9999: WS_UNIX=<socket path>, e.g. for a reverse proxy, and 
+// WS_LATENCY_PORT=<port> serving its clients with the low latency profile
+static int listen_extra(void) {
+    char *unix_path = getenv("WS_UNIX");
+    char *latency_port = getenv("WS_LATENCY_PORT");
+
+    if (unix_path != NULL && ws_server_listen_unix(unix_path, -1) == -1) {
+        return -1;
+    }
+    if (latency_port != NULL && ws_server_listen("localhost", latency_port, SOCKET_PROFILE_LOW_LATENCY) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    sigset_t signals;
+    char *handoff_path, *shards, *capture_path, *sample, *coalesce, *coalesce_bytes, *reactor, *budget, *coroutines, *spill, *qos, *qos_reactor;
+    struct pollfd fds[2];
+    int sig, pending;
+
     signal(SIGPIPE, SIG_IGN);
-    ws_server("localhost", "9999");
 
-    pthread_exit(NULL);
+    // block SIGTERM before any thread is created, the main thread waits for it below
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    // optional socket profile: ./wsserver [latency|throughput|busypoll [cpu list]]
+    if (argc > 1 && !strcmp(argv[1], "latency")) {
+        ws_server_set_socket_profile(SOCKET_PROFILE_LOW_LATENCY);
+    } else if (argc > 1 && !strcmp(argv[1], "throughput")) {
+        ws_server_set_socket_profile(SOCKET_PROFILE_THROUGHPUT);
+    } else if (argc > 1 && !strcmp(argv[1], "busypoll")) {
+        ws_server_set_socket_profile(SOCKET_PROFILE_LOW_LATENCY);
+        if (ws_server_set_busy_poll(BUSY_POLL_SPIN, (argc > 2) ? argv[2] : NULL) == -1) {
+            fprintf(stderr, "invalid cpu list\n");
+            return 1;
+        }
+    }
+
+    // a listener thread per cpu, each accepting the connections arriving on its cpu: WS_ACCEPT_CPUS=<cpu list>
+    if (getenv("WS_ACCEPT_CPUS") != NULL && ws_server_set_cpus(THREAD_ROLE_ACCEPT, getenv("WS_ACCEPT_CPUS")) == -1) {
+        return 1;
+    }
+
+    // record traffic for testing/replay.py: WS_CAPTURE=<path prefix> [WS_CAPTURE_SAMPLE=<1 in n connections>]
+    capture_path = getenv("WS_CAPTURE");
+    if (capture_path != NULL) {
+        sample = getenv("WS_CAPTURE_SAMPLE");
+        if (ws_server_set_capture(capture_path, CAPTURE_FILE_SIZE, CAPTURE_FILES, (sample != NULL) ? atoi(sample) : 1) == -1) {
+            fprintf(stderr, "capture could not be started\n");
+            return 1;
+        }
+    }
+
+    // echo big binary messages with MSG_ZEROCOPY: WS_ZEROCOPY=<threshold in bytes>
+    if (getenv("WS_ZEROCOPY") != NULL) {
+        zerocopy_threshold = strtoull(getenv("WS_ZEROCOPY"), NULL, 10);
+        ws_server_set_zerocopy(zerocopy_threshold);
+    }
+
+    // gather small outbound messages: WS_COALESCE=<window in usecs>[,<bytes>]
+    coalesce = getenv("WS_COALESCE");
+    if (coalesce != NULL) {
+        coalesce_bytes = strchr(coalesce, ',');
+        ws_server_set_coalescing(atoi(coalesce), (coalesce_bytes != NULL) ? atoi(coalesce_bytes + 1) : 0);
+    }
+
+    // serve the connections from epoll reactors instead of a thread each: WS_REACTOR=<threads>[,<bytes>,<frames> per turn]
+    reactor = getenv("WS_REACTOR");
+    if (reactor != NULL) {
+        budget = strchr(reactor, ',');
+        if (ws_server_set_reactor(atoi(reactor), (budget != NULL) ? atoi(budget + 1) : 0,
+                (budget != NULL && strchr(budget + 1, ',') != NULL) ? atoi(strchr(budget + 1, ',') + 1) : 0) == -1) {
+            fprintf(stderr, "invalid reactor count\n");
+            return 1;
+        }
+    }
+
+    // run every connection of the reactors as a coroutine: WS_COROUTINES=<threads>[,<bytes>,<frames> per turn]
+    coroutines = getenv("WS_COROUTINES");
+    if (coroutines != NULL) {
+        budget = strchr(coroutines, ',');
+        if (ws_server_set_coroutines(atoi(coroutines), (budget != NULL) ? atoi(budget + 1) : 0,
+                (budget != NULL && strchr(budget + 1, ',') != NULL) ? atoi(strchr(budget + 1, ',') + 1) : 0) == -1) {
+            fprintf(stderr, "invalid reactor count\n");
+            return 1;
+        }
+    }
+
+    // deliver fragmented messages as buffer chains: WS_SCATTER=1
+    if (getenv("WS_SCATTER") != NULL) {
+        ws_server_set_scatter_gather(atoi(getenv("WS_SCATTER")));
+    }
+
+    // clients pick their service class with a header: WS_QOS=<header name>[,<reactor of low-latency>,<reactor of bulk>]
+    qos = getenv("WS_QOS");
+    if (qos != NULL) {
+        qos_reactor = strchr(qos, ',');
+        if (qos_reactor != NULL) {
+            *qos_reactor++ = '\0';
+            ws_server_set_qos(QOS_LOW_LATENCY, &(ws_qos_t) { SOCKET_PROFILE_LOW_LATENCY, 0, 4, 0, atoi(qos_reactor) });
+            qos_reactor = strchr(qos_reactor, ',');
+        }
+        if (qos_reactor != NULL) {
+            ws_server_set_qos(QOS_BULK, &(ws_qos_t) { SOCKET_PROFILE_THROUGHPUT, 0, 1, 10, atoi(qos_reactor + 1) });
+        }
+        ws_server_set_qos_header(qos);
+    }
+
+    // receive big messages into spill files: WS_SPILL=<threshold>,<max message>,<budget>[,<directory>] in bytes
+    spill = getenv("WS_SPILL");
+    if (spill != NULL) {
+        uint64_t spill_limits[3] = {0, 0, 0};
+
+        for (int i = 0; i < 3 && spill != NULL; ++i) {
+            spill_limits[i] = strtoull(spill, &spill, 10);
+            spill = (*spill == ',') ? spill + 1 : NULL;
+        }
+
+        if (ws_server_set_spill(spill_limits[0], spill_limits[1], spill_limits[2], spill) == -1) {
+            fprintf(stderr, "invalid spill directory\n");
+            return 1;
+        }
+    }
+
+    // rolling restart: the new process takes the listeners over from the old one
+    handoff_path = getenv("WS_HANDOFF_PATH");
+    shards = getenv("WS_SHARDS");
+    if (getenv("WS_EMBED") != NULL) {
+        // no server threads at all, this loop drives the server: WS_EMBED=1
+        if (listen_extra() == -1
+            || ws_server_embed("localhost", "9999") == -1) {
+            return 1;
+        }
+
+        fds[0].fd = ws_server_fd();
+        fds[0].events = POLLIN;
+        fds[1].fd = signalfd(-1, &signals, SFD_CLOEXEC);
+        fds[1].events = POLLIN;
+        pending = 0;
+
+        while (poll(fds, 2, pending ? 0 : -1) >= 0 && !(fds[1].revents & POLLIN)) {
+            pending = ws_server_process(EMBED_BUDGET);
+            if (pending == -1) {
+                return 1;
+            }
+        }
+    } else if (shards != NULL) {
+        // one process per shard, all accepting on the same listeners
+        if (listen_extra() == -1
+            || ws_server_shards("localhost", "9999", atoi(shards)) == -1) {
+            return 1;
+        }
+    } else if (handoff_path == NULL || ws_server_inherit(handoff_path) == -1) {
+        if (listen_extra() == -1
+            || ws_server("localhost", "9999") == -1) {
+            return 1;
+        }
+    }
+
+    if (getenv("WS_EMBED") == NULL) {
+        sigwait(&signals, &sig);
+    }
+
+    if (handoff_path != NULL) {
+        ws_server_handoff(handoff_path);
+    }
+    ws_server_drain(1001, 100, 10, 5000);
+    ws_server_latency_report(stderr);
+    ws_server_fragment_report(stderr);
+    ws_server_coalescing_report(stderr);
+    ws_server_spill_report(stderr);
 
     return 0;
 }
@@ -0,0 +1,170 @@
+# Replays traffic captured by the server against a running server
+#
+# usage: python3 replay.py [--host HOST] [--port PORT] [--speed FACTOR] FILE...
+#
+# Start the server with WS_CAPTURE=<path prefix> to record the handshakes
+# and inbound frames of its connections into <path prefix>.0, .1, ..
+# (see ws_server_set_capture). Pass those files to this script to play
+# the sessions back with their original timing (--speed 1), accelerated
+# (--speed 10) or as fast as possible (--speed 0). Connections whose
+# handshake was already rotated out of the log are skipped.
+
+import argparse
+import os
+import socket
+import struct
+import threading
+import time
+
+MAGIC = b"WSCAP001"
+RECORD = struct.Struct("<QIIIBBH")
+
+KIND_HANDSHAKE = 1
+KIND_FRAME = 2
+KIND_DISCONNECT = 3
+
+
+def read_records(path):
+    with open(path, "rb") as f:
+        data = f.read()
+
+    if data[:len(MAGIC)] != MAGIC:
+        raise ValueError("%s is not a capture file" % path)
+
+    offset = len(MAGIC)
+    while offset + RECORD.size <= len(data):
+        timestamp, connection, length, original_length, kind, op_code, _ = RECORD.unpack_from(data, offset)
+        if kind == 0:
+            break
+
+        payload = data[offset + RECORD.size:offset + RECORD.size + length]
+        yield timestamp, connection, kind, op_code, payload, original_length
+        offset += (RECORD.size + length + 7) & ~7
+
+
+def build_frame(op_code, payload):
+    mask = os.urandom(4)
+    length = len(payload)
+
+    if length < 126:
+        header = struct.pack("!BB", op_code, 0x80 | length)
+    elif length <= 0xFFFF:
+        header = struct.pack("!BBH", op_code, 0x80 | 126, length)
+    else:
+        header = struct.pack("!BBQ", op_code, 0x80 | 127, length)
+
+    repeated = (mask * (length // 4 + 1))[:length]
+    masked = (int.from_bytes(payload, "big") ^ int.from_bytes(repeated, "big")).to_bytes(length, "big")
+
+    return header + mask + masked
+
+
+class Session(threading.Thread):
+    def __init__(self, records, host, port, start, origin, speed):
+        super().__init__(daemon=True)
+        self.records = records
+        self.host = host
+        self.port = port
+        self.start_time = start
+        self.origin = origin
+        self.speed = speed
+        self.frames = 0
+        self.bytes_sent = 0
+        self.bytes_received = 0
+        self.error = None
+
+    def wait_until(self, timestamp):
+        if self.speed > 0:
+            delay = self.start_time + (timestamp - self.origin) / 1e9 / self.speed - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+
+    def drain(self, sock):
+        try:
+            while True:
+                data = sock.recv(0x10000)
+                if not data:
+                    break
+                self.bytes_received += len(data)
+        except OSError:
+            pass
+
+    def run(self):
+        sock = None
+        reader = None
+
+        try:
+            for timestamp, kind, op_code, payload, original_length in self.records:
+                self.wait_until(timestamp)
+
+                if kind == KIND_HANDSHAKE:
+                    sock = socket.create_connection((self.host, self.port))
+                    sock.sendall(payload)
+                    reader = threading.Thread(target=self.drain, args=(sock,), daemon=True)
+                    reader.start()
+                elif kind == KIND_FRAME and sock is not None:
+                    # payloads cut off by the size cap are padded to their original length
+                    payload += bytes(original_length - len(payload))
+                    frame = build_frame(op_code, payload)
+                    sock.sendall(frame)
+                    self.frames += 1
+                    self.bytes_sent += len(frame)
+                elif kind == KIND_DISCONNECT and sock is not None:
+                    break
+        except OSError as e:
+            self.error = e
+
+        if sock is not None:
+            try:
+                sock.shutdown(socket.SHUT_WR)
+            except OSError:
+                pass
+            reader.join(5)
+            sock.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="replay captured websocket traffic")
+    parser.add_argument("files", nargs="+")
+    parser.add_argument("--host", default="localhost")
+    parser.add_argument("--port", type=int, default=9999)
+    parser.add_argument("--speed", type=float, default=1.0, help="time scale, 0 replays without delays")
+    args = parser.parse_args()
+
+    records = []
+    for path in args.files:
+        records.extend(read_records(path))
+    records.sort(key=lambda record: record[0])
+
+    sessions = {}
+    for timestamp, connection, kind, op_code, payload, original_length in records:
+        if connection not in sessions:
+            if kind != KIND_HANDSHAKE:
+                continue
+            sessions[connection] = []
+        sessions[connection].append((timestamp, kind, op_code, payload, original_length))
+
+    if not sessions:
+        print("no complete sessions found")
+        return
+
+    origin = min(session[0][0] for session in sessions.values())
+    span = (max(session[-1][0] for session in sessions.values()) - origin) / 1e9
+    start = time.monotonic()
+
+    threads = [Session(session, args.host, args.port, start, origin, args.speed) for session in sessions.values()]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+
+    elapsed = time.monotonic() - start
+    errors = sum(1 for thread in threads if thread.error is not None)
+    print("sessions %d  errors %d  frames %d  sent %.1f KB  received %.1f KB" % (len(threads), errors,
+          sum(thread.frames for thread in threads), sum(thread.bytes_sent for thread in threads) / 1024,
+          sum(thread.bytes_received for thread in threads) / 1024))
+    print("captured %.3f s  replayed in %.3f s" % (span, elapsed))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,252 @@
+/***************************************************************************//**
+
+  @file         tuning.c
+
+  @author       Robert Eikmanns
+
+  @date         Monday, 19 October 2026
+
+  @brief        Socket tuning profiles trading latency against throughput
+
+*******************************************************************************/
+
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "tuning.h"
+
+// fragments chosen per size bucket, see fragment_size_report
+static uint64_t fragment_counts[FRAGMENT_SIZE_BUCKETS];
+// data messages and tcp segments of closed connections, see segments_report
+static uint64_t messages_total;
+static uint64_t segments_total;
+
+// struct tcp_info of glibc ends before the segment counters the kernel reports since linux 4.2
+struct tcp_info_segments {
+	struct tcp_info info;
+	uint64_t pacing_rate;
+	uint64_t max_pacing_rate;
+	uint64_t bytes_acked;
+	uint64_t bytes_received;
+	uint32_t segs_out;
+	uint32_t segs_in;
+};
+
+#ifndef SO_PREFER_BUSY_POLL
+#define 	SO_PREFER_BUSY_POLL		69
+#endif
+
+/**
+ *  @brief                  apply the socket options belonging to a tuning profile
+ *
+ *  @param fd               the socket to configure. Listening sockets pass most of the options on to accepted sockets 
+ *  @param profile          one of the values of enum ws_socket_profile
+ *  @return                 0 if all options have been set, or -1 if the profile is unknown or an option could not be set
+ */
+int 
+apply_socket_profile(int fd, int profile) {
+	int nodelay, lowat, buffer_size, rc;
+
+	rc = 0;
+
+	switch (profile) {
+		case SOCKET_PROFILE_DEFAULT:
+			break;
+		case SOCKET_PROFILE_LOW_LATENCY:
+			nodelay = 1;
+			lowat = LOW_LATENCY_NOTSENT_LOWAT;
+
+			if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) == -1
+				|| setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) == -1) {
+				perror("setsockopt error");
+				rc = -1;
+			}
+			break;
+		case SOCKET_PROFILE_THROUGHPUT:
+			nodelay = 0;
+			buffer_size = THROUGHPUT_BUFFER_SIZE;
+
+			if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) == -1
+				|| setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size)) == -1
+				|| setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size)) == -1) {
+				perror("setsockopt error");
+				rc = -1;
+			}
+			break;
+		default:
+			rc = -1;
+	}
+
+	return rc;
+}
+
+/**
+ *  @brief                  cork or uncork a socket. Uncorking is the explicit flush point of the throughput profile
+ *
+ *  @param fd               the socket   
+ *  @param on               1 to hold back partial segments, 0 to flush everything queued so far
+ *  @return                 0 if successful, or -1 in case of an error
+ */
+int 
+socket_cork(int fd, int on) {
+	return setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+/**
+ *  @brief                  let blocking reads poll the device queue of the socket for a while before they sleep. 
+ *                          Raising the time above net.core.busy_read needs CAP_NET_ADMIN
+ *
+ *  @param fd               the socket, accepted sockets inherit the options of the listener   
+ *  @param usecs            time in microseconds to busy poll for, 0 turns busy polling off
+ *  @return                 0 if successful, or -1 in case of an error
+ */
+int 
+apply_busy_poll(int fd, int usecs) {
+	int prefer;
+
+	prefer = usecs > 0;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == -1) {
+		perror("setsockopt error");
+		return -1;
+	}
+
+	// keeps device interrupts masked while the application polls, only available since linux 5.11
+	setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+
+	return 0;
+}
+
+/**
+ *  @brief                  limit the unsent bytes the kernel queues for a socket. A small queue keeps new messages 
+ *                          and control frames from waiting behind a backlog, the sender waits for room instead
+ *
+ *  @param fd               the socket
+ *  @param bytes            the limit, see TCP_NOTSENT_LOWAT
+ *  @return                 0 if successful, or -1 in case of an error
+ */
+int 
+apply_send_queue(int fd, uint32_t bytes) {
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes, sizeof(bytes)) == -1) {
+		perror("setsockopt error");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ *  @brief                  choose the size of the next outbound fragment from the state of the connection. The 
+ *                          congestion window (cwnd * mss) is what the link takes per round trip: fast links get 
+ *                          large fragments with few headers, slow ones small fragments, so control frames 
+ *                          between them and backpressure react quickly
+ *
+ *  @param fd               the socket
+ *  @param profile          one of the values of enum ws_socket_profile
+ *  @return                 the fragment size in bytes, between FRAGMENT_SIZE_MIN and FRAGMENT_SIZE_MAX
+ */
+uint32_t 
+fragment_size(int fd, int profile) {
+	struct tcp_info info;
+	socklen_t len;
+	uint64_t window, size;
+	int queued, bucket;
+
+	len = sizeof(info);
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1) {
+		// not tcp but a unix domain socket, no link to adapt to
+		size = FRAGMENT_SIZE_MAX;
+	} else {
+		window = (uint64_t) info.tcpi_snd_cwnd * info.tcpi_snd_mss;
+
+		switch (profile) {
+			case SOCKET_PROFILE_LOW_LATENCY:
+				size = window / 2;
+				break;
+			case SOCKET_PROFILE_THROUGHPUT:
+				size = window * 4;
+				break;
+			default:
+				size = window;
+		}
+
+		// a queue longer than the window means the peer can't keep up, smaller fragments let control frames pass
+		if (ioctl(fd, SIOCOUTQ, &queued) == 0 && (uint64_t) queued > window) {
+			size /= 2;
+		}
+	}
+
+	if (size < FRAGMENT_SIZE_MIN) {
+		size = FRAGMENT_SIZE_MIN;
+	} else if (size > FRAGMENT_SIZE_MAX) {
+		size = FRAGMENT_SIZE_MAX;
+	}
+
+	for (bucket = 0; bucket < FRAGMENT_SIZE_BUCKETS - 1 && ((uint64_t) FRAGMENT_SIZE_MIN << (bucket + 1)) <= size; ++bucket) {
+		;
+	}
+	__atomic_fetch_add(&fragment_counts[bucket], 1, __ATOMIC_RELAXED);
+
+	return size;
+}
+
+/**
+ *  @brief                  print how many fragments of which size fragment_size has chosen
+ *
+ *  @param out              the stream to print to
+ */
+void 
+fragment_size_report(FILE *out) {
+	uint64_t count;
+
+	fprintf(out, "%-12s %12s\n", "fragment", "count");
+
+	for (int i = 0; i < FRAGMENT_SIZE_BUCKETS; ++i) {
+		count = __atomic_load_n(&fragment_counts[i], __ATOMIC_RELAXED);
+		if (count > 0) {
+			fprintf(out, ">= %-5u KB %12lu\n", (FRAGMENT_SIZE_MIN << i) >> 10, count);
+		}
+	}
+}
+
+/**
+ *  @brief                  add the data messages of a connection that is about to close and the tcp segments 
+ *                          it has sent to the totals printed by segments_report
+ *
+ *  @param fd               the socket, unix domain sockets are skipped
+ *  @param messages         the amount of data messages sent on the connection
+ */
+void 
+segments_record(int fd, uint64_t messages) {
+	struct tcp_info_segments info;
+	socklen_t len;
+
+	len = sizeof(info);
+	if (messages == 0 || getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1 || len < sizeof(info)) {
+		return;
+	}
+
+	__atomic_fetch_add(&messages_total, messages, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&segments_total, info.segs_out, __ATOMIC_RELAXED);
+}
+
+/**
+ *  @brief                  print the tcp segments sent per data message of the closed connections. The segment 
+ *                          count includes handshake and pure acks, so it is an upper bound of the data packets
+ *
+ *  @param out              the stream to print to
+ */
+void 
+segments_report(FILE *out) {
+	uint64_t messages, segments;
+
+	messages = __atomic_load_n(&messages_total, __ATOMIC_RELAXED);
+	segments = __atomic_load_n(&segments_total, __ATOMIC_RELAXED);
+
+	fprintf(out, "%-12s %12s %12s\n", "messages", "segments", "per message");
+	fprintf(out, "%-12lu %12lu %12.3f\n", messages, segments, messages ? (double) segments / messages : 0.0);
+}
@@ -0,0 +1,40 @@
+/***************************************************************************//**
+
+  @file         tuning.h
+
+  @author       Robert Eikmanns
+
+  @date         Monday, 19 October 2026
+
+  @brief        Declarations for socket tuning profiles
+
+*******************************************************************************/
+
+#ifndef TUNING_H
+#define TUNING_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define 	LOW_LATENCY_NOTSENT_LOWAT	0x4000		// unsent bytes allowed in the kernel before the socket stops being writable
+#define 	THROUGHPUT_BUFFER_SIZE		0x400000	// SO_SNDBUF / SO_RCVBUF used by the throughput profile
+#define 	FRAGMENT_SIZE_MIN			0x1000		// smallest fragment chosen by fragment_size
+#define 	FRAGMENT_SIZE_MAX			0x100000	// largest fragment chosen by fragment_size
+#define 	FRAGMENT_SIZE_BUCKETS		9			// power of two buckets from FRAGMENT_SIZE_MIN to FRAGMENT_SIZE_MAX
+
+enum ws_socket_profile {
+	SOCKET_PROFILE_DEFAULT 		= 0,	// leave the kernel defaults untouched
+	SOCKET_PROFILE_LOW_LATENCY 	= 1,	// no nagle, small unsent queue, every message is pushed immediately
+	SOCKET_PROFILE_THROUGHPUT 	= 2		// large buffers, frames are corked and flushed once per message
+};
+
+int apply_socket_profile(int fd, int profile);
+int socket_cork(int fd, int on);
+int apply_busy_poll(int fd, int usecs);
+int apply_send_queue(int fd, uint32_t bytes);
+uint32_t fragment_size(int fd, int profile);
+void fragment_size_report(FILE *out);
+void segments_record(int fd, uint64_t messages);
+void segments_report(FILE *out);
+
+#endif
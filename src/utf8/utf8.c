@@ -1,6 +1,9 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
+
+#include "utf8.h"
 
 int 
 chr_isvalid(uint32_t c)
@@ -15,39 +18,70 @@ chr_isvalid(uint32_t c)
   return 0;
 }
 
+/**
+ *  @brief                  validate the next piece of a text that may arrive in several pieces. A code point 
+ *                          may be split between pieces, the state carries it over
+ *
+ *  @param state            zeroed before the first piece
+ *  @param data             the piece
+ *  @param len              length of the piece
+ *  @return                 1 if the text is valid so far, or 0 if it can't become valid anymore. The text is 
+ *                          complete once state->need is 0
+ */
 int 
-is_valid_utf8(const uint8_t *data, size_t len) {
+utf8_validate(utf8_state_t *state, const uint8_t *data, size_t len) {
+    uint64_t word;
+    uint8_t byte;
     size_t i = 0;
+
     while (i < len) {
-        uint8_t byte = data[i];
-        uint32_t codepoint = 0;
-        size_t remaining = len - i;
-
-        if (byte <= 0x7F) {
-            codepoint = byte;
-            i += 1;
-        } else if ((byte & 0xE0) == 0xC0 && remaining >= 2) {
-            uint8_t b1 = data[i + 1];
-            if ((b1 & 0xC0) != 0x80) return 0; 
-        
-            uint32_t codepoint = ((byte & 0x1F) << 6) | (b1 & 0x3F);
-            if (codepoint < 0x80) return 0; 
-        
-            i += 2;
-        } else if ((byte & 0xF0) == 0xE0 && remaining >= 3) {
-            codepoint = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
-            i += 3;
-        } else if ((byte & 0xF8) == 0xF0 && remaining >= 4) {
-            codepoint = (data[i] << 24) | (data[i + 1] << 16) | (data[i + 2] << 8) | data[i + 3];
-            i += 4;
-        } else {
-            return 0; 
+        // skip plain ascii 8 bytes at a time
+        if (state->need == 0 && len - i >= 8) {
+            memcpy(&word, data + i, 8);
+            if ((word & 0x8080808080808080ULL) == 0) {
+                i += 8;
+                continue;
+            }
+        }
+
+        byte = data[i++];
+
+        if (state->need > 0) {
+            if (byte < state->lower || byte > state->upper) return 0;
+
+            state->need--;
+            state->lower = 0x80;
+            state->upper = 0xBF;
+            continue;
         }
 
-        if (!chr_isvalid(codepoint)) {
-            return 0; 
+        if (byte <= 0x7F) continue;
+
+        state->lower = 0x80;
+        state->upper = 0xBF;
+
+        // overlong forms, surrogates and code points above U+10FFFF are rejected by the range of the second byte
+        if (byte >= 0xC2 && byte <= 0xDF) {
+            state->need = 1;
+        } else if (byte >= 0xE0 && byte <= 0xEF) {
+            state->need = 2;
+            if (byte == 0xE0) state->lower = 0xA0;
+            if (byte == 0xED) state->upper = 0x9F;
+        } else if (byte >= 0xF0 && byte <= 0xF4) {
+            state->need = 3;
+            if (byte == 0xF0) state->lower = 0x90;
+            if (byte == 0xF4) state->upper = 0x8F;
+        } else {
+            return 0;
         }
     }
 
-    return 1; 
+    return 1;
+}
+
+int 
+is_valid_utf8(const uint8_t *data, size_t len) {
+    utf8_state_t state = {0, 0, 0};
+
+    return utf8_validate(&state, data, len) && state.need == 0;
 }
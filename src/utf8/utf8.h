@@ -1,2 +1,18 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// progress of utf8_validate within a code point, all zero between code points
+typedef struct {
+    uint8_t need;       // continuation bytes still missing
+    uint8_t lower;      // range of the next continuation byte, narrower after E0, ED, F0 and F4
+    uint8_t upper;
+} utf8_state_t;
+
 int chr_isvalid(uint32_t c);
 int is_valid_utf8(const uint8_t *data, size_t len);
+int utf8_validate(utf8_state_t *state, const uint8_t *data, size_t len);
+
+#endif
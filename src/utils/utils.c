@@ -16,8 +16,16 @@
 #include <errno.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
 #include "utils.h"
 
+// how the calling thread waits for a non blocking socket, NULL blocks in poll
+static __thread io_wait_t io_wait = NULL;
+
 /**
  *  @brief                      split a string on a given string
  *
@@ -66,57 +74,174 @@ char
 }
 
 /**
- *  @brief                         create a socket listening for incoming tcp connections 
+ *  @brief                         create a socket listening for incoming tcp connections. Without a host address the 
+ *                                 socket listens on the IPv6 wildcard address with IPV6_V6ONLY off, which takes IPv4 
+ *                                 clients as well (dual stack). With a host address its first IPv4 address is preferred
  *
  *  @param host_address            the host ip address to listen for incomming connections. May be NULL
  *  @param port                    the port to listen on, allowed values: 1024-65535     
+ *  @param backlog                 length of the accept queue
+ *  @param reuse_port              1 to let more sockets join the address with SO_REUSEPORT, see get_steered_listener
  */
 int 
-get_listener_socket(char *host_address, char *port) {
-	int listener, yes, rv;
+get_listener_socket(char *host_address, char *port, int backlog, int reuse_port) {
+	int listener, yes, no, rv, preferred;
 	struct addrinfo hints, *ai, *p;
 
+	yes = 1;
+	no = 0;
+	listener = -1;
+
 	memset(&hints, 0, sizeof hints);
-	hints.ai_family = AF_INET;
+	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
 	if (host_address == NULL) hints.ai_flags = AI_PASSIVE;
 
 	rv = getaddrinfo(host_address, port, &hints, &ai);
 
 	if (rv != 0) {
-		fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(errno));
+		fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(rv));
 		return -1;
 	}
 
-	for (p = ai; p != NULL; p = p->ai_next) {
-		listener = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-		if (listener < 0) {
-			perror("socket error");
-			continue;
+	preferred = (host_address == NULL) ? AF_INET6 : AF_INET;
+
+	// first try the addresses of the preferred family, then all others
+	for (int pass = 0; pass < 2 && listener < 0; ++pass) {
+		for (p = ai; p != NULL; p = p->ai_next) {
+			if ((pass == 0) != (p->ai_family == preferred)) {
+				continue;
+			}
+
+			listener = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
+			if (listener < 0) {
+				perror("socket error");
+				continue;
+			}
+
+			if (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1
+				|| (reuse_port && setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1)
+				|| (p->ai_family == AF_INET6 && setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(int)) == -1)) {
+				perror("setsockopt error");
+				close(listener);
+				freeaddrinfo(ai);
+				return -1;
+			}
+
+			if (bind(listener, p->ai_addr, p->ai_addrlen) < 0) {
+				perror("bind error");
+				close(listener);
+				listener = -1;
+				continue;
+			}
+
+			break;
 		}
+	}
+
+	freeaddrinfo(ai);
+	if (listener < 0) {
+		return -1;
+	}
+
+	if (listen(listener, backlog) == -1) {
+		fprintf(stderr, "listen error: %s\n", strerror(errno));
+		close(listener);
+		return -1;
+	}
+
+	return listener;
+}
+
+/**
+ *  @brief                         create another listener on the address of a tcp listener created with reuse_port. 
+ *                                 The kernel hands it the connections whose packets arrive on cpu (SO_INCOMING_CPU), 
+ *                                 the others are spread over all listeners of the address
+ *
+ *  @param listener                the listener created by get_listener_socket
+ *  @param cpu                     the cpu the new listener takes the connections of
+ *  @param backlog                 length of the accept queue
+ *  @return                        the non blocking listening socket, or -1 in case of an error
+ */
+int 
+get_steered_listener(int listener, int cpu, int backlog) {
+	struct sockaddr_storage addr;
+	socklen_t addr_len, len;
+	int steered, yes, v6only;
+
+	yes = 1;
+	addr_len = sizeof(addr);
+	if (getsockname(listener, (struct sockaddr *) &addr, &addr_len) == -1) {
+		perror("getsockname error");
+		return -1;
+	}
 
-		if(setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+	steered = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (steered < 0) {
+		perror("socket error");
+		return -1;
+	}
+
+	// the same dual stack setting as the listener, else the address is a different one
+	if (addr.ss_family == AF_INET6) {
+		len = sizeof(v6only);
+		if (getsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, &len) == -1
+			|| setsockopt(steered, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(int)) == -1) {
 			perror("setsockopt error");
-			close(listener);
+			close(steered);
 			return -1;
 		}
+	}
 
-		if (bind(listener, p->ai_addr, p->ai_addrlen) < 0) {
-			perror("bind error");
-			close(listener);
-			continue;
-		}
+	if (setsockopt(steered, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1
+		|| setsockopt(steered, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1
+		|| setsockopt(steered, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(int)) == -1) {
+		perror("setsockopt error");
+		close(steered);
+		return -1;
+	}
 
-		break;
+	if (bind(steered, (struct sockaddr *) &addr, addr_len) < 0 || listen(steered, backlog) == -1) {
+		perror("steered listener error");
+		close(steered);
+		return -1;
 	}
 
-	freeaddrinfo(ai);
-	if (p == NULL) {
+	return steered;
+}
+
+/**
+ *  @brief                         create a unix domain socket listening for incoming connections, e.g. from a reverse 
+ *                                 proxy on the same host. A stale socket file at the path is replaced
+ *
+ *  @param path                    file system path of the socket
+ *  @param backlog                 length of the accept queue
+ *  @return                        the listening socket, or -1 in case of an error
+ */
+int 
+get_unix_listener_socket(char *path, int backlog) {
+	int listener;
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
 		return -1;
 	}
 
-	if (listen(listener, 10) == -1) {
-		fprintf(stderr, "listen error: %s\n", strerror(errno));
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listener < 0) {
+		perror("socket error");
+		return -1;
+	}
+
+	unlink(path);
+	if (bind(listener, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(listener, backlog) == -1) {
+		perror("unix listen error");
+		close(listener);
+		return -1;
 	}
 
 	return listener;
@@ -139,7 +264,10 @@ recv_bytes(int fd, uint8_t *mem, uint32_t fetch_bytes) {
 	while (fetch_bytes) {
 		numbytes = recv(fd, mem, fetch_bytes, 0);
 		
-		if(numbytes == 0) {
+		if (numbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			wait_fd(fd, POLLIN);
+			continue;
+		} else if(numbytes == 0) {
 			return -1;
 		} else if (numbytes == -1) {
 			perror("socket recv");
@@ -151,4 +279,210 @@ recv_bytes(int fd, uint8_t *mem, uint32_t fetch_bytes) {
 	}
 
 	return 0;
-}
\ No newline at end of file
+}
+
+/**
+ *  @brief                  receive bytes from a socket, spinning on non blocking reads before the thread goes to 
+ *                          sleep. Saves the wakeup latency of a blocking recv on a dedicated core
+ *
+ *  @param fd               the file descriptor   
+ *  @param mem              pointer to the memory region to store the received bytes 
+ *  @param fetch_bytes      amount of bytes to fetch 
+ *  @param spin_usecs       time in microseconds to spin without data before falling back to a blocking recv, 
+ *                          0 behaves like recv_bytes
+ *  @return                 0 if successful, or -1 in case the opposing site closed the underlying tcp connection, -2 if any other error occured
+ */
+int 
+recv_bytes_busy(int fd, uint8_t *mem, uint32_t fetch_bytes, uint32_t spin_usecs) {
+	struct timespec start, now;
+	ssize_t numbytes;
+	uint32_t spins;
+
+	if (spin_usecs == 0) {
+		return recv_bytes(fd, mem, fetch_bytes);
+	}
+
+	while (fetch_bytes) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		spins = 0;
+
+		for (;;) {
+			numbytes = recv(fd, mem, fetch_bytes, MSG_DONTWAIT);
+			if (numbytes != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+				break;
+			}
+
+			// the clock is only read every few rounds, the budget is coarse anyway
+			if ((++spins & 0x3F) == 0) {
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				if ((now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000 >= spin_usecs) {
+					// idle, sleep until data arrives
+					numbytes = recv(fd, mem, fetch_bytes, 0);
+					break;
+				}
+			}
+		}
+
+		if (numbytes == 0) {
+			return -1;
+		} else if (numbytes == -1) {
+			perror("socket recv");
+			return -2;
+		}
+
+		mem += numbytes;
+		fetch_bytes -= numbytes;
+	}
+
+	return 0;
+}
+
+/**
+ *  @brief                  send bytes over a socket, continuing after partial sends
+ *
+ *  @param fd               the file descriptor   
+ *  @param mem              pointer to the bytes to send 
+ *  @param length           amount of bytes to send 
+ *  @param flags            flags passed to every call of send, e.g. MSG_MORE
+ *  @return                 0 if successful, or -1 in case of an error
+ */                                                            
+int 
+send_bytes(int fd, uint8_t *mem, uint64_t length, int flags) {
+	ssize_t numbytes;
+
+	while (length) {
+		numbytes = send(fd, mem, length, flags);
+
+		if (numbytes == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				wait_fd(fd, POLLOUT);
+				continue;
+			}
+			return -1;
+		}
+
+		mem += numbytes;
+		length -= numbytes;
+	}
+
+	return 0;
+}
+
+/**
+ *  @brief                  pass a file descriptor to another process over a unix socket (SCM_RIGHTS)
+ *
+ *  @param sock             connected unix socket   
+ *  @param fd               the file descriptor to pass 
+ *  @return                 0 if successful, or -1 in case of an error
+ */
+int 
+send_fd(int sock, int fd) {
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+	uint8_t data;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+
+	// at least one byte of real data has to accompany the descriptor
+	data = 0;
+	iov.iov_base = &data;
+	iov.iov_len = 1;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	if (sendmsg(sock, &msg, 0) == -1) {
+		perror("sendmsg error");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ *  @brief                  receive a file descriptor passed with send_fd
+ *
+ *  @param sock             connected unix socket   
+ *  @return                 the received file descriptor, or -1 in case of an error
+ */
+int 
+recv_fd(int sock) {
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+	uint8_t data;
+	ssize_t rc;
+	int fd;
+
+	memset(&msg, 0, sizeof(msg));
+
+	iov.iov_base = &data;
+	iov.iov_len = 1;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	rc = recvmsg(sock, &msg, 0);
+	if (rc <= 0) {
+		// 0 is the regular end after the last descriptor
+		if (rc == -1) perror("recvmsg error");
+		return -1;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		fprintf(stderr, "no file descriptor received\n");
+		return -1;
+	}
+
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+	return fd;
+}
+
+/**
+ *  @brief                  set how the calling thread waits for non blocking sockets in recv_bytes, send_bytes 
+ *                          and wait_fd. Threads running coroutines yield to their scheduler instead of blocking
+ *
+ *  @param wait             the wait function, NULL blocks in poll (default)
+ */
+void 
+set_io_wait(io_wait_t wait) {
+	io_wait = wait;
+}
+
+/**
+ *  @brief                  wait until a file descriptor is ready
+ *
+ *  @param fd               the file descriptor
+ *  @param events           POLLIN or POLLOUT
+ */
+void 
+wait_fd(int fd, short events) {
+	struct pollfd pfd;
+
+	if (io_wait != NULL) {
+		io_wait(fd, events);
+		return;
+	}
+
+	pfd.fd = fd;
+	pfd.events = events;
+	pfd.revents = 0;
+	poll(&pfd, 1, -1);
+}
@@ -10,6 +10,17 @@
 
 *******************************************************************************/
 
+// waits until fd is ready for events (POLLIN / POLLOUT), see set_io_wait
+typedef void (*io_wait_t)(int fd, short events);
+
 char *split(char *str, const char *delim);
-int get_listener_socket(char *host_address, char *port);
-int recv_bytes(int fd, uint8_t *mem, uint32_t fetch_bytes);
\ No newline at end of file
+int get_listener_socket(char *host_address, char *port, int backlog, int reuse_port);
+int get_steered_listener(int listener, int cpu, int backlog);
+int get_unix_listener_socket(char *path, int backlog);
+int recv_bytes(int fd, uint8_t *mem, uint32_t fetch_bytes);
+int recv_bytes_busy(int fd, uint8_t *mem, uint32_t fetch_bytes, uint32_t spin_usecs);
+int send_bytes(int fd, uint8_t *mem, uint64_t length, int flags);
+int send_fd(int sock, int fd);
+int recv_fd(int sock);
+void set_io_wait(io_wait_t wait);
+void wait_fd(int fd, short events);
\ No newline at end of file
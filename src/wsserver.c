@@ -10,37 +10,174 @@
 
 *******************************************************************************/
 
+#define _GNU_SOURCE
+
 #include "ws.h"
 #include "sha1.h"
 #include "base64.h"
 #include "utils.h"
 #include "http.h"
 #include "utf8.h"
+#include "admission.h"
+#include "tuning.h"
+#include "affinity.h"
 
 static int ws_handshake(ws_connection_t *);
+static int ws_process_handshake(ws_connection_t *, char *data);
 static void build_accept_header(char *header, char *sec_websocket_key);
 static int ws_process_message(ws_connection_t *); 
 static void init_connections(int);
 static int ws_send_message(ws_connection_t *connection, uint8_t *message_bytes, uint64_t message_length, uint8_t message_type);
+static int send_control_frame(ws_connection_t *connection, uint8_t *payload, uint64_t payload_len, uint8_t op_code);
+static int send_data_message(ws_connection_t *connection, uint8_t *message_bytes, uint64_t message_length, uint8_t message_type, int priority, zerocopy_buffer_t **buffer);
+static void zerocopy_collect(ws_connection_t *connection);
+static int frame_acquire(ws_connection_t *connection, int control);
+static void frame_release(ws_connection_t *connection);
+static void message_acquire(ws_connection_t *connection, int priority);
+static void message_release(ws_connection_t *connection);
+static uint64_t next_fragment_size(ws_connection_t *connection, uint64_t remaining);
+static int send_allowed(ws_connection_t *connection, uint8_t op_code);
+static int build_frame_header(uint8_t *frame_header, uint8_t fin, uint8_t op_code, uint64_t payload_len);
 
 
 static void create_close_payload(int code, uint8_t *close_payload, int *close_reason_len);
 
+static int ws_server_start(void);
+static int add_listener(int listener, int profile);
+static int is_unix_socket(int fd);
+static void accept_batch(int *group, int index);
+static int start_accept_group(void);
+static int has_reuse_port(int fd);
+static void close_listeners(int *group);
+static int accept_connection(int newfd, ws_address_t *remote_addr, int profile);
+static void reject_connection(int fd);
+static int register_connection(ws_connection_t *);
+static void unregister_connection(ws_connection_t *);
+static void pin_connection(ws_connection_t *);
+static void unpin_connection(ws_connection_t *);
+static int send_close_frame(ws_connection_t *, uint16_t close_code);
+static int try_close_frame(ws_connection_t *, uint16_t close_code);
+
 static void *ws_server_listener_thread(void *);
-static void *ws_connection_thread(void *);
-static void thread_cleanup_handler(void *);
+static void *ws_worker_thread(void *);
+static int worker_start(ws_connection_t *);
+static int worker_dispatch(ws_connection_t *);
+static ws_connection_t *worker_take(void);
+static int worker_park(void);
+static void serve_thread_connection(ws_connection_t *);
+static void ws_connection_coroutine(void *);
+static void ws_connection_run(ws_connection_t *);
+static void *ws_coroutine_thread(void *);
+static void coroutine_turn(reactor_t *, reactor_entry_t *);
+static int embed_start(void);
+static void wake_due_connections(reactor_t *);
+static void embed_run(int msecs);
+static void coroutine_wait_io(int fd, short events);
+static void coroutine_budget(ws_connection_t *, uint64_t bytes, int frame);
+static void send_wait(ws_connection_t *);
+static void send_signal(ws_connection_t *);
+static void coroutine_park(ws_connection_t *);
+static void *ws_bus_thread(void *);
+static void deliver_broadcast(uint8_t type, uint8_t *bytes, uint32_t length);
+static void broadcast_to(ws_connection_t *, uint8_t type, uint8_t *bytes, uint32_t length);
+static int append_reply(ws_connection_t *, uint8_t *bytes, uint64_t length, uint8_t message_type);
+static int flush_replies(ws_connection_t *);
+static int finish_partial_reply(ws_connection_t *);
+static uint64_t frame_length(uint8_t *frame);
+static void release_message(ws_connection_t *);
+static void capture_frame(ws_connection_t *, ws_frame_header_t *frame_header, uint8_t *payload);
+static void receive_batches(ws_connection_t *);
+static void release_batch(ws_connection_t *);
+static int frame_buffered(int fd);
+static void *ws_flusher_thread(void *);
+static void *ws_reactor_thread(void *);
+static int serve_connection(ws_connection_t *, int64_t *deficit);
+static void close_connection(ws_connection_t *);
+static void setup_connection(ws_connection_t *);
+static void release_connection(ws_connection_t *, int drain_flags);
+static void batch_message(ws_connection_t *);
+static void deliver_batch(ws_connection_t *);
+static void schedule_flush(uint64_t deadline);
 
 static ws_connection_t **connections;
-static int listening_fd;
+static int listeners[MAX_LISTENERS];
+static int listener_profiles[MAX_LISTENERS];	// socket profile of the connections of each listener, -1 for the default
+static int listener_count = 0;
+static int steered_listeners[MAX_ACCEPT_CPUS][MAX_LISTENERS];	// listeners of the per cpu accept threads, -1 for none
+static pthread_t accept_threads[MAX_ACCEPT_CPUS];
+static int accept_thread_count = 0;
 static int con_count = 0, max_con = 10;
+static int default_socket_profile = SOCKET_PROFILE_DEFAULT;
+static size_t connection_stack_size = CONNECTION_STACK_SIZE;
+static int listen_backlog = LISTEN_BACKLOG;
+static uint64_t default_zerocopy_threshold = 0;
+static uint32_t busy_poll_usecs = 0;
+static uint32_t fixed_fragment_size = 0;
+static uint32_t default_coalesce_usecs = 0;
+static uint32_t default_coalesce_bytes = 0;
+static int default_scatter_gather = 0;
+static uint64_t spill_threshold = 0;
+static uint64_t spill_max_message = 0;
+static int admission_policy = ADMISSION_REJECT_HTTP;
+static int accepting = 0;
+static pthread_t listener_thread;
+static pthread_t bus_thread;
+static bus_t *bus = NULL;
+static int shard_id = 0;
+static pthread_t flusher_thread;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_cond;
+static uint64_t flusher_deadline = UINT64_MAX;
+static reactor_t reactors[MAX_REACTORS];
+static int reactor_count = 0;
+static int next_reactor = 0;
+static uint32_t reactor_byte_budget = REACTOR_BYTE_BUDGET;
+static uint32_t reactor_frame_budget = REACTOR_FRAME_BUDGET;
+static int coroutine_mode = 0;
+static int embedded = 0;
+static int flush_timer = -1;				// timerfd of the coalescing deadlines of an embedded server
+static reactor_entry_t flush_timer_entry;
+static reactor_entry_t listener_entries[MAX_LISTENERS];
+static int worker_threads = WORKER_THREADS;
+static int worker_idle_max = WORKER_IDLE_MAX;
+static int worker_idle = 0;
+static pthread_mutex_t worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_cond = PTHREAD_COND_INITIALIZER;
+static ws_connection_t **worker_queue;		// accepted connections handed to idle connection threads
+static int worker_queue_head = 0;
+static int worker_queue_count = 0;
+static char *recorder_prefix = "/wsserver";
+static char *qos_header = NULL;
+static const char *qos_names[QOS_CLASSES] = { "default", "low-latency", "bulk" };
+
+// default, low latency, bulk: the latency class gets four times the share of a reactor round and a small 
+// kernel send queue, bulk connection threads yield the cpu to the others
+static ws_qos_t qos_classes[QOS_CLASSES] = {
+	{ -1, 0, 1, 0, -1 },
+	{ SOCKET_PROFILE_LOW_LATENCY, 0, 4, 0, -1 },
+	{ SOCKET_PROFILE_THROUGHPUT, 0, 1, 10, -1 }
+};
+static __thread ws_connection_t *running_connection = NULL;
 
-pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static void handle_data_frame(ws_connection_t *ws_connection, ws_frame_header_t *frame_header);
-static void handle_ping_frame(ws_connection_t *ws_connection, ws_frame_header_t *frame_header);
-static void handle_close_frame(ws_connection_t *ws_connection, ws_frame_header_t *frame_header);
-static void handle_error(ws_connection_t *ws_connection, int close_code);
-static void handle_pong_frame(ws_connection_t *ws_connection, ws_frame_header_t *frame_header);
+static void parse_reset(ws_connection_t *ws_connection);
+static uint64_t parse_want(ws_connection_t *ws_connection, uint8_t **target);
+static int parse_advance(ws_connection_t *ws_connection, uint64_t count);
+static int parse_frame_complete(ws_connection_t *ws_connection);
+static int reserve_segment(ws_connection_t *ws_connection, uint64_t payload_length);
+static uint8_t *segment_end(ws_connection_t *ws_connection);
+static int spill_segment(ws_connection_t *ws_connection, uint64_t required);
+static reactor_t *pick_reactor(void);
+static reactor_t *qos_reactor(ws_connection_t *ws_connection);
+static int qos_move(ws_connection_t *ws_connection, reactor_t *reactor);
+static void qos_move_point(ws_connection_t *ws_connection);
+static void qos_reactor_priority(reactor_t *reactor);
+static void release_buffer(uint8_t *data, uint64_t capacity, uint8_t storage);
+static void unmask_payload(uint8_t *payload, uint64_t offset, uint64_t count, uint8_t *mask);
+static int handle_ping_frame(ws_connection_t *ws_connection, ws_frame_header_t *frame_header, uint8_t *ping_data);
+static void handle_close_frame(ws_connection_t *ws_connection, ws_frame_header_t *frame_header, uint8_t *close_data);
+static int handle_error(ws_connection_t *ws_connection, int error);
 
 enum handshake_headers {
 	HOST			= 128, 
@@ -58,7 +195,21 @@ enum message_return_codes {
 	RCV_CON_CLOSE				= 3,
 	RCV_ERR_CONNECTION_LOST 	= -1,
 	RCV_ERR_PROTOCOLL 			= -2,
-	RCV_ERR_PAYLOAD_SIZE 		= -3 
+	RCV_ERR_PAYLOAD_SIZE 		= -3,
+	RCV_ERR_NO_MEMORY			= -4,
+	RCV_ERR_SPILL_BUDGET		= -5
+};
+
+enum parse_states {
+	PARSE_HEADER				= 0,
+	PARSE_PAYLOAD				= 1
+};
+
+enum parse_results {
+	PARSE_MORE					= 0,	// the frame is incomplete
+	PARSE_FRAME					= 1,	// a frame has been processed
+	PARSE_MESSAGE				= 2,	// a data message is complete
+	PARSE_CLOSE					= -1	// the connection has to be closed
 };
 
 websocket_status_code_t websocket_close_codes[] = {
@@ -67,6 +218,8 @@ websocket_status_code_t websocket_close_codes[] = {
 	{ 1007, "data not consistent" },
 	{ 1009, "message too big to process" },
 	{ 1011, "unexpected serverside condition" },
+	{ 1012, "service restart" },
+	{ 1013, "try again later" },
 	{ 1000, "normal closure" },
 };
 
@@ -77,481 +230,4100 @@ uint16_t invalid_close_codes[] = {
 /**
  *  @brief                  create the websocket server
  *
- *  @param host_address     the host ip address to listen for incomming connections. May be NULL   
- *  @param port             the port to listen on, allowed values: 1024-65535   
+ *  @param host_address     the host ip address to listen for incomming connections. May be NULL for all 
+ *                          IPv4 and IPv6 addresses   
+ *  @param port             the port to listen on, allowed values: 1024-65535. May be NULL to only serve the 
+ *                          listeners added with ws_server_listen and ws_server_listen_unix
  *  @return                 0 if creation was successful, or -1 in case of an error
  */
 int 
 ws_server(char *host_address, char *port) {
+	if (port != NULL && ws_server_listen(host_address, port, -1) == -1) {
+		return -1;
+	}
+
+	if (ws_server_start() == -1) {
+		return -1;
+	}
+
+	DEBUG_PRINT("websocket server created. Listening on %s:%s\n", host_address, port);
+
+	return 0;
+}
+
+/**
+ *  @brief                  create the websocket server inside the event loop of the application. No thread is 
+ *                          started: the loop watches ws_server_fd and calls ws_server_process, which accepts, 
+ *                          reads, runs the callbacks and flushes on the calling thread. The connections run as 
+ *                          coroutines like with ws_server_set_coroutines, so a slow client never blocks the loop. 
+ *                          Messages may only be sent from within the callbacks
+ *
+ *  @param host_address     the host ip address to listen for incomming connections. May be NULL for all 
+ *                          IPv4 and IPv6 addresses   
+ *  @param port             the port to listen on, allowed values: 1024-65535. May be NULL to only serve the 
+ *                          listeners added with ws_server_listen and ws_server_listen_unix
+ *  @return                 0 if creation was successful, or -1 in case of an error
+ */
+int 
+ws_server_embed(char *host_address, char *port) {
+	if (port != NULL && ws_server_listen(host_address, port, -1) == -1) {
+		return -1;
+	}
+
+	embedded = 1;
+	coroutine_mode = 1;
+	reactor_count = 1;
+
+	if (ws_server_start() == -1) {
+		return -1;
+	}
+
+	DEBUG_PRINT("embedded websocket server created. Listening on %s:%s\n", host_address, port);
+
+	return 0;
+}
+
+/**
+ *  @brief                  the file descriptor an embedding event loop watches for POLLIN, see ws_server_embed. 
+ *                          It becomes readable on new connections, input and due coalesced replies
+ *
+ *  @return                 an epoll file descriptor, or -1 if the server is not embedded
+ */
+int 
+ws_server_fd(void) {
+	return embedded ? reactors[0].epoll_fd : -1;
+}
+
+/**
+ *  @brief                  do the work that is ready now without blocking: accept connections, give ready 
+ *                          connections a turn within the budgets of ws_server_set_reactor and run their callbacks
+ *
+ *  @param budget           turns to run at most. A turn is one batch of accepts or one connection reading 
+ *                          and handling its input
+ *  @return                 1 if work is left and the loop should call again without waiting for ws_server_fd, 
+ *                          0 if all ready work is done, or -1 in case of an error
+ */
+int 
+ws_server_process(int budget) {
+	reactor_t *reactor;
+	reactor_entry_t *entry;
+
+	if (!embedded) {
+		return -1;
+	}
+
+	reactor = &reactors[0];
+
+	// a callback sending to a full socket suspends its coroutine instead of the loop
+	set_io_wait(coroutine_wait_io);
+
+	if (reactor_wait(reactor, 0) == -1 && errno != EINTR) {
+		perror("epoll_wait error");
+		return -1;
+	}
+
+	while (budget-- > 0 && (entry = reactor_next(reactor)) != NULL) {
+		if (entry == &flush_timer_entry) {
+			wake_due_connections(reactor);
+			reactor_requeue(reactor, entry, 0);
+		} else if (entry->owner == NULL) {
+			if (accepting) {
+				accept_batch(listeners, entry - listener_entries);
+			}
+			reactor_requeue(reactor, entry, 0);
+		} else {
+			coroutine_turn(reactor, entry);
+		}
+	}
+
+	return reactor->head != NULL;
+}
+
+/**
+ *  @brief                  create the websocket server on a listening socket taken over from a running server,
+ *                          see ws_server_handoff. Retries until the old process offers its socket
+ *
+ *  @param socket_path      path of the unix socket the old process hands its listener over   
+ *  @return                 0 if creation was successful, or -1 in case of an error
+ */
+int 
+ws_server_inherit(char *socket_path) {
+	int fd, listener, attempts;
+
+	listener = -1;
+	struct sockaddr_un addr;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket error");
+		return -1;
+	}
+
+	for (attempts = 0; connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1; ++attempts) {
+		if (attempts == HANDOFF_ATTEMPTS || (errno != ENOENT && errno != ECONNREFUSED)) {
+			perror("handoff connect error");
+			close(fd);
+			return -1;
+		}
+
+		usleep(HANDOFF_RETRY_INTERVAL);
+	}
+
+	// the old process passes all of its listeners, one after another
+	while (listener_count < MAX_LISTENERS && (listener = recv_fd(fd)) >= 0) {
+		add_listener(listener, -1);
+	}
+	close(fd);
+
+	if (listener_count == 0 || ws_server_start() == -1) {
+		return -1;
+	}
+
+	DEBUG_PRINT("websocket server created. Inherited listener from %s\n", socket_path);
+
+	return 0;
+}
+
+/**
+ *  @brief                  create the websocket server in several processes sharing one listener. Must be called 
+ *                          before any thread is created. The shards are forked from the calling process, which 
+ *                          becomes shard 0, the others get SIGTERM when it exits. Broadcasts reach the clients 
+ *                          of all shards through a shared memory bus, see ws_broadcast
+ *
+ *  @param host_address     the host ip address to listen for incomming connections. May be NULL   
+ *  @param port             the port to listen on, allowed values: 1024-65535   
+ *  @param shards           amount of processes
+ *  @return                 the shard of the calling process (0 .. shards - 1), or -1 in case of an error
+ */
+int 
+ws_server_shards(char *host_address, char *port, int shards) {
+	int shard;
+	pid_t parent, pid;
+
+	if (port != NULL && ws_server_listen(host_address, port, -1) == -1) {
+		return -1;
+	}
+
+	// mapped before fork, so every shard sees the same rings
+	bus = bus_create(shards);
+	if (bus == NULL) {
+		return -1;
+	}
+
+	parent = getpid();
+	pid = 1;
+
+	for (shard = 1; shard < shards; ++shard) {
+		pid = fork();
+
+		if (pid == -1) {
+			perror("fork error");
+			return -1;
+		} else if (pid == 0) {
+			// don't outlive shard 0, it may already be gone before prctl
+			prctl(PR_SET_PDEATHSIG, SIGTERM);
+			if (getppid() != parent) {
+				kill(getpid(), SIGTERM);
+			}
+			break;
+		}
+	}
+
+	shard_id = (pid == 0) ? shard : 0;
+
+	if (ws_server_start() == -1) {
+		return -1;
+	}
+
+	DEBUG_PRINT("websocket shard %d created. Listening on %s:%s\n", shard_id, host_address, port);
+
+	return shard_id;
+}
+
+static int 
+ws_server_start(void) {
 	int rc;
-	pthread_t listener_thread;
+	pthread_t reactor_thread;
+	pthread_attr_t attr;
+	pthread_condattr_t cond_attr;
 
-	listening_fd = get_listener_socket(host_address, port);
-	if (listening_fd < 0) {
+	if (listener_count == 0) {
 		return -1;
 	}
 
+	for (int i = 0; i < listener_count; ++i) {
+		// an inherited listener may still be blocking
+		if (fcntl(listeners[i], F_SETFL, fcntl(listeners[i], F_GETFL) | O_NONBLOCK) == -1) {
+			perror("fcntl error");
+			return -1;
+		}
+
+		if (listener_profiles[i] == -1) {
+			listener_profiles[i] = default_socket_profile;
+		}
+
+		// buffer sizes have to be known before the handshake to get a matching window scale
+		if (!is_unix_socket(listeners[i])) {
+			apply_socket_profile(listeners[i], listener_profiles[i]);
+			if (busy_poll_usecs > 0) apply_busy_poll(listeners[i], busy_poll_usecs);
+		}
+	}
+
 	connections = (ws_connection_t **) malloc(sizeof(ws_connection_t *) * max_con);
 	if (connections == NULL) {
 		return -1;
 	}
 	init_connections(0);
 
-	rc = pthread_create(&listener_thread, NULL, ws_server_listener_thread, NULL);
+	// the flight recorder is not essential, the server runs without it
+	if (recorder_prefix != NULL) {
+		char recorder_name[64];
+
+		snprintf(recorder_name, sizeof(recorder_name), "%s.%d", recorder_prefix, getpid());
+		recorder_open(recorder_name);
+	}
+
+	// coalescing deadlines are CLOCK_MONOTONIC like latency_now
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&flusher_cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+
+	if (embedded) {
+		return embed_start();
+	}
+
+	// the listener thread takes the connections of the first cpu of the accept group
+	if (affinity_init_attr(&attr, THREAD_ROLE_ACCEPT, start_accept_group()) == -1) {
+		return -1;
+	}
+
+	rc = pthread_create(&listener_thread, &attr, ws_server_listener_thread, listeners);
+	pthread_attr_destroy(&attr);
+
+	if (rc == 0 && affinity_init_attr(&attr, THREAD_ROLE_ACCEPT, -1) == -1) {
+		return -1;
+	}
+
+	if (rc == 0 && bus != NULL) {
+		rc = pthread_create(&bus_thread, &attr, ws_bus_thread, NULL);
+	}
+	if (rc == 0) {
+		rc = pthread_create(&flusher_thread, &attr, ws_flusher_thread, NULL);
+		pthread_attr_destroy(&attr);
+	}
 	if (rc != 0) {
 		perror("thread create error");
 		return -1;
 	}
 
-	DEBUG_PRINT("websocket server created. Listening on %s:%s\n", host_address, port);
+	// the pool holds at most worker_idle_max idle threads, a connection is only queued for an idle one
+	if (reactor_count == 0) {
+		worker_queue = (ws_connection_t **) malloc(sizeof(ws_connection_t *) * (worker_idle_max + 1));
+		if (worker_queue == NULL) {
+			return -1;
+		}
+
+		for (int i = 0; i < worker_threads; ++i) {
+			if (worker_start(NULL) == -1) {
+				return -1;
+			}
+		}
+	}
+
+	for (int i = 0; i < reactor_count; ++i) {
+		if (reactor_init(&reactors[i], reactor_byte_budget) == -1 || affinity_init_attr(&attr, THREAD_ROLE_IO, -1) == -1) {
+			return -1;
+		}
+
+		rc = pthread_create(&reactor_thread, &attr, coroutine_mode ? ws_coroutine_thread : ws_reactor_thread, &reactors[i]);
+		pthread_attr_destroy(&attr);
+		if (rc != 0) {
+			perror("thread create error");
+			return -1;
+		}
+	}
+
+	accepting = 1;
 
 	return 0;
 }
 
-static void*
-ws_server_listener_thread(void *param) {
-	int newfd, rc;
-	uint32_t thread_pos;
-	socklen_t addrlen;
-	struct sockaddr_storage remote_addr;
-	ws_connection_t *connection;
-	addrlen = sizeof(struct sockaddr_storage);
+/**
+ *  @brief                  watch the listeners and the coalescing timer of an embedded server with its reactor 
+ *                          instead of threads
+ */
+static int 
+embed_start(void) {
+	reactor_t *reactor;
 
-	for (;;) {
-		thread_pos = 0;
+	reactor = &reactors[0];
+	if (reactor_init(reactor, reactor_byte_budget) == -1) {
+		return -1;
+	}
 
-		newfd = accept(listening_fd, (struct sockaddr *) &remote_addr, &addrlen);
-		if (newfd == -1) {
-			perror("accept error");
-			continue;
+	flush_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (flush_timer == -1) {
+		perror("timerfd_create error");
+		return -1;
+	}
+
+	flush_timer_entry.weight = 1;
+	if (reactor_add(reactor, flush_timer, &flush_timer_entry, NULL) == -1) {
+		return -1;
+	}
+
+	for (int i = 0; i < listener_count; ++i) {
+		listener_entries[i].weight = 1;
+		if (reactor_add(reactor, listeners[i], &listener_entries[i], NULL) == -1) {
+			return -1;
 		}
+	}
 
-		connection = (ws_connection_t *) malloc(sizeof(ws_connection_t));
-		if (connection == NULL) {
-			return NULL;
+	accepting = 1;
+
+	return 0;
+}
+
+/**
+ *  @brief                  add a tcp listener. Several listeners are served by the same listener thread. Should be 
+ *                          called before ws_server
+ *
+ *  @param host_address     the host ip address to listen on. May be NULL for all IPv4 and IPv6 addresses   
+ *  @param port             the port to listen on, allowed values: 1024-65535   
+ *  @param profile          socket profile of the listener and its connections, one of the values of 
+ *                          enum ws_socket_profile, or -1 for the one of ws_server_set_socket_profile
+ *  @return                 0 if successful, or -1 in case of an error
+ */
+int 
+ws_server_listen(char *host_address, char *port, int profile) {
+	cpu_set_t cpus;
+	int listener;
+
+	// an accept role on several cpus gets a listener per cpu, they join this one with SO_REUSEPORT
+	listener = get_listener_socket(host_address, port, listen_backlog, affinity_get_cpus(THREAD_ROLE_ACCEPT, &cpus));
+	if (listener < 0) {
+		return -1;
+	}
+
+	if (add_listener(listener, profile) == -1) {
+		close(listener);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ *  @brief                  add a unix domain socket listener, e.g. for a reverse proxy on the same host. Should be 
+ *                          called before ws_server
+ *
+ *  @param path             file system path of the socket, a stale socket file is replaced   
+ *  @param profile          socket profile of its connections, or -1 for the one of ws_server_set_socket_profile. 
+ *                          Only the parts that apply to unix domain sockets take effect, e.g. corking
+ *  @return                 0 if successful, or -1 in case of an error
+ */
+int 
+ws_server_listen_unix(char *path, int profile) {
+	int listener;
+
+	listener = get_unix_listener_socket(path, listen_backlog);
+	if (listener < 0) {
+		return -1;
+	}
+
+	if (add_listener(listener, profile) == -1) {
+		close(listener);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int 
+add_listener(int listener, int profile) {
+	if (listener_count == MAX_LISTENERS) {
+		fprintf(stderr, "too many listeners\n");
+		return -1;
+	}
+
+	listener_profiles[listener_count] = profile;
+	listeners[listener_count++] = listener;
+
+	return 0;
+}
+
+/**
+ *  @brief                  give every further cpu of the accept role a listener thread of its own, pinned to it. 
+ *                          Each tcp listener created with SO_REUSEPORT gets a steered listener per cpu, so the 
+ *                          kernel hands a connection to the thread on the cpu its packets arrive on 
+ *                          (SO_INCOMING_CPU). The listener thread keeps the first cpu
+ *
+ *  @return                 a listener steered to the first cpu, the listener thread is pinned by it, or -1 if 
+ *                          there is no accept group
+ */
+static int 
+start_accept_group(void) {
+	pthread_attr_t attr;
+	cpu_set_t cpus;
+	int *group, first, steered, rc;
+
+	if (!affinity_get_cpus(THREAD_ROLE_ACCEPT, &cpus)) {
+		return -1;
+	}
+
+	first = -1;
+	for (int cpu = 0; cpu < CPU_SETSIZE && accept_thread_count < MAX_ACCEPT_CPUS; ++cpu) {
+		if (!CPU_ISSET(cpu, &cpus)) {
+			continue;
 		}
 
-		connection->fd = newfd;
-		connection->status = CONNECTING;
-		connection->remote_addr = remote_addr;
-		connection->message = NULL;
-		connection->message_length = 0;
-		connection->processed_frames = 0;
-		connection->close_sent = 0;
+		if (first == -1) {
+			for (int i = 0; i < listener_count; ++i) {
+				if (has_reuse_port(listeners[i]) 
+					&& setsockopt(listeners[i], SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == 0 && first == -1) {
+					first = listeners[i];
+				}
+			}
 
-		pthread_t new_thread;
-		rc = pthread_create(&new_thread, NULL, ws_connection_thread, (void *) connection);
-		if (rc != 0) {
-			// change connection state
-			free(connection);
-			perror("thread create error");
+			// listeners without SO_REUSEPORT have no group to join, e.g. inherited or unix domain ones
+			if (first == -1) {
+				return -1;
+			}
 			continue;
-		}		
+		}
 
-		for (; thread_pos < max_con; ++thread_pos) {
-			if (connections[thread_pos] == NULL || connections[thread_pos]->status == CLOSED) {
-				break;
+		group = steered_listeners[accept_thread_count];
+		steered = -1;
+
+		for (int i = 0; i < listener_count; ++i) {
+			group[i] = has_reuse_port(listeners[i]) ? get_steered_listener(listeners[i], cpu, listen_backlog) : -1;
+
+			if (group[i] != -1) {
+				apply_socket_profile(group[i], listener_profiles[i]);
+				if (busy_poll_usecs > 0) apply_busy_poll(group[i], busy_poll_usecs);
+				steered = group[i];
 			}
 		}
 
-		if (thread_pos == max_con) {
-			max_con += 10;
-			connections = realloc(connections, sizeof(ws_connection_t *) * max_con);
-			init_connections(thread_pos);
+		// the incoming cpu of the steered listener pins the thread to its cpu
+		if (steered == -1 || affinity_init_attr(&attr, THREAD_ROLE_ACCEPT, steered) == -1) {
+			close_listeners(group);
+			break;
+		}
+
+		rc = pthread_create(&accept_threads[accept_thread_count], &attr, ws_server_listener_thread, group);
+		if (rc != 0) {
+			// nobody would accept from its listeners, the kernel would still queue connections there
+			errno = rc;
+			perror("thread create error");
+			pthread_attr_destroy(&attr);
+			close_listeners(group);
+			break;
 		}
 
-		connection->thread_id = thread_pos;
+		pthread_attr_destroy(&attr);
+		accept_thread_count++;
+	}
+
+	return first;
+}
+
+static void 
+close_listeners(int *group) {
+	for (int i = 0; i < listener_count; ++i) {
+		if (group[i] != -1) {
+			close(group[i]);
+		}
+	}
+}
+
+static int 
+has_reuse_port(int fd) {
+	int reuse_port;
+	socklen_t len;
+
+	len = sizeof(reuse_port);
+
+	return getsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse_port, &len) == 0 && reuse_port && !is_unix_socket(fd);
+}
+
+static int 
+is_unix_socket(int fd) {
+	int domain;
+	socklen_t len;
+
+	len = sizeof(domain);
+
+	return getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) == 0 && domain == AF_UNIX;
+}
+
+/**
+ *  @brief                  stop accepting new connections. Open connections are not affected
+ */
+void 
+ws_server_stop(void) {
+	if (!accepting) {
+		return;
+	}
+
+	accepting = 0;
+	if (!embedded) {
+		pthread_cancel(listener_thread);
+		pthread_join(listener_thread, NULL);
+	}
+
+	for (int i = 0; i < accept_thread_count; ++i) {
+		pthread_cancel(accept_threads[i]);
+		pthread_join(accept_threads[i], NULL);
+		close_listeners(steered_listeners[i]);
+	}
+	accept_thread_count = 0;
+
+	for (int i = 0; i < listener_count; ++i) {
+		close(listeners[i]);
+	}
+	listener_count = 0;
+}
+
+/**
+ *  @brief                  hand the listening socket over to a new server process (SCM_RIGHTS) and stop accepting.
+ *                          Blocks until the new process called ws_server_inherit with the same path
+ *
+ *  @param socket_path      path of the unix socket to offer the listener on   
+ *  @return                 0 if the listener has been handed over, or -1 in case of an error
+ */
+int 
+ws_server_handoff(char *socket_path) {
+	int unix_listener, fd, rc;
+	struct sockaddr_un addr;
+
+	if (!accepting || strlen(socket_path) >= sizeof(addr.sun_path)) {
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	unix_listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (unix_listener < 0) {
+		perror("socket error");
+		return -1;
+	}
+
+	unlink(socket_path);
+	if (bind(unix_listener, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(unix_listener, 1) == -1) {
+		perror("handoff listen error");
+		close(unix_listener);
+		return -1;
+	}
+
+	fd = accept(unix_listener, NULL, NULL);
+	close(unix_listener);
+	unlink(socket_path);
+
+	if (fd < 0) {
+		perror("handoff accept error");
+		return -1;
+	}
+
+	rc = 0;
+	for (int i = 0; i < listener_count && rc == 0; ++i) {
+		rc = send_fd(fd, listeners[i]);
+	}
+	close(fd);
+
+	if (rc == -1) {
+		return -1;
+	}
+
+	// the new process owns the listener now, our copy may go
+	ws_server_stop();
+
+	return 0;
+}
+
+/**
+ *  @brief                  stop accepting and close all connections. Close frames are sent in batches to spread the 
+ *                          reconnects of the clients, connections still open at the deadline are shut down. The 
+ *                          close frames never wait for a socket, so a client that doesn't read can't hold the drain
+ *
+ *  @param close_code       status code of the close frames, e.g. 1001 (going away) or 1012 (service restart)
+ *  @param batch_size       amount of close frames to send per batch   
+ *  @param batch_interval   pause between two batches in milliseconds
+ *  @param deadline         time in milliseconds after which the remaining connections are shut down  
+ *  @return                 the amount of connections that had to be shut down
+ */
+int 
+ws_server_drain(uint16_t close_code, int batch_size, int batch_interval, int deadline) {
+	struct timespec start, now;
+	int pos, sent, remaining, elapsed;
+	ws_connection_t *connection;
+
+	ws_server_stop();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pos = 0;
+	elapsed = 0;
+	
+	while (elapsed < deadline) {
+		sent = 0;
+
+		pthread_mutex_lock(&connections_lock);
+		remaining = con_count;
+
+		// scan at most one full round per batch
+		for (int i = 0; i < max_con && sent < batch_size; ++i, ++pos) {
+			connection = connections[pos % max_con];
+
+			if (connection != NULL && connection->status == OPEN && connection->close_sent == 0 
+				&& try_close_frame(connection, close_code) != 0) {
+				sent++;
+			}
+		}
+		pthread_mutex_unlock(&connections_lock);
+
+		if (remaining == 0) {
+			return 0;
+		}
+
+		if (embedded) {
+			embed_run(batch_interval);
+		} else {
+			usleep(batch_interval * 1000);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+	}
+
+	pthread_mutex_lock(&connections_lock);
+	remaining = con_count;
+	for (int i = 0; i < max_con; ++i) {
+		if (connections[i] != NULL) {
+			shutdown(connections[i]->fd, SHUT_RDWR);
+		}
+	}
+	pthread_mutex_unlock(&connections_lock);
+
+	DEBUG_PRINT("drain deadline reached, %d connections shut down\n", remaining);
+
+	return remaining;
+}
+
+/**
+ *  @brief                  set the socket profile of the listeners added without a profile of their own and of 
+ *                          their connections. Should be called before ws_server
+ *
+ *  @param profile          one of the values of enum ws_socket_profile
+ */
+void 
+ws_server_set_socket_profile(int profile) {
+	default_socket_profile = profile;
+}
+
+/**
+ *  @brief                  switch the socket profile of a single connection, e.g. from within on_connection
+ *
+ *  @param connection       the websocket connection 
+ *  @param profile          one of the values of enum ws_socket_profile
+ *  @return                 0 if the profile has been applied, or -1 in case of an error
+ */
+int 
+ws_set_socket_profile(ws_connection_t *connection, int profile) {
+	if (apply_socket_profile(connection->fd, profile) == -1) {
+		return -1;
+	}
+
+	connection->socket_profile = profile;
+
+	return 0;
+}
+
+/**
+ *  @brief                  change the settings of a service class, see ws_set_qos. Should be called before ws_server
+ *
+ *  @param qos_class        one of the values of enum ws_qos_class
+ *  @param qos              the settings, a weight of 0 counts as 1. A reactor reserved for the class no longer 
+ *                          takes new connections of other classes and runs at the nice value of the class
+ *  @return                 0 if successful, or -1 if the class is unknown or the reactor doesn't exist
+ */
+int 
+ws_server_set_qos(int qos_class, ws_qos_t *qos) {
+	if (qos_class < 0 || qos_class >= QOS_CLASSES || qos->reactor < -1 || qos->reactor >= MAX_REACTORS) {
+		return -1;
+	}
+
+	qos_classes[qos_class] = *qos;
+	if (qos_classes[qos_class].weight == 0) {
+		qos_classes[qos_class].weight = 1;
+	}
+
+	return 0;
+}
+
+/**
+ *  @brief                  let clients choose their service class with a request header of the handshake, 
+ *                          e.g. "X-QoS-Class: low-latency". on_connection may still change it. Only for clients 
+ *                          that can be trusted with the choice, e.g. behind an authenticating proxy
+ *
+ *  @param header           name of the header, NULL ignores it (default)
+ */
+void 
+ws_server_set_qos_header(char *header) {
+	qos_header = header;
+}
+
+/**
+ *  @brief                  put a connection into a service class, from on_connection or a handler. The class 
+ *                          decides its socket profile and kernel send queue, its share of a reactor round or the 
+ *                          priority of its connection thread, and the reactor it is served by. Settings the 
+ *                          class leaves at -1 or 0 stay as they are
+ *
+ *  @param connection       the websocket connection
+ *  @param qos_class        one of the values of enum ws_qos_class
+ *  @return                 0 if all settings have been applied, or -1 if the class is unknown or a setting failed, 
+ *                          e.g. a negative nice value without CAP_SYS_NICE
+ */
+int 
+ws_set_qos(ws_connection_t *connection, int qos_class) {
+	ws_qos_t *qos;
+	int rc;
+
+	if (qos_class < 0 || qos_class >= QOS_CLASSES) {
+		return -1;
+	}
+
+	qos = &qos_classes[qos_class];
+	rc = 0;
+
+	connection->qos_class = qos_class;
+	connection->reactor_entry.weight = qos->weight;
+
+	if (connection->cold->remote_addr.sa.sa_family != AF_UNIX) {
+		if (qos->socket_profile != -1 && ws_set_socket_profile(connection, qos->socket_profile) == -1) {
+			rc = -1;
+		}
+
+		if (qos->send_queue > 0 && apply_send_queue(connection->fd, qos->send_queue) == -1) {
+			rc = -1;
+		}
+	}
+
+	// a shared reactor serves all classes, only a connection thread of its own can run at the priority of the class
+	if (connection->reactor == NULL && setpriority(PRIO_PROCESS, syscall(SYS_gettid), qos->nice) == -1) {
+		rc = -1;
+	}
+
+	return rc;
+}
+
+/**
+ *  @brief                  send messages of at least threshold bytes of every connection accepted afterwards 
+ *                          with MSG_ZEROCOPY. Should be called before ws_server
+ *
+ *  @param threshold        minimum message size in bytes, 0 disables zero copy sends
+ */
+void 
+ws_server_set_zerocopy(uint64_t threshold) {
+	default_zerocopy_threshold = threshold;
+}
+
+/**
+ *  @brief                  send messages of at least threshold bytes of a single connection with MSG_ZEROCOPY if 
+ *                          they are handed over with send_ws_message_zerocopy. The kernel reads the payload 
+ *                          straight from the buffer of the caller, which is released once the completion 
+ *                          notification arrived. The other send functions always copy
+ *
+ *  @param connection       the websocket connection 
+ *  @param threshold        minimum message size in bytes, 0 disables zero copy sends
+ *  @return                 0 if successful, or -1 if the kernel doesn't support zero copy sends or the connection 
+ *                          runs as a coroutine, its reactor only reads the error queue of reactor connections
+ */
+int 
+ws_set_zerocopy(ws_connection_t *connection, uint64_t threshold) {
+	if (threshold > 0 && (connection->coroutine != NULL || zerocopy_enable(connection->fd) == -1)) {
+		connection->zerocopy_threshold = 0;
+		return -1;
+	}
+
+	connection->zerocopy_threshold = threshold;
+
+	return 0;
+}
+
+/**
+ *  @brief                  coalesce small outbound messages of all connections, see ws_set_coalescing. Should 
+ *                          be called before ws_server
+ *
+ *  @param usecs            longest time a message waits for others, at most COALESCE_MAX_USECS. 0 turns it off
+ *  @param bytes            queued bytes that trigger a flush before the window ends, 0 for REPLY_QUEUE_FLUSH
+ */
+void 
+ws_server_set_coalescing(uint32_t usecs, uint32_t bytes) {
+	default_coalesce_usecs = usecs;
+	default_coalesce_bytes = bytes;
+}
+
+/**
+ *  @brief                  gather the small outbound messages of a connection into the reply queue and send them 
+ *                          with a single write. The queue is flushed once it reaches the byte limit or when 
+ *                          the window of its oldest message ends, whichever comes first, so no message is delayed 
+ *                          by more than the window. ws_flush sends the queue right away
+ *
+ *  @param connection       the websocket connection 
+ *  @param usecs            longest time a message waits for others, at most COALESCE_MAX_USECS. 0 turns it off
+ *  @param bytes            queued bytes that trigger a flush before the window ends, 0 for REPLY_QUEUE_FLUSH. 
+ *                          Messages of this size or bigger are sent on their own
+ */
+void 
+ws_set_coalescing(ws_connection_t *connection, uint32_t usecs, uint32_t bytes) {
+	pthread_mutex_lock(&connection->send_lock);
+	connection->coalesce_usecs = (usecs > COALESCE_MAX_USECS) ? COALESCE_MAX_USECS : usecs;
+	connection->coalesce_bytes = (bytes == 0 || bytes > REPLY_QUEUE_FLUSH) ? REPLY_QUEUE_FLUSH : bytes;
+	pthread_mutex_unlock(&connection->send_lock);
+
+	if (usecs == 0 && connection->replies_length > 0) {
+		ws_flush(connection);
+	}
+}
+
+/**
+ *  @brief                  deliver fragmented messages as the chain of buffers they were received into. By default 
+ *                          the chain is copied into one buffer before on_message runs, with scatter gather on, 
+ *                          message stays NULL for messages of several segments and handlers read them with 
+ *                          ws_message_iov, or call ws_message_flatten if they need contiguous bytes after all. 
+ *                          on_messages always gets contiguous messages. Should be called before ws_server
+ *
+ *  @param on               1 to deliver chains, 0 to flatten every message (default)
+ */
+void 
+ws_server_set_scatter_gather(int on) {
+	default_scatter_gather = (on != 0);
+}
+
+/**
+ *  @brief                  receive messages above threshold into a spill file mapped into memory instead of the 
+ *                          heap, so occasional big uploads don't pin heap memory of the size of the upload. 
+ *                          The handler gets the mapping as message. The size limit applies to whole messages then, 
+ *                          instead of MAX_FRAME_SIZE_RCV per frame. Bigger messages are closed with 1009, messages 
+ *                          that don't fit the budget left with 1013. Should be called before ws_server
+ *
+ *  @param threshold        messages bigger than this are spilled, 0 turns spilling off (default)
+ *  @param max_message      the largest message accepted
+ *  @param budget           bytes all spilled messages together may take
+ *  @param directory        directory for the spill files, it has to support O_TMPFILE. NULL keeps them in 
+ *                          anonymous memory files (memfd), which the kernel can swap out
+ *  @return                 0 if successful, or -1 if the directory can't be used
+ */
+int 
+ws_server_set_spill(uint64_t threshold, uint64_t max_message, uint64_t budget, char *directory) {
+	if (threshold > 0 && spill_init(budget, directory) == -1) {
+		return -1;
+	}
+
+	spill_threshold = threshold;
+	spill_max_message = (max_message > threshold) ? max_message : threshold;
+
+	return 0;
+}
+
+/**
+ *  @brief                  print how many messages have been spilled and how much of the budget they took
+ *
+ *  @param out              the stream to print to
+ */
+void 
+ws_server_spill_report(FILE *out) {
+	spill_report(out);
+}
+
+/**
+ *  @brief                  describe the buffers of the current message, in order, e.g. for writev
+ *
+ *  @param connection       the websocket connection, called from on_message
+ *  @param iov              receives up to count buffers
+ *  @param count            size of iov
+ *  @return                 the amount of buffers of the message, more than count if iov was too small
+ */
+int 
+ws_message_iov(ws_connection_t *connection, struct iovec *iov, int count) {
+	for (uint32_t i = 0; i < connection->segment_count && i < (uint32_t) count; ++i) {
+		iov[i].iov_base = connection->segments[i].data;
+		iov[i].iov_len = connection->segments[i].length;
+	}
+
+	return connection->segment_count;
+}
+
+/**
+ *  @brief                  copy the buffers of the current message into one and set message. The copy is made 
+ *                          once, later calls return the same buffer
+ *
+ *  @param connection       the websocket connection, called from on_message
+ *  @return                 the contiguous message, or NULL if the message is empty or the memory ran out
+ */
+uint8_t *
+ws_message_flatten(ws_connection_t *connection) {
+	ws_segment_t *segment;
+	uint8_t *flat;
+	uint64_t offset;
+
+	if (connection->message != NULL || connection->segment_count == 0) {
+		return connection->message;
+	}
+
+	if (connection->segment_count == 1) {
+		connection->message = connection->segments[0].data;
+		return connection->message;
+	}
+
+	flat = (uint8_t *) malloc(connection->message_length);
+	if (flat == NULL) {
+		return NULL;
+	}
+
+	offset = 0;
+	for (uint32_t i = 0; i < connection->segment_count; ++i) {
+		segment = &connection->segments[i];
+		memcpy(flat + offset, segment->data, segment->length);
+		offset += segment->length;
+		release_buffer(segment->data, segment->capacity, segment->storage);
+	}
+
+	segment = &connection->segments[0];
+	segment->data = flat;
+	segment->length = connection->message_length;
+	segment->capacity = connection->message_length;
+	segment->storage = STORAGE_HEAP;
+	connection->segment_count = 1;
+	connection->message = flat;
+
+	return flat;
+}
+
+/**
+ *  @brief                  serve the connections from a few epoll reactors instead of a thread per connection. 
+ *                          Ready connections take turns by deficit round robin: per round each one may read 
+ *                          byte_budget bytes and complete frame_budget frames, the parser resumes in the middle 
+ *                          of a frame on its next turn. Clients streaming big frames can't hold up the others, 
+ *                          handlers should not block though, as they run on the reactor. Sends block too: the 
+ *                          handshake reply, the sends of on_message and ws_flush wait on the reactor thread until 
+ *                          the client takes the bytes, so a client that reads slowly delays every connection of 
+ *                          its reactor. Only ws_broadcast and the coalescing flushes never wait. Where that tail 
+ *                          latency matters, ws_server_set_coroutines suspends just the waiting connection. Should 
+ *                          be called before ws_server
+ *
+ *  @param threads          reactor threads, at most MAX_REACTORS. 0 starts a thread per connection (default)
+ *  @param byte_budget      bytes a connection may read per turn, 0 for REACTOR_BYTE_BUDGET
+ *  @param frame_budget     frames a connection may complete per turn, 0 for REACTOR_FRAME_BUDGET
+ *  @return                 0 if successful, or -1 if there are too many threads
+ */
+int 
+ws_server_set_reactor(int threads, uint32_t byte_budget, uint32_t frame_budget) {
+	if (threads < 0 || threads > MAX_REACTORS) {
+		return -1;
+	}
+
+	reactor_count = threads;
+	reactor_byte_budget = (byte_budget > 0) ? byte_budget : REACTOR_BYTE_BUDGET;
+	reactor_frame_budget = (frame_budget > 0) ? frame_budget : REACTOR_FRAME_BUDGET;
+	coroutine_mode = 0;
+
+	return 0;
+}
+
+/**
+ *  @brief                  run every connection as a coroutine on the reactors, see ws_server_set_reactor. Handlers 
+ *                          keep their blocking style: a read or send that would block suspends the coroutine 
+ *                          until epoll reports the socket ready, and the reactor serves the next connection 
+ *                          meanwhile. Coroutine stacks have the size set by ws_server_set_stack_size and are 
+ *                          pooled. Zero copy sends are not available. Should be called before ws_server
+ *
+ *  @param threads          reactor threads, at most MAX_REACTORS. 0 starts a thread per connection (default)
+ *  @param byte_budget      bytes a connection may read per turn, 0 for REACTOR_BYTE_BUDGET
+ *  @param frame_budget     frames a connection may complete per turn, 0 for REACTOR_FRAME_BUDGET
+ *  @return                 0 if successful, or -1 if there are too many threads
+ */
+int 
+ws_server_set_coroutines(int threads, uint32_t byte_budget, uint32_t frame_budget) {
+	if (ws_server_set_reactor(threads, byte_budget, frame_budget) == -1) {
+		return -1;
+	}
+
+	coroutine_mode = 1;
+
+	return 0;
+}
+
+/**
+ *  @brief                  restrict the threads of a role to a set of cpus. Should be called before ws_server and 
+ *                          ws_server_listen. With THREAD_ROLE_ACCEPT every cpu of the list gets a listener thread 
+ *                          pinned to it, up to MAX_ACCEPT_CPUS. Its tcp listeners join those of ws_server_listen 
+ *                          with SO_REUSEPORT and SO_INCOMING_CPU, so a connection is accepted on the cpu its 
+ *                          packets arrive on, and its connection thread is pinned there as well. Listeners 
+ *                          inherited with ws_server_inherit only steer if the old process created them this way, 
+ *                          and ws_server_handoff passes the listeners of ws_server_listen only
+ *
+ *  @param role             THREAD_ROLE_ACCEPT for the listener threads, THREAD_ROLE_IO for the connection threads
+ *  @param cpu_list         cpus in the notation of taskset -c, e.g. "0-3,8". NULL removes the restriction
+ *  @return                 0 if successful, or -1 if the role is unknown or the list is malformed
+ */
+int 
+ws_server_set_cpus(int role, char *cpu_list) {
+	return affinity_set_cpus(role, cpu_list);
+}
+
+/**
+ *  @brief                  busy poll mode for latency critical servers. Connection threads spin on non blocking 
+ *                          reads for up to spin_usecs before they block, and the kernel busy polls the device 
+ *                          queue (SO_BUSY_POLL, SO_PREFER_BUSY_POLL). Spinning only pays off on dedicated cores, 
+ *                          so the connection threads should be pinned. Should be called before ws_server
+ *
+ *  @param spin_usecs       time in microseconds to spin without data before sleeping, 0 turns busy polling off
+ *  @param cpu_list         cpus reserved for the connection threads in the notation of taskset -c, or NULL to 
+ *                          keep the current placement. The listener is pinned with ws_server_set_cpus
+ *  @return                 0 if successful, or -1 if the cpu list is malformed
+ */
+int 
+ws_server_set_busy_poll(uint32_t spin_usecs, char *cpu_list) {
+	busy_poll_usecs = spin_usecs;
+
+	if (cpu_list != NULL) {
+		return affinity_set_cpus(THREAD_ROLE_IO, cpu_list);
+	}
+
+	return 0;
+}
+
+/**
+ *  @brief                  use the same fragment size for all outbound messages instead of choosing it per 
+ *                          connection from the congestion window and the socket profile. Should be called before ws_server
+ *
+ *  @param size             maximum payload of an outbound frame in bytes, 0 chooses it per connection (default)
+ */
+void 
+ws_server_set_fragment_size(uint32_t size) {
+	fixed_fragment_size = size;
+}
+
+/**
+ *  @brief                  print the tcp segments sent per data message of the closed connections, a measure of 
+ *                          how well small messages get coalesced
+ *
+ *  @param out              the stream to print to
+ */
+void 
+ws_server_coalescing_report(FILE *out) {
+	segments_report(out);
+}
+
+/**
+ *  @brief                  print how often which outbound fragment size has been chosen
+ *
+ *  @param out              the stream to print to
+ */
+void 
+ws_server_fragment_report(FILE *out) {
+	fragment_size_report(out);
+}
+
+/**
+ *  @brief                  set the stack size of the connection threads. Should be called before ws_server
+ *
+ *  @param stack_size       stack size in bytes, at least PTHREAD_STACK_MIN. Handlers running deep call chains
+ *                          need more than the default of CONNECTION_STACK_SIZE
+ */
+void 
+ws_server_set_stack_size(size_t stack_size) {
+	connection_stack_size = stack_size;
+}
+
+/**
+ *  @brief                  size the pool of connection threads. The threads are started with the server and wait 
+ *                          for accepted connections, a thread whose connection closed goes back to the pool. If 
+ *                          no thread is idle, a new one is started. Should be called before ws_server
+ *
+ *  @param threads          threads started with the server
+ *  @param max_idle         idle threads kept for the next connections, at least threads. Threads beyond it exit 
+ *                          once their connection closed, 0 gives every connection a thread of its own
+ *  @return                 0 if successful, or -1 if a value is negative
+ */
+int 
+ws_server_set_workers(int threads, int max_idle) {
+	if (threads < 0 || max_idle < 0) {
+		return -1;
+	}
+
+	worker_threads = threads;
+	worker_idle_max = (max_idle > threads) ? max_idle : threads;
+
+	return 0;
+}
+
+/**
+ *  @brief                  set the length of the accept queue. Should be called before ws_server
+ *
+ *  @param backlog          maximum of pending connections, capped by net.core.somaxconn
+ */
+void 
+ws_server_set_backlog(int backlog) {
+	listen_backlog = backlog;
+}
+
+/**
+ *  @brief                  limit the amount of open connections. Connections over the limits are shed right after 
+ *                          accept without a thread. Should be called before ws_server
+ *
+ *  @param max_connections  maximum of open connections, 0 for no limit
+ *  @param max_per_address  maximum of open connections per client ip address, 0 for no limit
+ *  @param policy           ADMISSION_REJECT_HTTP to answer with 503, ADMISSION_REJECT_RESET to reset the connection
+ */
+void 
+ws_server_set_admission(int max_connections, int max_per_address, int policy) {
+	admission_set_limits(max_connections, max_per_address);
+	admission_policy = policy;
+}
+
+/**
+ *  @brief                  print the latency histograms of all stages. Only available when built with LATENCY_STATS
+ *
+ *  @param out              the stream to print to
+ *  @return                 0 if the report has been printed, or -1 if latency statistics are not compiled in
+ */
+int 
+ws_server_latency_report(FILE *out) {
+#ifdef LATENCY_STATS
+	latency_report(out);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+/**
+ *  @brief                  record handshakes and inbound frames of sampled connections into a rotating set of memory 
+ *                          mapped files, see testing/replay.py to play them back. Should be called before ws_server
+ *
+ *  @param path             prefix of the capture files, <path>.0 .. <path>.<files - 1>
+ *  @param file_size        size of every file in bytes
+ *  @param files            amount of files, the oldest one is overwritten once all are full
+ *  @param sample_rate      capture one of sample_rate connections, 1 captures all
+ *  @return                 0 if successful, or -1 in case of an error
+ */
+int 
+ws_server_set_capture(char *path, size_t file_size, int files, int sample_rate) {
+	return capture_open(path, file_size, files, sample_rate);
+}
+
+/**
+ *  @brief                  name the shared memory object of the flight recorder, which keeps the last events of 
+ *                          every thread (accepts, handshakes, frame headers, close codes, send stalls, errors) 
+ *                          and survives a crash, see testing/flight_dump.py. It is on by default with the prefix 
+ *                          "/wsserver". Should be called before ws_server
+ *
+ *  @param prefix           the object is /dev/shm/<prefix>.<pid>, NULL turns the recorder off
+ */
+void 
+ws_server_set_recorder(char *prefix) {
+	recorder_prefix = prefix;
+}
+
+static void*
+ws_server_listener_thread(void *param) {
+	struct pollfd fds[MAX_LISTENERS];
+	int *group = (int *) param;
+
+	// poll skips the listeners of the group that are -1
+	for (int i = 0; i < listener_count; ++i) {
+		fds[i].fd = group[i];
+		fds[i].events = POLLIN;
+	}
+
+	// poll is the only point where ws_server_stop may cancel this thread
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	for (;;) {
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		poll(fds, listener_count, -1);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		for (int i = 0; i < listener_count; ++i) {
+			if (fds[i].revents & POLLIN) {
+				accept_batch(group, i);
+			}
+		}
+	}
+
+	return (void *) NULL;
+}
+
+/**
+ *  @brief                  drain the accept queue of a listener, at most ACCEPT_BATCH connections per call
+ *
+ *  @param group            listeners or the steered listeners of an accept thread
+ *  @param index            index of the non blocking listening socket in the group, the same as in listeners
+ */
+static void 
+accept_batch(int *group, int index) {
+	int newfd, listener;
+	socklen_t addrlen;
+	ws_address_t remote_addr;
+
+	listener = group[index];
+
+	for (int i = 0; i < ACCEPT_BATCH; ++i) {
+		// unix domain peers don't fit into remote_addr, the kernel truncates them to the address family
+		addrlen = sizeof(remote_addr);
+
+		newfd = accept4(listener, (struct sockaddr *) &remote_addr, &addrlen, SOCK_CLOEXEC);
+		if (newfd == -1) {
+			if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+				// out of resources, give closing connections a chance instead of spinning
+				perror("accept error");
+				usleep(ACCEPT_ERROR_BACKOFF);
+			} else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR) {
+				perror("accept error");
+			}
+			break;
+		}
+
+		if (admission_acquire(&remote_addr.sa) != ADMISSION_ACCEPTED) {
+			reject_connection(newfd);
+			continue;
+		}
+
+		if (accept_connection(newfd, &remote_addr, listener_profiles[index]) == -1) {
+			admission_release(&remote_addr.sa);
+			close(newfd);
+		}
+	}
+}
+
+static void*
+ws_bus_thread(void *param) {
+	uint64_t *cursors;
+	uint8_t *buffer;
+
+	cursors = (uint64_t *) malloc(sizeof(uint64_t) * bus_rings(bus));
+	buffer = (uint8_t *) malloc(BUS_SLOT_SIZE);
+	if (cursors == NULL || buffer == NULL) {
+		perror("malloc error");
+		free(cursors);
+		free(buffer);
+		return (void *) NULL;
+	}
+
+	bus_cursors_init(bus, cursors);
+
+	for (;;) {
+		bus_consume(bus, cursors, buffer, deliver_broadcast);
+	}
+
+	return (void *) NULL;
+}
+
+/**
+ *  @brief                  set up an admitted connection and start its thread
+ *
+ *  @param newfd            the accepted socket
+ *  @param remote_addr      the address of the client
+ *  @param profile          the socket profile of the listener
+ *  @return                 0 if successful, or -1 if the connection could not be set up
+ */
+static int 
+accept_connection(int newfd, ws_address_t *remote_addr, int profile) {
+	ws_connection_t *connection;
+
+	// one block, the cold part follows the hot fields and is freed with them
+	connection = (ws_connection_t *) malloc(sizeof(ws_connection_t) + sizeof(ws_connection_cold_t));
+	if (connection == NULL) {
+		return -1;
+	}
+
+	connection->cold = (ws_connection_cold_t *) (connection + 1);
+	connection->fd = newfd;
+	connection->status = CONNECTING;
+	connection->cold->remote_addr = *remote_addr;
+	connection->message = NULL;
+	connection->message_length = 0;
+	connection->segments = connection->cold->inline_segments;
+	connection->segment_count = 0;
+	connection->segment_capacity = INLINE_SEGMENTS;
+	connection->scatter_gather = default_scatter_gather;
+	connection->spill_fd = -1;
+	connection->qos_class = QOS_DEFAULT;
+	connection->reactor_entry.weight = 1;
+	memset(&connection->utf8, 0, sizeof(connection->utf8));
+	connection->processed_frames = 0;
+	connection->close_sent = 0;
+	connection->socket_profile = profile;
+	connection->zerocopy_threshold = 0;
+	connection->spin_budget = busy_poll_usecs;
+	connection->capture_id = capture_sample();
+	connection->recorder_id = recorder_connection();
+	connection->send_started = 0;
+	recorder_event(RECORDER_ACCEPT, remote_addr->sa.sa_family, connection->recorder_id, newfd);
+	memset(&connection->zerocopy, 0, sizeof(connection->zerocopy));
+	connection->ctrl_pending = 0;
+	connection->priority_pending = 0;
+	connection->frame_busy = 0;
+	connection->message_busy = 0;
+	connection->corked = 0;
+	connection->send_waiters = NULL;
+	connection->wait_next = NULL;
+	connection->replies = NULL;
+	connection->replies_length = 0;
+	connection->replies_capacity = 0;
+	connection->replies_partial = 0;
+	connection->pins = 1;
+	connection->cold->batch = NULL;
+	connection->cold->batch_count = 0;
+	connection->coalesce_usecs = 0;
+	connection->coalesce_bytes = REPLY_QUEUE_FLUSH;
+	connection->coalesce_deadline = 0;
+	connection->messages_sent = 0;
+	connection->reactor = NULL;
+	connection->coroutine = NULL;
+	connection->turn_frames = 0;
+	connection->requeue = 0;
+	connection->move_pending = 0;
+	parse_reset(connection);
+	pthread_mutex_init(&connection->send_lock, NULL);
+	pthread_cond_init(&connection->send_cond, NULL);
+
+	// register before the thread starts, so its cleanup always finds the slot
+	if (register_connection(connection) == -1) {
+		free(connection);
+		return -1;
+	}
+
+	if (reactor_count > 0) {
+		connection->spin_budget = 0;
+		connection->reactor = pick_reactor();
+
+		// coroutines must never block their reactor, the socket only ever returns EAGAIN
+		if (coroutine_mode) {
+			connection->coroutine = coroutine_create(ws_connection_coroutine, connection, connection_stack_size);
+			if (connection->coroutine == NULL || fcntl(newfd, F_SETFL, fcntl(newfd, F_GETFL) | O_NONBLOCK) == -1) {
+				if (connection->coroutine != NULL) coroutine_destroy(connection->coroutine);
+				unregister_connection(connection);
+				free(connection);
+				return -1;
+			}
+		}
+
+		setup_connection(connection);
+
+		if (reactor_add(connection->reactor, newfd, &connection->reactor_entry, connection) == -1) {
+			if (connection->coroutine != NULL) coroutine_destroy(connection->coroutine);
+			unregister_connection(connection);
+			free(connection);
+			return -1;
+		}
+
+		return 0;
+	}
+
+	if (worker_dispatch(connection) == -1) {
+		unregister_connection(connection);
+		free(connection);
+		return -1;
+	}
+
+	DEBUG_PRINT("new connection. Thread ID %u\n", connection->cold->thread_id);
+
+	return 0;
+}
+
+/**
+ *  @brief                  shed a connection over the admission limits without creating a thread for it
+ *
+ *  @param fd               the accepted socket, closed afterwards
+ */
+static void 
+reject_connection(int fd) {
+	char http_response[200];
+	http_header_t response_headers[1];
+	struct linger sl;
+
+	if (admission_policy == ADMISSION_REJECT_HTTP) {
+		response_headers[0] = (http_header_t) { "Retry-After", "1" };
+		build_http_response(http_response, 503, response_headers, 1);
+
+		// never wait for a client that doesn't read
+		send(fd, http_response, strlen(http_response), MSG_DONTWAIT | MSG_NOSIGNAL);
+	} else {
+		sl.l_onoff = 1;
+		sl.l_linger = 0;
+		setsockopt(fd, SOL_SOCKET, SO_LINGER, &sl, sizeof(sl));
+	}
+
+	close(fd);
+}
+
+/**
+ *  @brief                  store a connection in the first free slot of the connection table
+ *
+ *  @param connection       the new connection, its thread_id is set to the slot   
+ *  @return                 0 if successful, or -1 if the table could not be grown
+ */
+static int 
+register_connection(ws_connection_t *connection) {
+	ws_connection_t **grown;
+	uint32_t thread_pos;
+
+	pthread_mutex_lock(&connections_lock);
+
+	for (thread_pos = 0; thread_pos < max_con; ++thread_pos) {
+		if (connections[thread_pos] == NULL) {
+			break;
+		}
+	}
+
+	if (thread_pos == max_con) {
+		grown = realloc(connections, sizeof(ws_connection_t *) * (max_con + 10));
+		if (grown == NULL) {
+			pthread_mutex_unlock(&connections_lock);
+			return -1;
+		}
+
+		connections = grown;
+		max_con += 10;
+		init_connections(thread_pos);
+	}
+
+	connection->cold->thread_id = thread_pos;
+	connections[thread_pos] = connection;
+	con_count++;
+
+	pthread_mutex_unlock(&connections_lock);
+
+	return 0;
+}
+
+static void 
+unregister_connection(ws_connection_t *connection) {
+	pthread_mutex_lock(&connections_lock);
+	connections[connection->cold->thread_id] = NULL;
+	con_count--;
+	pthread_mutex_unlock(&connections_lock);
+}
+
+/**
+ *  @brief                  keep a connection from being freed, so it can be used after connections_lock has been 
+ *                          released. Only called under connections_lock
+ */
+static void 
+pin_connection(ws_connection_t *connection) {
+	__atomic_add_fetch(&connection->pins, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ *  @brief                  drop a reference to a connection, the last one closes the socket and frees it
+ */
+static void 
+unpin_connection(ws_connection_t *connection) {
+	if (__atomic_sub_fetch(&connection->pins, 1, __ATOMIC_ACQ_REL) > 0) {
+		return;
+	}
+
+	free(connection->replies);
+
+	// buffers the kernel may still send from go back once the socket is gone, its unsent data is discarded
+	zerocopy_collect(connection);
+	if (connection->zerocopy.head != NULL) {
+		struct linger sl = { 1, 0 };
+		setsockopt(connection->fd, SOL_SOCKET, SO_LINGER, &sl, sizeof(sl));
+	}
+
+	close(connection->fd);
+	zerocopy_release(connection->zerocopy.head);
+	pthread_mutex_destroy(&connection->send_lock);
+	pthread_cond_destroy(&connection->send_cond);
+	free(connection);
+}
+
+/**
+ *  @brief                  apply the server wide settings to a new connection
+ */
+static void 
+setup_connection(ws_connection_t *ws_connection) {
+	if (ws_connection->cold->remote_addr.sa.sa_family != AF_UNIX) {
+		apply_socket_profile(ws_connection->fd, ws_connection->socket_profile);
+	}
+	ws_set_zerocopy(ws_connection, default_zerocopy_threshold);
+	ws_set_coalescing(ws_connection, default_coalesce_usecs, default_coalesce_bytes);
+	LATENCY_ENABLE_TIMESTAMPS(ws_connection->fd);
+}
+
+/**
+ *  @brief                  hand an accepted connection to an idle connection thread, or start a new thread for it 
+ *                          if all are busy. Only called by the listener thread
+ *
+ *  @param connection       the registered connection
+ *  @return                 0 if successful, or -1 if no thread could be started
+ */
+static int 
+worker_dispatch(ws_connection_t *connection) {
+	pthread_mutex_lock(&worker_lock);
+
+	if (worker_idle > worker_queue_count) {
+		worker_queue[(worker_queue_head + worker_queue_count) % (worker_idle_max + 1)] = connection;
+		worker_queue_count++;
+		pthread_cond_signal(&worker_cond);
+		pthread_mutex_unlock(&worker_lock);
+		return 0;
+	}
+
+	pthread_mutex_unlock(&worker_lock);
+
+	return worker_start(connection);
+}
+
+/**
+ *  @brief                  start a connection thread. Threads are detached, they release their resources when 
+ *                          they leave the pool
+ *
+ *  @param connection       the first connection of the thread, or NULL to start it idle
+ *  @return                 0 if successful, or -1 in case of an error
+ */
+static int 
+worker_start(ws_connection_t *connection) {
+	pthread_t new_thread;
+	pthread_attr_t attr;
+	int rc;
+
+	if (affinity_init_attr(&attr, THREAD_ROLE_IO, (connection != NULL) ? (int) connection->fd : -1) == -1) {
+		return -1;
+	}
+
+	if (connection == NULL) {
+		pthread_mutex_lock(&worker_lock);
+		worker_idle++;
+		pthread_mutex_unlock(&worker_lock);
+	}
+
+	pthread_attr_setstacksize(&attr, connection_stack_size);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rc = pthread_create(&new_thread, &attr, ws_worker_thread, (void *) connection);
+	pthread_attr_destroy(&attr);
+
+	if (rc != 0) {
+		perror("thread create error");
+		if (connection == NULL) {
+			pthread_mutex_lock(&worker_lock);
+			worker_idle--;
+			pthread_mutex_unlock(&worker_lock);
+		}
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ *  @brief                  wait for the next accepted connection
+ */
+static ws_connection_t *
+worker_take(void) {
+	ws_connection_t *connection;
+
+	pthread_mutex_lock(&worker_lock);
+
+	while (worker_queue_count == 0) {
+		pthread_cond_wait(&worker_cond, &worker_lock);
+	}
+
+	connection = worker_queue[worker_queue_head];
+	worker_queue_head = (worker_queue_head + 1) % (worker_idle_max + 1);
+	worker_queue_count--;
+	worker_idle--;
+
+	pthread_mutex_unlock(&worker_lock);
+
+	return connection;
+}
+
+/**
+ *  @brief                  put the calling thread back into the pool after its connection closed
+ *
+ *  @return                 1 if the thread stays in the pool, or 0 if the pool is full and the thread has to exit
+ */
+static int 
+worker_park(void) {
+	int stay;
+
+	pthread_mutex_lock(&worker_lock);
+	stay = worker_idle < worker_idle_max;
+	if (stay) worker_idle++;
+	pthread_mutex_unlock(&worker_lock);
+
+	return stay;
+}
+
+/**
+ *  @brief                  a pooled connection thread, it serves one connection after the other
+ *
+ *  @param connection       the first connection, or NULL to wait for one
+ */
+static void*
+ws_worker_thread(void *connection) {
+	int nice_value;
+
+	nice_value = getpriority(PRIO_PROCESS, syscall(SYS_gettid));
+
+	for (;;) {
+		if (connection == NULL) {
+			connection = worker_take();
+			affinity_apply(THREAD_ROLE_IO, ((ws_connection_t *) connection)->fd);
+		}
+
+		serve_thread_connection((ws_connection_t *) connection);
+
+		DEBUG_PRINT("connection for thread with id %u terminated\n", ((ws_connection_t *) connection)->cold->thread_id);
+		release_connection((ws_connection_t *) connection, 0);
+		connection = NULL;
+
+		// the service class of the connection may have changed the priority of its thread
+		setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice_value);
+
+		if (!worker_park()) {
+			break;
+		}
+	}
+
+	return (void *) NULL;
+}
+
+static void 
+serve_thread_connection(ws_connection_t *ws_connection) {
+	struct linger sl;
+
+	sl.l_onoff = 1;
+	sl.l_linger = 2;
+	setsockopt(ws_connection->fd, SOL_SOCKET, SO_LINGER, &sl, sizeof(sl));
+	setup_connection(ws_connection);
+	if (ws_connection->spin_budget > 0) apply_busy_poll(ws_connection->fd, ws_connection->spin_budget);
+
+	ws_connection_run(ws_connection);
+}
+
+/**
+ *  @brief                  body of the coroutine of a connection. The coroutine releases its connection itself 
+ *                          once it has ended and returns to its reactor for good
+ *
+ *  @param connection       the accepted connection
+ */
+static void 
+ws_connection_coroutine(void *connection) {
+	ws_connection_t *ws_connection = (ws_connection_t *) connection;
+
+	ws_connection_run(ws_connection);
+
+	DEBUG_PRINT("coroutine of connection with id %u terminated\n", ws_connection->cold->thread_id);
+
+	reactor_remove(ws_connection->reactor, ws_connection->fd);
+	reactor_forget(ws_connection->reactor, &ws_connection->reactor_entry);
+	release_connection(ws_connection, MSG_DONTWAIT);
+}
+
+/**
+ *  @brief                  handshake and receive loop of a connection, the same for connection threads and 
+ *                          coroutines. Returns once the connection has ended, the caller releases it
+ *
+ *  @param ws_connection    the accepted connection
+ */
+static void 
+ws_connection_run(ws_connection_t *ws_connection) {
+	int status;
+
+	status = -1;
+	while (status != 0) {
+		status = ws_handshake(ws_connection);
+
+		if (status == -2) {
+			return;
+		}
+	}
+
+	ws_connection->status = OPEN;
+	
+	on_connection(ws_connection);
+	qos_move_point(ws_connection);
+	
+	// 	0 if successful, -1 if the underlying socket got closed or an 
+	//  other error occured, -2 if the client sent an unmasked frame,
+	//  -3 if the client sent a message bigger than 64 KB  
+
+	int val;
+	LATENCY_DECLARE(handler_start);
+
+	if (on_messages != NULL) {
+		receive_batches(ws_connection);
+		return;
+	}
+
+	for (;;) {
+		val = ws_process_message(ws_connection);
+		if (val != RCV_DATA) {
+			return;
+		}
+
+		LATENCY_NOW(handler_start);
+		LATENCY_RECORD(STAGE_DISPATCH, ws_connection->message_complete, handler_start);
+
+		on_message(ws_connection);
+
+		if (ws_connection->replies_length > 0 && ws_connection->coalesce_usecs == 0) {
+			ws_flush(ws_connection);
+		}
+
+		LATENCY_RECORD(STAGE_HANDLER, handler_start, latency_now());
+
+		release_message(ws_connection);
+		ws_connection->processed_frames = 0;
+		zerocopy_collect(ws_connection);
+		qos_move_point(ws_connection);
+	}
+}
+
+/**
+ *  @brief                  receive loop of connections served by on_messages. Every message whose frame is 
+ *							already buffered in the socket joins the batch of the message before it, so the
+ *							batch never waits for the network. Replies queued in the callback are flushed together
+ *
+ *  @param ws_connection    the open websocket connection, the function returns once the connection has ended
+ */
+static void
+receive_batches(ws_connection_t *ws_connection) {
+	ws_connection->cold->batch = (ws_message_t *) malloc(MESSAGE_BATCH_MAX * sizeof(ws_message_t));
+	if (ws_connection->cold->batch == NULL) {
+		return;
+	}
+
+	for (;;) {
+		do {
+			// the messages batched so far are released with the connection
+			if (ws_process_message(ws_connection) != RCV_DATA) {
+				return;
+			}
+
+			batch_message(ws_connection);
+		} while (ws_connection->cold->batch_count < MESSAGE_BATCH_MAX && frame_buffered(ws_connection->fd));
+
+		deliver_batch(ws_connection);
+		zerocopy_collect(ws_connection);
+		qos_move_point(ws_connection);
+	}
+}
+
+/**
+ *  @brief                  move the message just received into the batch, the next message starts with a fresh buffer
+ */
+static void
+batch_message(ws_connection_t *ws_connection) {
+	ws_message_t *message;
+
+	message = &ws_connection->cold->batch[ws_connection->cold->batch_count++];
+	message->data = ws_connection->message;
+	message->length = ws_connection->message_length;
+	message->type = ws_connection->message_type;
+	message->storage = (ws_connection->segment_count > 0) ? ws_connection->segments[0].storage : STORAGE_HEAP;
+
+	// the buffer belongs to the batch now, only the chain is reset
+	ws_connection->segment_count = 0;
+	release_message(ws_connection);
+	ws_connection->processed_frames = 0;
+}
+
+/**
+ *  @brief                  hand the batch to on_messages, flush the replies and release the messages
+ */
+static void
+deliver_batch(ws_connection_t *ws_connection) {
+	LATENCY_DECLARE(handler_start);
+
+	if (ws_connection->cold->batch_count > 0) {
+		LATENCY_NOW(handler_start);
+		LATENCY_RECORD(STAGE_DISPATCH, ws_connection->message_complete, handler_start);
+
+		on_messages(ws_connection, ws_connection->cold->batch, ws_connection->cold->batch_count);
+
+		if (ws_connection->replies_length > 0 && ws_connection->coalesce_usecs == 0) {
+			ws_flush(ws_connection);
+		}
+
+		LATENCY_RECORD(STAGE_HANDLER, handler_start, latency_now());
+	}
+
+	release_batch(ws_connection);
+}
+
+/**
+ *  @brief                  run a reactor: take turns serving its ready connections until the server exits
+ *
+ *  @param param            the reactor_t to run
+ */
+static void *
+ws_reactor_thread(void *param) {
+	reactor_t *reactor = (reactor_t *) param;
+	reactor_entry_t *entry;
+	int ready, pending;
+
+	qos_reactor_priority(reactor);
+	recorder_signal_stack();
+
+	for (;;) {
+		ready = reactor_wait(reactor, 1);
+		if (ready == -1) {
+			if (errno != EINTR) {
+				perror("epoll_wait error");
+			}
+			continue;
+		}
+
+		// one round over the connections that are ready now, newly ready ones join the next round
+		while (ready-- > 0) {
+			entry = reactor_next(reactor);
+			pending = serve_connection((ws_connection_t *) entry->owner, &entry->deficit);
+
+			// closed connections have left the reactor already, others may move to the reactor of their class
+			if (pending != -1 && !qos_move((ws_connection_t *) entry->owner, reactor)) {
+				reactor_requeue(reactor, entry, pending);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ *  @brief                  one turn of a connection: read and parse until the input is drained or the budgets of 
+ *                          the turn are used up. Messages are handed to on_messages batched per turn, or one by 
+ *                          one to on_message
+ *
+ *  @param ws_connection    the connection
+ *  @param deficit          bytes the connection may still read, reduced by the bytes read
+ *  @return                 1 if input may be left, 0 if the socket is drained, or -1 if the connection has been closed
+ */
+static int 
+serve_connection(ws_connection_t *ws_connection, int64_t *deficit) {
+	uint8_t *target;
+	uint64_t wanted;
+	uint32_t frames;
+	ssize_t received;
+	int rc;
+
+	if (ws_connection->status == CONNECTING) {
+		// the whole request is expected in one read like on a connection thread, anything else waits for more input
+		rc = ws_handshake(ws_connection);
+		if (rc == -2) {
+			close_connection(ws_connection);
+			return -1;
+		}
+
+		if (rc == 0) {
+			ws_connection->status = OPEN;
+			on_connection(ws_connection);
+		}
+
+		return 0;
+	}
+
+	// pending completions keep the socket readable for epoll (EPOLLERR) until they are read
+	zerocopy_collect(ws_connection);
+
+	if (on_messages != NULL && ws_connection->cold->batch == NULL) {
+		ws_connection->cold->batch = (ws_message_t *) malloc(MESSAGE_BATCH_MAX * sizeof(ws_message_t));
+		if (ws_connection->cold->batch == NULL) {
+			close_connection(ws_connection);
+			return -1;
+		}
+	}
+
+	frames = 0;
+	rc = PARSE_MORE;
+
+	while (*deficit > 0 && frames < reactor_frame_budget * ws_connection->reactor_entry.weight) {
+		wanted = parse_want(ws_connection, &target);
+		if (wanted > (uint64_t) *deficit) {
+			wanted = *deficit;
+		}
+
+		received = recv(ws_connection->fd, target, wanted, MSG_DONTWAIT);
+		if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			deliver_batch(ws_connection);
+			return 0;
+		} else if (received <= 0) {
+			recorder_event(RECORDER_ERROR, 1006, ws_connection->recorder_id, (received == 0) ? 0 : errno);
+			rc = PARSE_CLOSE;
+			break;
+		}
+
+		*deficit -= received;
+
+		rc = parse_advance(ws_connection, received);
+		if (rc == PARSE_CLOSE) {
+			break;
+		} else if (rc == PARSE_MORE) {
+			continue;
+		}
+
+		frames++;
+
+		if (rc == PARSE_MESSAGE && on_messages != NULL) {
+			batch_message(ws_connection);
+			if (ws_connection->cold->batch_count == MESSAGE_BATCH_MAX) {
+				deliver_batch(ws_connection);
+			}
+		} else if (rc == PARSE_MESSAGE) {
+			on_message(ws_connection);
+
+			if (ws_connection->replies_length > 0 && ws_connection->coalesce_usecs == 0) {
+				ws_flush(ws_connection);
+			}
+
+			release_message(ws_connection);
+			ws_connection->processed_frames = 0;
+		}
+	}
+
+	// the messages before a close frame are still delivered
+	deliver_batch(ws_connection);
+
+	if (rc == PARSE_CLOSE) {
+		close_connection(ws_connection);
+		return -1;
+	}
+
+	return 1;
+}
+
+/**
+ *  @brief                  remove a connection from its reactor and release it. Only called by the reactor thread
+ */
+static void 
+close_connection(ws_connection_t *ws_connection) {
+	DEBUG_PRINT("connection with id %u closed by its reactor\n", ws_connection->cold->thread_id);
+
+	reactor_remove(ws_connection->reactor, ws_connection->fd);
+	reactor_forget(ws_connection->reactor, &ws_connection->reactor_entry);
+	release_connection(ws_connection, MSG_DONTWAIT);
+}
+
+/**
+ *  @brief                  choose the reactor of a new connection round robin, reactors reserved for a service 
+ *                          class are skipped unless all of them are reserved
+ */
+static reactor_t *
+pick_reactor(void) {
+	int index, reserved;
+
+	for (int i = 0; i < reactor_count; ++i) {
+		index = next_reactor++ % reactor_count;
+		reserved = 0;
+
+		for (int j = 0; j < QOS_CLASSES; ++j) {
+			reserved |= (qos_classes[j].reactor == index);
+		}
+
+		if (!reserved) {
+			return &reactors[index];
+		}
+	}
+
+	return &reactors[next_reactor++ % reactor_count];
+}
+
+/**
+ *  @brief                  the reactor reserved for the class of a connection
+ *
+ *  @return                 the reactor, or NULL if the class shares all reactors
+ */
+static reactor_t *
+qos_reactor(ws_connection_t *ws_connection) {
+	int index;
+
+	index = qos_classes[ws_connection->qos_class].reactor;
+
+	return (index >= 0 && index < reactor_count) ? &reactors[index] : NULL;
+}
+
+/**
+ *  @brief                  run the calling reactor thread at the nice value of the class its reactor is 
+ *                          reserved for, shared reactors keep the priority of the process
+ */
+static void 
+qos_reactor_priority(reactor_t *reactor) {
+	for (int i = 0; i < QOS_CLASSES; ++i) {
+		if (qos_classes[i].reactor >= 0 && qos_classes[i].reactor < reactor_count 
+			&& &reactors[qos_classes[i].reactor] == reactor 
+			&& setpriority(PRIO_PROCESS, syscall(SYS_gettid), qos_classes[i].nice) == -1) {
+			perror("setpriority error");
+		}
+	}
+}
+
+/**
+ *  @brief                  move a connection to the reactor reserved for its class, called by the reactor serving 
+ *                          it at the end of its turn. The new reactor picks it up through epoll
+ *
+ *  @param ws_connection    the connection, not in the ready list
+ *  @param reactor          the reactor serving it
+ *  @return                 1 if the connection has moved, or 0 if it stays
+ */
+static int 
+qos_move(ws_connection_t *ws_connection, reactor_t *reactor) {
+	reactor_t *target;
+
+	target = qos_reactor(ws_connection);
+	if (target == NULL || target == reactor) {
+		return 0;
+	}
+
+	reactor_remove(reactor, ws_connection->fd);
+	reactor_forget(reactor, &ws_connection->reactor_entry);
+	ws_connection->reactor = target;
+
+	if (reactor_add(target, ws_connection->fd, &ws_connection->reactor_entry, ws_connection) == -1) {
+		ws_connection->reactor = reactor;
+		reactor_add(reactor, ws_connection->fd, &ws_connection->reactor_entry, ws_connection);
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ *  @brief                  let the coroutine of a connection move to the reactor of its class. Called between 
+ *                          messages and after on_connection, where it holds no locks and nothing on its stack 
+ *                          belongs to the reactor it leaves. A no-op for connection threads
+ *
+ *  @param ws_connection    the connection of the running coroutine
+ */
+static void 
+qos_move_point(ws_connection_t *ws_connection) {
+	reactor_t *target;
+
+	if (ws_connection->coroutine == NULL) {
+		return;
+	}
+
+	target = qos_reactor(ws_connection);
+	if (target == NULL || target == ws_connection->reactor) {
+		return;
+	}
+
+	ws_connection->move_pending = 1;
+	ws_connection->requeue = 1;
+	coroutine_yield();
+}
+
+/**
+ *  @brief                  run a reactor whose connections are coroutines. A ready connection is resumed and runs 
+ *                          until its turn is used up or it waits for its socket
+ *
+ *  @param param            the reactor_t to run
+ */
+static void *
+ws_coroutine_thread(void *param) {
+	reactor_t *reactor = (reactor_t *) param;
+	int ready;
+
+	set_io_wait(coroutine_wait_io);
+	qos_reactor_priority(reactor);
+
+	// a coroutine overflowing into its guard page is only recorded from the alternate stack
+	recorder_signal_stack();
+
+	for (;;) {
+		ready = reactor_wait(reactor, 1);
+		if (ready == -1) {
+			if (errno != EINTR) {
+				perror("epoll_wait error");
+			}
+			continue;
+		}
+
+		while (ready-- > 0) {
+			coroutine_turn(reactor, reactor_next(reactor));
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ *  @brief                  resume the coroutine of a ready connection for one turn. Afterwards it goes back to the 
+ *                          ready list, waits for its socket or moves to the reactor of its class
+ *
+ *  @param reactor          the reactor of the calling thread
+ *  @param entry            the entry returned by reactor_next
+ */
+static void 
+coroutine_turn(reactor_t *reactor, reactor_entry_t *entry) {
+	ws_connection_t *connection;
+	coroutine_t *co;
+
+	connection = (ws_connection_t *) entry->owner;
+	co = connection->coroutine;
+
+	connection->turn_frames = 0;
+	connection->requeue = 0;
+	running_connection = connection;
+
+	// an ended coroutine has released its connection already
+	if (coroutine_resume(co)) {
+		running_connection = NULL;
+		coroutine_destroy(co);
+		return;
+	}
+
+	running_connection = NULL;
+
+	// only a coroutine that yielded at qos_move_point moves, elsewhere it may hold locks or wait for this reactor
+	if (connection->move_pending) {
+		connection->move_pending = 0;
+		if (qos_move(connection, reactor)) {
+			return;
+		}
+	}
+
+	reactor_requeue(reactor, entry, connection->requeue);
+}
+
+/**
+ *  @brief                  turn of the coalescing timer of an embedded server: wake the connections whose replies 
+ *                          are due, their coroutines send them, see coroutine_wait_io
+ *
+ *  @param reactor          the reactor of the server
+ */
+static void 
+wake_due_connections(reactor_t *reactor) {
+	uint64_t expirations, now, next, deadline;
+
+	pthread_mutex_lock(&connections_lock);
+
+	if (read(flush_timer, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+		perror("timerfd read error");
+	}
+
+	pthread_mutex_lock(&flusher_lock);
+	flusher_deadline = UINT64_MAX;
+	pthread_mutex_unlock(&flusher_lock);
+
+	now = latency_now();
+	next = UINT64_MAX;
+
+	for (int i = 0; i < max_con; ++i) {
+		if (connections[i] == NULL || (deadline = connections[i]->coalesce_deadline) == 0) {
+			continue;
+		}
+
+		if (deadline <= now) {
+			reactor_wake(reactor, &connections[i]->reactor_entry);
+		} else if (deadline < next) {
+			next = deadline;
+		}
+	}
+	pthread_mutex_unlock(&connections_lock);
+
+	if (next != UINT64_MAX) {
+		schedule_flush(next);
+	}
+}
+
+/**
+ *  @brief                  run an embedded server for a while, e.g. while ws_server_drain waits for the clients
+ *
+ *  @param msecs            time to run in milliseconds
+ */
+static void 
+embed_run(int msecs) {
+	struct pollfd fd;
+	uint64_t end, now;
+
+	fd.fd = reactors[0].epoll_fd;
+	fd.events = POLLIN;
+	end = latency_now() + (uint64_t) msecs * 1000000;
+
+	while ((now = latency_now()) < end) {
+		if (ws_server_process(REACTOR_EVENTS) == 0) {
+			poll(&fd, 1, (end - now + 999999) / 1000000);
+		}
+	}
+}
+
+/**
+ *  @brief                  io_wait of the coroutine reactors: suspend the running coroutine until the socket is ready
+ *
+ *  @param fd               the socket, usually the one of the running connection
+ *  @param events           POLLIN or POLLOUT
+ */
+static void 
+coroutine_wait_io(int fd, short events) {
+	ws_connection_t *connection = running_connection;
+	int watched;
+
+	if (connection == NULL) {
+		return;
+	}
+
+	if (fd != connection->fd) {
+		// the socket of another connection, a duplicate of it is watched for this coroutine until it is ready
+		watched = dup(fd);
+		if (watched == -1 || reactor_watch(connection->reactor, watched, &connection->reactor_entry,
+				(events & POLLOUT) ? EPOLLOUT : EPOLLIN) == -1) {
+			perror("coroutine wait error");
+			if (watched != -1) close(watched);
+			connection->requeue = 1;
+			coroutine_yield();
+			return;
+		}
+
+		coroutine_park(connection);
+		reactor_remove(connection->reactor, watched);
+		close(watched);
+	} else if (events & POLLOUT) {
+		reactor_modify(connection->reactor, fd, &connection->reactor_entry, EPOLLOUT);
+		connection->requeue = 0;
+		coroutine_yield();
+		reactor_modify(connection->reactor, fd, &connection->reactor_entry, EPOLLIN);
+	} else {
+		connection->requeue = 0;
+		coroutine_yield();
+
+		// replies that became due while it waited, see wake_due_connections
+		if (connection->coalesce_deadline != 0 && connection->coalesce_deadline <= latency_now()) {
+			ws_flush(connection);
+		}
+	}
+}
+
+/**
+ *  @brief                  charge bytes read and frames completed to the turn of a coroutine, it yields once 
+ *                          either budget is used up and continues in the next round
+ */
+static void 
+coroutine_budget(ws_connection_t *ws_connection, uint64_t bytes, int frame) {
+	ws_connection->reactor_entry.deficit -= bytes;
+	ws_connection->turn_frames += frame;
+
+	if (ws_connection->reactor_entry.deficit <= 0 
+		|| ws_connection->turn_frames >= reactor_frame_budget * ws_connection->reactor_entry.weight) {
+		ws_connection->requeue = 1;
+		coroutine_yield();
+	}
+}
+
+/**
+ *  @brief                  wait for send_cond. The holder of the send slot may be a coroutine suspended on the same 
+ *                          reactor, so coroutines park until send_signal rings the doorbell of their reactor
+ *
+ *  @param connection       the connection, send_lock is held
+ */
+static void 
+send_wait(ws_connection_t *connection) {
+	ws_connection_t *self, **link;
+
+	self = running_connection;
+	if (self == NULL) {
+		pthread_cond_wait(&connection->send_cond, &connection->send_lock);
+		return;
+	}
+
+	self->wait_next = connection->send_waiters;
+	connection->send_waiters = self;
+	pthread_mutex_unlock(&connection->send_lock);
+
+	coroutine_park(self);
+
+	// resumed for another reason, e.g. the coalescing timer of an embedded server, it is still listed
+	pthread_mutex_lock(&connection->send_lock);
+	for (link = &connection->send_waiters; *link != NULL; link = &(*link)->wait_next) {
+		if (*link == self) {
+			*link = self->wait_next;
+			break;
+		}
+	}
+}
+
+/**
+ *  @brief                  wake everyone waiting for the send slots of a connection, threads and parked coroutines
+ *
+ *  @param connection       the connection, send_lock is held
+ */
+static void 
+send_signal(ws_connection_t *connection) {
+	ws_connection_t *waiter;
+
+	pthread_cond_broadcast(&connection->send_cond);
+
+	// rung under send_lock, so a waiter can't be resumed otherwise and freed before its bell
+	while ((waiter = connection->send_waiters) != NULL) {
+		connection->send_waiters = waiter->wait_next;
+		reactor_ring(waiter->reactor, &waiter->reactor_entry);
+	}
+}
+
+/**
+ *  @brief                  suspend the running coroutine until its entry is rung or a socket watched for it with 
+ *                          reactor_watch gets ready. Its own socket is not watched meanwhile, input waiting there 
+ *                          would resume it over and over
+ *
+ *  @param self             the connection of the running coroutine
+ */
+static void 
+coroutine_park(ws_connection_t *self) {
+	reactor_remove(self->reactor, self->fd);
+	self->requeue = 0;
+	coroutine_yield();
+	reactor_watch(self->reactor, self->fd, &self->reactor_entry, EPOLLIN);
+}
+
+/**
+ *  @brief                  check without blocking whether the socket holds a whole single frame data message
+ *
+ *  @param fd               the socket of the connection
+ *  @return                 1 if the next frame is a final data frame and completely received, 0 otherwise. Control 
+ *							frames end the batch, so the messages before a close frame are delivered first
+ */
+static int
+frame_buffered(int fd) {
+	uint8_t header[14];
+	uint64_t payload_length;
+	ssize_t peeked;
+	int header_length, available;
+
+	peeked = recv(fd, header, sizeof(header), MSG_PEEK | MSG_DONTWAIT);
+	if (peeked < 2 || (header[0] & 0x80) == 0 || (header[0] & 0x08) != 0) {
+		return 0;
+	}
+
+	payload_length = header[1] & 0x7F;
+	header_length = 6;
+
+	if (payload_length == 126) {
+		if (peeked < 4) return 0;
+		payload_length = (uint64_t) header[2] << 8 | header[3];
+		header_length = 8;
+	} else if (payload_length == 127) {
+		if (peeked < 10) return 0;
+		memcpy(&payload_length, header + 2, sizeof(payload_length));
+		payload_length = be64toh(payload_length);
+		header_length = 14;
+	}
+
+	if (ioctl(fd, FIONREAD, &available) == -1) {
+		return 0;
+	}
+
+	return (uint64_t) available >= header_length + payload_length;
+}
+
+/*      0                   1                   2                   3
+      0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+     +-+-+-+-+-------+-+-------------+-------------------------------+
+     |F|R|R|R| opcode|M| Payload len |    Extended payload length    |
+     |I|S|S|S|  (4)  |A|     (7)     |             (16/64)           |
+     |N|V|V|V|       |S|             |   (if payload len==126/127)   |
+     | |1|2|3|       |K|             |                               |
+     +-+-+-+-+-------+-+-------------+ - - - - - - - - - - - - - - - +
+     |     Extended payload length continued, if payload len == 127  |
+     + - - - - - - - - - - - - - - - +-------------------------------+
+     |                               |Masking-key, if MASK set to 1  |
+     +-------------------------------+-------------------------------+
+     | Masking-key (continued)       |          Payload Data         |
+     +-------------------------------- - - - - - - - - - - - - - - - +
+     :                     Payload Data continued ...                :
+     + - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - +
+     |                     Payload Data continued ...                |
+     +---------------------------------------------------------------+
+*/
+
+/**
+ *  @brief                  receive a websocket message on a connection thread. The parser is fed with exactly the 
+ *							bytes it asks for, so the reads match the frame layout
+ *
+ *  @param ws_connection    ws_connection_t instance representing an open websocket connection 
+ *  @return                 RCV_DATA (0) once a data message is complete, RCV_ERR_CONNECTION_LOST if the socket 
+ *							failed or the client shut it down, or RCV_CON_CLOSE for protocol errors and close frames. 
+ *							Both end the connection
+ */
+static int
+ws_process_message(ws_connection_t *ws_connection) {
+	uint8_t *target;
+	uint64_t wanted;
+	int rc;
+
+	for (;;) {
+		wanted = parse_want(ws_connection, &target);
+
+		// a coroutine reads no more than its turn allows, big frames are spread over several turns
+		if (ws_connection->coroutine != NULL && wanted > (uint64_t) ws_connection->reactor_entry.deficit) {
+			wanted = ws_connection->reactor_entry.deficit;
+		}
+
+		rc = recv_bytes_busy(ws_connection->fd, target, wanted, ws_connection->spin_budget);
+		if (rc < 0) {
+			// -1 is the orderly shutdown of the client, errno only belongs to -2
+			recorder_event(RECORDER_ERROR, 1006, ws_connection->recorder_id, (rc == -2) ? errno : 0);
+			return RCV_ERR_CONNECTION_LOST;
+		}
+
+		// stamped after the first read of the message, so waiting for it stays with recv_bytes_busy. The 
+		// client always sends a mask key after the header, that is still queued and carries the same stamp
+		if (ws_connection->processed_frames == 0 && ws_connection->header_received == 0) {
+			LATENCY_NOW(ws_connection->read_start);
+			LATENCY_RX_TIMESTAMP(ws_connection->fd, &ws_connection->rx_timestamp);
+			LATENCY_RECORD_QUEUE(&ws_connection->rx_timestamp);
+		}
+
+		rc = parse_advance(ws_connection, wanted);
+		if (rc == PARSE_CLOSE) {
+			return RCV_CON_CLOSE;
+		}
+
+		if (ws_connection->coroutine != NULL) {
+			coroutine_budget(ws_connection, wanted, rc != PARSE_MORE);
+		}
+
+		if (rc == PARSE_MESSAGE) {
+			return RCV_DATA;
+		}
+	}
+}
+
+/**
+ *  @brief                  reset the parser to the start of the next frame
+ */
+static void
+parse_reset(ws_connection_t *ws_connection) {
+	ws_connection->parse_state = PARSE_HEADER;
+	ws_connection->header_length = 2;
+	ws_connection->header_received = 0;
+	ws_connection->payload_received = 0;
+}
+
+/**
+ *  @brief                  tell where the parser wants the next bytes of the connection. Frame headers are 
+ *							collected in raw_header, data payloads go straight into the message buffer and 
+ *							control payloads into the control buffer
+ *
+ *  @param ws_connection    the websocket connection
+ *  @param target           receives the address to store the next bytes at
+ *  @return                 the amount of bytes missing in the current part of the frame, never 0
+ */
+static uint64_t
+parse_want(ws_connection_t *ws_connection, uint8_t **target) {
+	if (ws_connection->parse_state == PARSE_HEADER) {
+		*target = ws_connection->raw_header + ws_connection->header_received;
+		return ws_connection->header_length - ws_connection->header_received;
+	}
+
+	if (ws_connection->frame.op_code & 0x08) {
+		*target = ws_connection->cold->control + ws_connection->payload_received;
+	} else {
+		*target = segment_end(ws_connection) + ws_connection->payload_received;
+	}
+
+	return ws_connection->frame.payload_length - ws_connection->payload_received;
+}
+
+/**
+ *  @brief                  hand bytes stored at the address returned by parse_want to the parser
+ *
+ *  @param ws_connection    the websocket connection
+ *  @param count            the amount of bytes stored, at most the amount returned by parse_want
+ *  @return                 PARSE_MORE if the frame is incomplete, PARSE_FRAME if a frame has been processed, 
+ *							PARSE_MESSAGE if a data message is complete, or PARSE_CLOSE if the connection has to 
+ *							be closed: protocol errors, messages too big, and close frames
+ */
+static int
+parse_advance(ws_connection_t *ws_connection, uint64_t count) {
+	ws_frame_header_t *frame_header;
+	uint8_t *raw_header, *payload;
+	int rc;
+
+	frame_header = &ws_connection->frame;
+	raw_header = ws_connection->raw_header;
+
+	if (ws_connection->parse_state == PARSE_PAYLOAD) {
+		// unmask the new bytes, the mask continues where the last read stopped
+		payload = (frame_header->op_code & 0x08) ? ws_connection->cold->control : segment_end(ws_connection);
+		unmask_payload(payload, ws_connection->payload_received, count, frame_header->mask);
+
+		ws_connection->payload_received += count;
+		if (ws_connection->payload_received < frame_header->payload_length) {
+			return PARSE_MORE;
+		}
+
+		return parse_frame_complete(ws_connection);
+	}
+
+	ws_connection->header_received += count;
+	if (ws_connection->header_received < ws_connection->header_length) {
+		return PARSE_MORE;
+	}
+
+	if (ws_connection->header_length == 2) {
+		frame_header->fin = raw_header[0] & 0x80;
+		frame_header->rsv = raw_header[0] & 0x70;
+		frame_header->op_code = raw_header[0] & 0x0F;
+		frame_header->masked = raw_header[1] & 0x80;	
+		frame_header->payload_length = raw_header[1] & 0x7F;
+
+		if (frame_header->masked == 0 
+			|| frame_header->rsv != 0 
+			|| (frame_header->op_code > OPCODE_BINARY && frame_header->op_code < OPCODE_CON_CLOSE)
+			|| frame_header->op_code > OPCODE_PONG
+			|| (((frame_header->op_code & 0x08) == 0) && 
+						((ws_connection->processed_frames == 0 && frame_header->op_code == 0) 
+					 || (ws_connection->processed_frames > 0 && frame_header->op_code != 0)))
+			|| (((frame_header->op_code & 0x08) == 0x08) && (frame_header->payload_length > 125 || frame_header->fin == 0))
+		) {
+			// close the tcp connection due to RCV_ERR_PROTOCOLL
+			recorder_event(RECORDER_ERROR, 1002, ws_connection->recorder_id, 0);
+			return PARSE_CLOSE;
+		}
+
+		// the extended length and the mask follow
+		if (frame_header->payload_length == 126) {
+			ws_connection->header_length = 8;
+		} else if (frame_header->payload_length == 127) {
+			ws_connection->header_length = 14;
+		} else {
+			ws_connection->header_length = 6;
+		}
+
+		return PARSE_MORE;
+	}
+
+	if (frame_header->payload_length == 126) {
+		frame_header->payload_length = (long) raw_header[2] << 8 | (long) raw_header[3];
+	} else if (frame_header->payload_length == 127) {
+		frame_header->payload_length = 0;
+		
+		for (int i = 0; i < 8; ++i) {
+			frame_header->payload_length |= (long) raw_header[2 + i] << 8 * (7 - i);
+		}
+	}
+
+	recorder_event(RECORDER_FRAME, raw_header[0], ws_connection->recorder_id, frame_header->payload_length);
+
+	// with spilling the limit applies to whole messages, otherwise to each frame
+	if ((spill_threshold == 0 && frame_header->payload_length >= MAX_FRAME_SIZE_RCV)
+		|| (spill_threshold > 0 && ws_connection->message_length + frame_header->payload_length > spill_max_message)) {
+		handle_error(ws_connection, RCV_ERR_PAYLOAD_SIZE);
+		return PARSE_CLOSE;
+	}
+
+	memcpy(frame_header->mask, raw_header + ws_connection->header_length - 4, 4);
+
+	if ((frame_header->op_code & 0x08) == 0) {
+		rc = reserve_segment(ws_connection, frame_header->payload_length);
+		if (rc != 0) {
+			handle_error(ws_connection, rc);
+			return PARSE_CLOSE;
+		}
+	}
+
+	ws_connection->parse_state = PARSE_PAYLOAD;
+	ws_connection->payload_received = 0;
+
+	if (frame_header->payload_length > 0) {
+		return PARSE_MORE;
+	}
+
+	return parse_frame_complete(ws_connection);
+}
+
+/**
+ *  @brief                  process a frame whose payload has been received and unmasked
+ *
+ *  @return                 PARSE_FRAME, PARSE_MESSAGE or PARSE_CLOSE, see parse_advance
+ */
+static int
+parse_frame_complete(ws_connection_t *ws_connection) {
+	ws_frame_header_t *frame_header;
+	uint8_t *payload;
+	LATENCY_DECLARE(utf8_end);
+
+	frame_header = &ws_connection->frame;
+	parse_reset(ws_connection);
+
+	// the messages of a reactor turn come first, their replies can't follow a close frame
+	if ((frame_header->op_code & 0x08) && ws_connection->cold->batch_count > 0) {
+		deliver_batch(ws_connection);
+	}
+
+	switch (frame_header->op_code) {
+		case OPCODE_CON_CLOSE:
+			recorder_event(RECORDER_CLOSE_RECEIVED, (frame_header->payload_length >= 2) 
+				? ws_connection->cold->control[0] << 8 | ws_connection->cold->control[1] : 0, ws_connection->recorder_id, 0);
+
+			// response to sent close frame received, close immediatly
+			if (ws_connection->close_sent == 1) {
+				return PARSE_CLOSE;
+			}
+
+			capture_frame(ws_connection, frame_header, ws_connection->cold->control);
+			handle_close_frame(ws_connection, frame_header, ws_connection->cold->control);
+			return PARSE_CLOSE;
+		case OPCODE_PING:
+			capture_frame(ws_connection, frame_header, ws_connection->cold->control);
+			return (handle_ping_frame(ws_connection, frame_header, ws_connection->cold->control) == -1) ? PARSE_CLOSE : PARSE_FRAME;
+		case OPCODE_PONG:
+			capture_frame(ws_connection, frame_header, ws_connection->cold->control);
+			return PARSE_FRAME;
+		case OPCODE_TEXT:
+			ws_connection->message_type = MESSAGE_TYPE_TXT;
+			memset(&ws_connection->utf8, 0, sizeof(ws_connection->utf8));
+			break;
+		case OPCODE_BINARY:
+			ws_connection->message_type = MESSAGE_TYPE_BIN;
+			break;
+	}
+
+	payload = segment_end(ws_connection);
+	capture_frame(ws_connection, frame_header, payload);
+
+	if (frame_header->payload_length > 0) {
+		ws_connection->segments[ws_connection->segment_count - 1].length += frame_header->payload_length;
+	}
+	ws_connection->message_length += frame_header->payload_length;
+	ws_connection->processed_frames++;
+
+	if (!frame_header->fin) {
+		// fragments are validated as they arrive, invalid text fails before the rest of the message is read
+		if (ws_connection->message_type == MESSAGE_TYPE_TXT 
+			&& !utf8_validate(&ws_connection->utf8, payload, frame_header->payload_length)) {
+			recorder_event(RECORDER_ERROR, 1007, ws_connection->recorder_id, 0);
+			return PARSE_CLOSE;
+		}
+
+		return PARSE_FRAME;
+	}
+
+	LATENCY_NOW(ws_connection->message_complete);
+	LATENCY_RECORD(STAGE_PARSE, ws_connection->read_start, ws_connection->message_complete);
+
+	if (ws_connection->spill_fd != -1) {
+		ws_connection->segments[0].capacity = spill_finish(ws_connection->spill_fd, ws_connection->segments[0].data, 
+			ws_connection->segments[0].capacity, ws_connection->message_length);
+		ws_connection->spill_fd = -1;
+	}
+
+	if (ws_connection->message_type == MESSAGE_TYPE_TXT) {
+		if (!utf8_validate(&ws_connection->utf8, payload, frame_header->payload_length) || ws_connection->utf8.need != 0) {
+			recorder_event(RECORDER_ERROR, 1007, ws_connection->recorder_id, 0);
+			return PARSE_CLOSE;
+		}
+
+		LATENCY_NOW(utf8_end);
+		LATENCY_RECORD(STAGE_UTF8, ws_connection->message_complete, utf8_end);
+		LATENCY_NOW(ws_connection->message_complete);
+	}
+
+	// nothing is delivered after the close frame has been sent, the client's answer is still awaited
+	if (ws_connection->close_sent == 1) {
+		release_message(ws_connection);
+		ws_connection->processed_frames = 0;
+		return PARSE_FRAME;
+	}
+
+	// a chain is copied at most once, when the whole message is there
+	if (ws_connection->segment_count == 1) {
+		ws_connection->message = ws_connection->segments[0].data;
+	} else if (ws_connection->segment_count > 1 && (ws_connection->scatter_gather == 0 || on_messages != NULL)
+		&& ws_message_flatten(ws_connection) == NULL) {
+		return PARSE_CLOSE;
+	}
+
+	return PARSE_MESSAGE;
+}
+
+/**
+ *  @brief                  make room for the next payload_length bytes of the message. A fragment goes into the 
+ *							last buffer of the chain if it fits, otherwise into a new one: pooled for small 
+ *							fragments, sized to the fragment for bigger ones. Nothing received is copied again. 
+ *							Messages above the spill threshold move to a spill file, see ws_server_set_spill
+ *
+ *  @return                 0 if successful, or the RCV_ERR_* code to close the connection with
+ */
+static int
+reserve_segment(ws_connection_t *ws_connection, uint64_t payload_length) {
+	ws_segment_t *segment, *grown;
+
+	if (payload_length == 0) {
+		return 0;
+	}
+
+	if (spill_threshold > 0 && ws_connection->message_length + payload_length > spill_threshold) {
+		return spill_segment(ws_connection, ws_connection->message_length + payload_length);
+	}
+
+	if (ws_connection->segment_count > 0) {
+		segment = &ws_connection->segments[ws_connection->segment_count - 1];
+		if (segment->capacity - segment->length >= payload_length) {
+			return 0;
+		}
+	}
+
+	if (ws_connection->segment_count == ws_connection->segment_capacity) {
+		grown = (ws_segment_t *) malloc(sizeof(ws_segment_t) * ws_connection->segment_capacity * 2);
+		if (grown == NULL) {
+			return RCV_ERR_NO_MEMORY;
+		}
+
+		memcpy(grown, ws_connection->segments, sizeof(ws_segment_t) * ws_connection->segment_count);
+		if (ws_connection->segments != ws_connection->cold->inline_segments) {
+			free(ws_connection->segments);
+		}
+
+		ws_connection->segments = grown;
+		ws_connection->segment_capacity *= 2;
+	}
+
+	segment = &ws_connection->segments[ws_connection->segment_count];
+
+	if (payload_length <= POOL_BUFFER_SIZE) {
+		segment->data = (uint8_t *) pool_get();
+		segment->capacity = POOL_BUFFER_SIZE;
+		segment->storage = STORAGE_POOL;
+	} else {
+		segment->data = (uint8_t *) malloc(payload_length);
+		segment->capacity = payload_length;
+		segment->storage = STORAGE_HEAP;
+	}
+
+	if (segment->data == NULL) {
+		return RCV_ERR_NO_MEMORY;
+	}
+
+	segment->length = 0;
+	ws_connection->segment_count++;
+
+	return 0;
+}
+
+/**
+ *  @brief                  make room for a message of required bytes in its spill file. The file is created 
+ *							when the message crosses the threshold, the segments received so far are copied 
+ *							into it once. After that the file grows by doubling, its pages are remapped, not copied
+ *
+ *  @param required         length of the message including the frame to receive
+ *  @return                 0 if successful, or the RCV_ERR_* code to close the connection with
+ */
+static int
+spill_segment(ws_connection_t *ws_connection, uint64_t required) {
+	ws_segment_t *segment;
+	uint64_t size, offset;
+	uint8_t *data;
+	int fd;
+
+	segment = &ws_connection->segments[0];
+
+	if (ws_connection->segment_count == 1 && segment->storage == STORAGE_SPILL) {
+		if (segment->capacity >= required) {
+			return 0;
+		}
+
+		size = (segment->capacity * 2 > required) ? segment->capacity * 2 : required;
+		size = spill_size((size < spill_max_message) ? size : spill_max_message);
+
+		data = spill_grow(ws_connection->spill_fd, segment->data, segment->capacity, size);
+		if (data == NULL) {
+			return (errno == ENOSPC) ? RCV_ERR_SPILL_BUDGET : RCV_ERR_NO_MEMORY;
+		}
+
+		segment->data = data;
+		segment->capacity = size;
+
+		return 0;
+	}
+
+	size = spill_size(required);
+
+	data = spill_map(size, &fd);
+	if (data == NULL) {
+		return (errno == ENOSPC) ? RCV_ERR_SPILL_BUDGET : RCV_ERR_NO_MEMORY;
+	}
+
+	offset = 0;
+	for (uint32_t i = 0; i < ws_connection->segment_count; ++i) {
+		memcpy(data + offset, ws_connection->segments[i].data, ws_connection->segments[i].length);
+		offset += ws_connection->segments[i].length;
+		release_buffer(ws_connection->segments[i].data, ws_connection->segments[i].capacity, ws_connection->segments[i].storage);
+	}
+
+	segment->data = data;
+	segment->length = offset;
+	segment->capacity = size;
+	segment->storage = STORAGE_SPILL;
+	ws_connection->segment_count = 1;
+	ws_connection->spill_fd = fd;
+
+	return 0;
+}
+
+/**
+ *  @brief                  the address behind the last byte of the message, where the payload of the current 
+ *							frame is received
+ *
+ *  @return                 the address, or NULL if the message has no buffer yet
+ */
+static uint8_t *
+segment_end(ws_connection_t *ws_connection) {
+	ws_segment_t *segment;
+
+	if (ws_connection->segment_count == 0) {
+		return NULL;
+	}
+
+	segment = &ws_connection->segments[ws_connection->segment_count - 1];
+
+	return segment->data + segment->length;
+}
+
+/**
+ *  @brief                  unmask bytes of a payload, 8 bytes at a time
+ *
+ *  @param payload          start of the payload
+ *  @param offset           position of the first byte to unmask, the mask continues where the last read stopped
+ *  @param count            the amount of bytes to unmask
+ *  @param mask             the masking key of the frame
+ */
+static void
+unmask_payload(uint8_t *payload, uint64_t offset, uint64_t count, uint8_t *mask) {
+	uint64_t word, mask_word, i, end;
+	uint8_t rotated[8];
+
+	end = offset + count;
+
+	for (int j = 0; j < 8; ++j) {
+		rotated[j] = mask[(offset + j) % 4];
+	}
+	memcpy(&mask_word, rotated, 8);
+
+	for (i = offset; i + 8 <= end; i += 8) {
+		memcpy(&word, payload + i, 8);
+		word ^= mask_word;
+		memcpy(payload + i, &word, 8);
+	}
+
+	for (; i < end; ++i) {
+		payload[i] ^= mask[i % 4];
+	}
+}
+
+static void 
+handle_close_frame(ws_connection_t *ws_connection, ws_frame_header_t *frame_header, uint8_t *close_data) {
+	ws_connection->status = CLOSING;
+
+	uint8_t close_payload[40];
+	int close_payload_len;
+
+	if (frame_header->payload_length == 0) {
+		create_close_payload(1000, close_payload, &close_payload_len); 
+	} else if (frame_header->payload_length == 1) {
+		create_close_payload(1002, close_payload, &close_payload_len); 
+	} else {
+		if(!is_valid_utf8(close_data + 2, frame_header->payload_length - 2)) {
+			return;
+		} 
+		uint16_t close_code = close_data[0] << 8 | close_data[1];
+
+		int invalid_close_codes_size = sizeof(invalid_close_codes) / sizeof(uint16_t);
+		for (int i = 0; i < invalid_close_codes_size; ++i) {
+			if (invalid_close_codes[i] == close_code) { 
+				close_code = 1002;
+				break; 
+			}
+		} 
+
+		DEBUG_PRINT("Using code %u to close connection\n", close_code);
+		create_close_payload(close_code, close_payload, &close_payload_len); 
+	}
+
+	// connection has been properly closed ..
+	ws_send_message(ws_connection, close_payload, close_payload_len, OPCODE_CON_CLOSE);
+}
+
+static int 
+handle_ping_frame(ws_connection_t *ws_connection, ws_frame_header_t *frame_header, uint8_t *ping_data) {
+	return ws_send_message(ws_connection, ping_data, frame_header->payload_length, OPCODE_PONG);
+}
+
+/**
+ *  @brief                  send the close frame that belongs to a receive error
+ *
+ *  @param error            one of the RCV_ERR_* values of enum message_return_codes
+ *  @return                 0 if successful, or -1 if the frame could not be sent
+ */
+static int 
+handle_error(ws_connection_t *ws_connection, int error) {
+	uint16_t close_code;
+
+	switch (error) {
+		case RCV_ERR_PROTOCOLL:
+			close_code = 1002;
+			break;
+		case RCV_ERR_PAYLOAD_SIZE:
+			close_code = 1009;
+			break;
+		case RCV_ERR_SPILL_BUDGET:
+			close_code = 1013;
+			break;
+		default:
+			close_code = 1011;
+	}
+
+	recorder_event(RECORDER_ERROR, close_code, ws_connection->recorder_id, errno);
+
+	return send_close_frame(ws_connection, close_code);
+}
+
+/**
+ *  @brief                  send a close frame and wait for the client to answer it
+ *
+ *  @param ws_connection    the websocket connection
+ *  @param close_code       status code of the close frame
+ *  @return                 0 if successful, or -1 if the frame could not be sent
+ */
+static int 
+send_close_frame(ws_connection_t *ws_connection, uint16_t close_code) {
+	uint8_t close_payload[40];
+	int close_payload_len;	
+
+	create_close_payload(close_code, close_payload, &close_payload_len); 
+
+	if (ws_send_message(ws_connection, close_payload, close_payload_len, OPCODE_CON_CLOSE) == -1) {
+		return -1;
+	}
+
+	ws_connection->status = CLOSING;
+	ws_connection->close_sent = 1;
+
+	return 0;
+}
+
+/**
+ *  @brief                  send a close frame only if it can go out right away, for callers that must not wait 
+ *                          for the socket or the send slot while they hold connections_lock
+ *
+ *  @param ws_connection    the websocket connection
+ *  @param close_code       status code of the close frame
+ *  @return                 1 if the frame has been sent, 0 if the socket or the send slot is busy and the caller 
+ *                          should try again later, or -1 if the socket had to be shut down
+ */
+static int 
+try_close_frame(ws_connection_t *ws_connection, uint16_t close_code) {
+	uint8_t frame[10 + 40];
+	int header_len, close_payload_len;
+	ssize_t sent;
+
+	pthread_mutex_lock(&ws_connection->send_lock);
+
+	// replies still queued have to go first, their flush may be under way
+	if (ws_connection->frame_busy || ws_connection->replies_length > 0 || ws_connection->close_sent) {
+		pthread_mutex_unlock(&ws_connection->send_lock);
+		return 0;
+	}
+
+	ws_connection->frame_busy = 1;
+	ws_connection->send_started = recorder_now();
+	pthread_mutex_unlock(&ws_connection->send_lock);
+
+	create_close_payload(close_code, frame + 10, &close_payload_len);
+	header_len = build_frame_header(frame, 1, OPCODE_CON_CLOSE, close_payload_len);
+	memmove(frame + header_len, frame + 10, close_payload_len);
+
+	do {
+		sent = send(ws_connection->fd, frame, header_len + close_payload_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	} while (sent == -1 && errno == EINTR);
+
+	if (sent == header_len + close_payload_len) {
+		if (ws_connection->corked) {
+			socket_cork(ws_connection->fd, 0);
+			socket_cork(ws_connection->fd, 1);
+		}
+
+		ws_connection->close_sent = 1;
+		ws_connection->status = CLOSING;
+		recorder_event(RECORDER_CLOSE_SENT, close_code, ws_connection->recorder_id, 0);
+	} else if (sent != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+		// a partial frame can't be completed without waiting, the stream is broken anyway
+		shutdown(ws_connection->fd, SHUT_RDWR);
+		sent = -2;
+	}
+
+	frame_release(ws_connection);
+
+	return (sent > 0) ? 1 : (sent == -2) ? -1 : 0;
+}
+
+/**
+ *  @brief		wrapper function to send UTF-8 encoded text                                                
+ */
+int 
+send_ws_message_txt(ws_connection_t *connection, uint8_t *bytes, uint64_t length) {
+	return ws_send_message(connection, bytes, length, OPCODE_TEXT);
+}
+
+/**
+ *  @brief		wrapper function to send arbitrary binary data                                           
+ */
+int 
+send_ws_message_bin(ws_connection_t *connection, uint8_t *bytes, uint64_t length) {
+	return ws_send_message(connection, bytes, length, OPCODE_BINARY);
+}
+
+/**
+ *  @brief						send ws message. Control frames go out between the fragments of a data message in 
+ *								flight, data messages are sent one after another
+ *
+ *  @param connection 			the web socket connection struct  
+ *  @param message_bytes		the bytes to be transmitted over the established websocket connection
+ *  @param message_length		the amount of bytes to send. Most of the time this the length of the message bytes array
+ *  @param message_type			the available op codes according to the RFC
+ *  @return         			0 if the message has been transmitted successfully or -1 if the underlying connection has been closed                                                  
+ */
+static int 
+ws_send_message(ws_connection_t *connection, uint8_t *message_bytes, uint64_t message_length, uint8_t message_type) {
+	if (message_type & 0x08) {
+		return send_control_frame(connection, message_bytes, message_length, message_type);
+	}
+
+	if (connection != NULL && connection->coalesce_usecs > 0) {
+		return ws_queue_message(connection, message_bytes, message_length, message_type);
+	}
+
+	return send_data_message(connection, message_bytes, message_length, message_type, 0, NULL);
+}
+
+/**
+ *  @brief						send a small data message ahead of data messages that are still waiting. A message 
+ *								already in flight is finished first, as fragments of different messages must not 
+ *								interleave (RFC 6455, 5.4)
+ *
+ *  @param connection 			the web socket connection struct  
+ *  @param bytes				the bytes to be transmitted
+ *  @param length				the amount of bytes to send, at most MAX_FRAME_SIZE_SND
+ *  @param message_type			MESSAGE_TYPE_TXT or MESSAGE_TYPE_BIN
+ *  @return         			0 if the message has been transmitted successfully, or -1 in case of an error
+ */
+int 
+send_ws_message_priority(ws_connection_t *connection, uint8_t *bytes, uint64_t length, uint8_t message_type) {
+	if (length > MAX_FRAME_SIZE_SND) {
+		return -1;
+	}
+
+	return send_data_message(connection, bytes, length, message_type, 1, NULL);
+}
+
+/**
+ *  @brief						send a data message straight from the buffer of the caller with MSG_ZEROCOPY if the 
+ *								connection sends messages of this size zero copy, see ws_set_zerocopy. The buffer 
+ *								belongs to the server until release is called, which happens once the kernel has 
+ *								sent it, possibly on a later send or when the connection closes. Copying sends and 
+ *								failed sends release it before they return
+ *
+ *  @param connection 			the web socket connection struct  
+ *  @param bytes				the bytes to be transmitted, not modified until release is called
+ *  @param length				the amount of bytes to send
+ *  @param message_type			MESSAGE_TYPE_TXT or MESSAGE_TYPE_BIN
+ *  @param release				called exactly once with context and bytes, on the thread serving the connection 
+ *								or the one sending to it
+ *  @param context				passed to release
+ *  @return         			0 if the message has been transmitted successfully, or -1 in case of an error
+ */
+int 
+send_ws_message_zerocopy(ws_connection_t *connection, uint8_t *bytes, uint64_t length, uint8_t message_type, 
+	ws_release_callback_t release, void *context) {
+	zerocopy_buffer_t *buffer;
+	int rc;
+
+	// queued replies go first, a zero copy message never waits in the queue
+	rc = (connection != NULL && connection->replies_length > 0) ? ws_flush(connection) : 0;
+
+	buffer = zerocopy_buffer(bytes, release, context);
+	if (buffer == NULL) {
+		// without memory for the bookkeeping the message is copied
+		rc = (rc != -1) ? send_data_message(connection, bytes, length, message_type, 0, NULL) : -1;
+		release(context, bytes);
+		return rc;
+	}
+
+	if (rc != -1) {
+		rc = send_data_message(connection, bytes, length, message_type, 0, &buffer);
+	}
+
+	// send_data_message takes the buffer over if the kernel still sends from it
+	if (buffer != NULL) {
+		zerocopy_release(buffer);
+	}
+
+	return rc;
+}
+
+static int 
+send_control_frame(ws_connection_t *connection, uint8_t *payload, uint64_t payload_len, uint8_t op_code) {
+	int header_len, rc;
+	uint8_t frame_header[10];
+
+	if (!send_allowed(connection, op_code)) { 
+		return -1;
+	}
+
+	// messages still waiting in the reply queue go out before the close frame
+	if (op_code == OPCODE_CON_CLOSE && connection->replies_length > 0) {
+		ws_flush(connection);
+	}
+
+	frame_acquire(connection, 1);
+
+	header_len = build_frame_header(frame_header, 1, op_code, payload_len);
+	rc = send_bytes(connection->fd, frame_header, header_len, (payload_len > 0) ? MSG_MORE : 0);
+	if (rc != -1) {
+		rc = send_bytes(connection->fd, payload, payload_len, 0);
+	}
+
+	if (rc == -1) {
+		perror("socket send");
+	}
+
+	// push the frame past the cork of a message in flight, which stays corked afterwards
+	if (connection->corked) {
+		socket_cork(connection->fd, 0);
+		socket_cork(connection->fd, 1);
+	}
+
+	// nothing but the close frame may follow, fragments still to come are dropped
+	if (op_code == OPCODE_CON_CLOSE) {
+		connection->close_sent = 1;
+		recorder_event(RECORDER_CLOSE_SENT, (payload_len >= 2) ? payload[0] << 8 | payload[1] : 0, connection->recorder_id, 0);
+	}
+
+	frame_release(connection);
+
+	return rc;
+}
+
+/**
+ *  @brief						send a data message in fragments sized by next_fragment_size
+ *
+ *  @param buffer				NULL for a copying send, or the buffer of send_ws_message_zerocopy. It is taken 
+ *								over (set to NULL) if the message went out with MSG_ZEROCOPY
+ */
+static int 
+send_data_message(ws_connection_t *connection, uint8_t *message_bytes, uint64_t message_length, uint8_t message_type, int priority, zerocopy_buffer_t **buffer) {
+	if (!send_allowed(connection, message_type)) { 
+		return -1;
+	}
+
+	LATENCY_DECLARE(send_start);
+	LATENCY_NOW(send_start);
+
+	int header_len; 
+	uint8_t frame_header[10];
+	uint64_t payload_len;
+	int first, zerocopy, rc;
+
+	message_acquire(connection, priority);
+
+	// buffers of earlier messages the kernel is done with go back first
+	zerocopy_collect(connection);
+
+	zerocopy = buffer != NULL && connection->zerocopy_threshold > 0 && message_length >= connection->zerocopy_threshold;
+	first = 1;
+
+	do {
+		payload_len = next_fragment_size(connection, message_length);
+		payload_len = (message_length < payload_len) ? message_length : payload_len;
+		header_len = build_frame_header(frame_header, payload_len == message_length, first ? message_type : OPCODE_CONTINUATION, payload_len);
+
+		rc = frame_acquire(connection, 0);
+		if (rc != -1) {
+			// the throughput profile holds back partial segments until the whole message is queued
+			if (first && connection->socket_profile == SOCKET_PROFILE_THROUGHPUT) {
+				connection->corked = socket_cork(connection->fd, 1) == 0;
+			}
+
+			// send frame header, MSG_MORE lets it share a segment with the payload
+			rc = send_bytes(connection->fd, frame_header, header_len, (payload_len > 0) ? MSG_MORE : 0);
+			if (rc != -1) {
+				rc = zerocopy ? zerocopy_send(connection->fd, message_bytes, payload_len, 0, &connection->zerocopy)
+					: send_bytes(connection->fd, message_bytes, payload_len, 0);
+			}
+
+			if (rc == -1) {
+				perror("socket send");
+			}
+
+			frame_release(connection);
+		}
+
+		if (rc == -1) {
+			break;
+		}
+
+		message_bytes += payload_len;
+		message_length -= payload_len;
+		first = 0;
+	} while (message_length > 0);
+
+	// the kernel may still read from the buffer, also if a later send failed
+	if (zerocopy) {
+		pthread_mutex_lock(&connection->send_lock);
+		zerocopy_track(&connection->zerocopy, *buffer);
+		pthread_mutex_unlock(&connection->send_lock);
+		*buffer = NULL;
+	}
+
+	if (rc == -1) {
+		message_release(connection);
+		return -1;
+	}
+
+	connection->messages_sent++;
+	message_release(connection);
+
+	LATENCY_RECORD(STAGE_SEND, send_start, latency_now());
+
+	return 0;
+}
+
+/**
+ *  @brief						send a file as a fragmented binary message. The payload is copied by the kernel 
+ *								(sendfile, or splice for pipes), it never passes through user space
+ *
+ *  @param connection 			the web socket connection struct  
+ *  @param fd					the file descriptor to read from
+ *  @param offset				position in the file to start at. Ignored for pipes, which are read from their current position 
+ *  @param length				the amount of bytes to send
+ *  @return         			0 if the message has been transmitted successfully, or -1 in case of an error. If the file 
+ *								ended early or failed, the connection is shut down since the frame can't be completed
+ */
+int 
+send_ws_message_fd(ws_connection_t *connection, int fd, off_t offset, uint64_t length) {
+	int header_len, first, rc;
+	uint8_t frame_header[10];
+	uint64_t payload_len;
+	ssize_t sent;
+
+	if (!send_allowed(connection, OPCODE_BINARY)) { 
+		return -1;
+	}
+
+	message_acquire(connection, 0);
+
+	first = 1;
+	rc = 0;
+
+	do {
+		payload_len = next_fragment_size(connection, length);
+		payload_len = (length < payload_len) ? length : payload_len;
+		header_len = build_frame_header(frame_header, payload_len == length, first ? OPCODE_BINARY : OPCODE_CONTINUATION, payload_len);
+
+		if (frame_acquire(connection, 0) == -1) {
+			rc = -1;
+			break;
+		}
+
+		if (first && connection->socket_profile == SOCKET_PROFILE_THROUGHPUT) {
+			connection->corked = socket_cork(connection->fd, 1) == 0;
+		}
+
+		if (send_bytes(connection->fd, frame_header, header_len, (payload_len > 0) ? MSG_MORE : 0) == -1) {
+			perror("socket send");
+			frame_release(connection);
+			rc = -1;
+			break;
+		}
+
+		length -= payload_len;
+		first = 0;
+
+		while (payload_len > 0) {
+			sent = sendfile(connection->fd, fd, &offset, payload_len);
+			if (sent == -1 && (errno == EINVAL || errno == ESPIPE)) {
+				sent = splice(fd, NULL, connection->fd, NULL, payload_len, (length > 0) ? SPLICE_F_MORE : 0);
+			}
+
+			if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				wait_fd(connection->fd, POLLOUT);
+				continue;
+			}
+
+			if (sent <= 0) {
+				// the announced payload can't be delivered anymore
+				perror("sendfile");
+				shutdown(connection->fd, SHUT_RDWR);
+				rc = -1;
+				break;
+			}
+
+			payload_len -= sent;
+		}
+
+		frame_release(connection);
+	} while (rc == 0 && length > 0);
+
+	message_release(connection);
+
+	return rc;
+}
+
+/**
+ *  @brief						send a binary message of unknown length, produced chunk by chunk by a callback. 
+ *								Every chunk becomes a fragment, an empty final fragment ends the message
+ *
+ *  @param connection 			the web socket connection struct  
+ *  @param pull					fills a buffer of at most MAX_FRAME_SIZE_SND bytes and returns the amount of bytes 
+ *								written, 0 at the end of the data, or -1 in case of an error
+ *  @param context				passed to every call of pull
+ *  @return         			0 if the message has been transmitted successfully, or -1 in case of an error. If pull 
+ *								failed, the connection is shut down since the message can't be completed
+ */
+int 
+send_ws_message_pull(ws_connection_t *connection, ws_pull_callback_t pull, void *context) {
+	int header_len, first;
+	uint8_t frame_header[10];
+	uint8_t *buffer;
+	ssize_t chunk_len;
+
+	if (!send_allowed(connection, OPCODE_BINARY)) { 
+		return -1;
+	}
+
+	buffer = (uint8_t *) malloc(MAX_FRAME_SIZE_SND);
+	if (buffer == NULL) {
+		return -1;
+	}
+
+	message_acquire(connection, 0);
+
+	first = 1;
+
+	do {
+		// produce the chunk before taking the socket, control frames may go out meanwhile
+		chunk_len = pull(context, buffer, MAX_FRAME_SIZE_SND);
+		if (chunk_len < 0) {
+			if (!first) shutdown(connection->fd, SHUT_RDWR);
+			break;
+		}
+
+		header_len = build_frame_header(frame_header, chunk_len == 0, first ? OPCODE_BINARY : OPCODE_CONTINUATION, chunk_len);
+
+		if (frame_acquire(connection, 0) == -1) {
+			chunk_len = -1;
+			break;
+		}
+
+		if (first && connection->socket_profile == SOCKET_PROFILE_THROUGHPUT) {
+			connection->corked = socket_cork(connection->fd, 1) == 0;
+		}
+
+		if (send_bytes(connection->fd, frame_header, header_len, (chunk_len > 0) ? MSG_MORE : 0) == -1
+			|| send_bytes(connection->fd, buffer, chunk_len, 0) == -1) {
+			perror("socket send");
+			chunk_len = -1;
+		}
+
+		frame_release(connection);
+		first = 0;
+	} while (chunk_len > 0);
+
+	message_release(connection);
+	free(buffer);
+
+	return (chunk_len < 0) ? -1 : 0;
+}
+
+/**
+ *  @brief						size of the next fragment of a message, see fragment_size
+ *
+ *  @param connection 			the web socket connection struct  
+ *  @param remaining			bytes of the message still to send
+ *  @return         			the maximum payload of the next fragment
+ */
+static uint64_t 
+next_fragment_size(ws_connection_t *connection, uint64_t remaining) {
+	if (fixed_fragment_size > 0) {
+		return fixed_fragment_size;
+	}
+
+	// fits into the smallest fragment anyway, spare the socket queries
+	if (remaining <= FRAGMENT_SIZE_MIN) {
+		return FRAGMENT_SIZE_MIN;
+	}
+
+	return fragment_size(connection->fd, connection->socket_profile);
+}
+
+/**
+ *  @brief						take the socket for a single frame. Control frames go first, so a data message in 
+ *								flight only delays them by one fragment
+ *
+ *  @param connection 			the web socket connection struct  
+ *  @param control				1 for control frames, 0 for fragments of data messages
+ *  @return         			0 if the frame may be sent, or -1 if the close frame has been sent meanwhile
+ */
+static int 
+frame_acquire(ws_connection_t *connection, int control) {
+	uint64_t start;
+
+	start = recorder_now();
+	pthread_mutex_lock(&connection->send_lock);
+
+	if (control) connection->ctrl_pending++;
+
+	while (connection->frame_busy || (!control && connection->ctrl_pending > 0)) {
+		send_wait(connection);
+	}
+
+	if (control) connection->ctrl_pending--;
+
+	if (!control && connection->close_sent) {
+		pthread_mutex_unlock(&connection->send_lock);
+		return -1;
+	}
+
+	connection->frame_busy = 1;
+	connection->send_started = start;
+
+	// a non blocking flush cut a queued frame short, its rest goes out before anything else
+	if (connection->replies_partial > 0 && finish_partial_reply(connection) == -1) {
+		connection->frame_busy = 0;
+		send_signal(connection);
+		pthread_mutex_unlock(&connection->send_lock);
+		return -1;
+	}
+
+	pthread_mutex_unlock(&connection->send_lock);
+
+	return 0;
+}
+
+/**
+ *  @brief						send the rest of the frame flush_replies cut short. Called with send_lock held and 
+ *								the frame slot taken, the lock is released while the bytes are sent
+ *
+ *  @param connection 			the web socket connection struct  
+ *  @return         			0 if successful, or -1 in case of an error
+ */
+static int 
+finish_partial_reply(ws_connection_t *connection) {
+	uint8_t *rest;
+	uint64_t length;
+	int rc;
+
+	length = connection->replies_partial;
+	rest = (uint8_t *) malloc(length);
+	if (rest == NULL) {
+		return -1;
+	}
+
+	// the queue may grow meanwhile, the rest must not move with it
+	memcpy(rest, connection->replies, length);
+	connection->replies_length -= length;
+	memmove(connection->replies, connection->replies + length, connection->replies_length);
+	connection->replies_partial = 0;
+	pthread_mutex_unlock(&connection->send_lock);
+
+	rc = send_bytes(connection->fd, rest, length, MSG_NOSIGNAL);
+	free(rest);
+
+	pthread_mutex_lock(&connection->send_lock);
+
+	return rc;
+}
+
+static void 
+frame_release(ws_connection_t *connection) {
+	uint64_t stall;
+
+	pthread_mutex_lock(&connection->send_lock);
+
+	// waiting for the slot and for room in the socket both count, a slow reader shows up here
+	stall = recorder_ns(recorder_now() - connection->send_started);
+	if (stall > RECORDER_STALL_NS) {
+		recorder_event(RECORDER_SEND_STALL, connection->ctrl_pending, connection->recorder_id, stall);
+	}
+
+	connection->frame_busy = 0;
+	send_signal(connection);
+	pthread_mutex_unlock(&connection->send_lock);
+}
+
+/**
+ *  @brief						take the connection for a whole data message. Priority messages are served at the 
+ *								next message boundary, ahead of the other waiting messages
+ *
+ *  @param connection 			the web socket connection struct  
+ *  @param priority				1 for the priority lane, 0 otherwise
+ */
+static void 
+message_acquire(ws_connection_t *connection, int priority) {
+	pthread_mutex_lock(&connection->send_lock);
+
+	if (priority) connection->priority_pending++;
+
+	while (connection->message_busy || (!priority && connection->priority_pending > 0)) {
+		send_wait(connection);
+	}
+
+	if (priority) connection->priority_pending--;
+
+	connection->message_busy = 1;
+	pthread_mutex_unlock(&connection->send_lock);
+}
+
+/**
+ *  @brief						end a data message, the explicit flush point of the throughput profile
+ */
+static void 
+message_release(ws_connection_t *connection) {
+	pthread_mutex_lock(&connection->send_lock);
+
+	while (connection->frame_busy) {
+		send_wait(connection);
+	}
+
+	if (connection->corked) {
+		socket_cork(connection->fd, 0);
+		connection->corked = 0;
+	}
+
+	connection->message_busy = 0;
+	send_signal(connection);
+	pthread_mutex_unlock(&connection->send_lock);
+}
+
+/**
+ *  @brief						give the buffers of zero copy sends back whose completion has arrived, without 
+ *								waiting for the others. Called on sends and between the messages of a connection
+ */
+static void 
+zerocopy_collect(ws_connection_t *connection) {
+	zerocopy_buffer_t *done;
+
+	if (connection->zerocopy_threshold == 0 && connection->zerocopy.head == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&connection->send_lock);
+	done = zerocopy_reap(connection->fd, &connection->zerocopy);
+
+	// the kernel had to copy anyway (e.g. loopback), plain sends are cheaper then
+	if (connection->zerocopy.copied && connection->zerocopy_threshold > 0) {
+		DEBUG_PRINT("zero copy fell back to copying, disabled for fd %d\n", connection->fd);
+		connection->zerocopy_threshold = 0;
+	}
+	pthread_mutex_unlock(&connection->send_lock);
+
+	// the owners may send again from release
+	zerocopy_release(done);
+}
+
+/**
+ *  @brief						queue a data message, it is sent with the other queued replies by the next ws_flush. 
+ *								The server flushes after every on_message and on_messages call, and early once the 
+ *								queue reaches REPLY_QUEUE_FLUSH bytes
+ *
+ *  @param connection 			the web socket connection struct  
+ *  @param bytes				the bytes to be transmitted, copied into the queue
+ *  @param length				the amount of bytes to send
+ *  @param message_type			MESSAGE_TYPE_TXT or MESSAGE_TYPE_BIN
+ *  @return         			0 if the message has been queued (or sent), or -1 in case of an error
+ */
+int 
+ws_queue_message(ws_connection_t *connection, uint8_t *bytes, uint64_t length, uint8_t message_type) {
+	uint64_t queued, deadline;
+
+	if (!send_allowed(connection, message_type) || (message_type & 0x08)) {
+		return -1;
+	}
+
+	// big messages would only be copied twice, they go out on their own behind the queue
+	if (length >= connection->coalesce_bytes) {
+		if (ws_flush(connection) == -1) {
+			return -1;
+		}
+
+		return send_data_message(connection, bytes, length, message_type, 0, NULL);
+	}
+
+	pthread_mutex_lock(&connection->send_lock);
+
+	if (append_reply(connection, bytes, length, message_type) == -1) {
+		pthread_mutex_unlock(&connection->send_lock);
+		return -1;
+	}
+
+	queued = connection->replies_length;
+
+	// the window starts with the first message of the queue
+	deadline = 0;
+	if (connection->coalesce_usecs > 0 && connection->coalesce_deadline == 0) {
+		deadline = latency_now() + (uint64_t) connection->coalesce_usecs * 1000;
+		connection->coalesce_deadline = deadline;
+	}
+
+	pthread_mutex_unlock(&connection->send_lock);
+
+	if (queued >= connection->coalesce_bytes) {
+		return ws_flush(connection);
+	}
+
+	if (deadline > 0) {
+		schedule_flush(deadline);
+	}
+
+	return 0;
+}
+
+/**
+ *  @brief						append a frame to the reply queue. Called with send_lock held
+ *
+ *  @param connection 			the web socket connection struct  
+ *  @param bytes				the payload, copied into the queue
+ *  @param length				the length of the payload
+ *  @param message_type			MESSAGE_TYPE_TXT or MESSAGE_TYPE_BIN
+ *  @return         			0 if successful, or -1 if the queue could not grow
+ */
+static int 
+append_reply(ws_connection_t *connection, uint8_t *bytes, uint64_t length, uint8_t message_type) {
+	uint64_t required;
+	uint8_t *grown;
+
+	required = connection->replies_length + length + 10;
+	if (required > connection->replies_capacity) {
+		grown = (uint8_t *) realloc(connection->replies, required * 2);
+		if (grown == NULL) {
+			return -1;
+		}
+
+		connection->replies = grown;
+		connection->replies_capacity = required * 2;
+	}
+
+	connection->replies_length += build_frame_header(connection->replies + connection->replies_length, 1, message_type, length);
+	memcpy(connection->replies + connection->replies_length, bytes, length);
+	connection->replies_length += length;
+	connection->messages_sent++;
+
+	return 0;
+}
+
+/**
+ *  @brief						send as much of the reply queue as the socket takes right now, without waiting for 
+ *								the client or for another sender. Whatever is left is tried again FLUSH_RETRY_USECS 
+ *								later, by the flusher or the event loop of an embedded server
+ *
+ *  @param connection 			the web socket connection struct  
+ *  @return         			0 if the queue is empty now, 1 if bytes are left, or -1 in case of an error
+ */
+static int 
+flush_replies(ws_connection_t *connection) {
+	uint64_t deadline, offset;
+	ssize_t sent;
+	int rc;
+
+	deadline = 0;
+	pthread_mutex_lock(&connection->send_lock);
+
+	if (connection->replies_length == 0) {
+		connection->coalesce_deadline = 0;
+		pthread_mutex_unlock(&connection->send_lock);
+		return 0;
+	}
+
+	if (connection->close_sent) {
+		connection->replies_length = 0;
+		connection->replies_partial = 0;
+		connection->coalesce_deadline = 0;
+		pthread_mutex_unlock(&connection->send_lock);
+		return -1;
+	}
+
+	rc = 1;
+	if (!connection->message_busy && !connection->frame_busy) {
+		// the lock keeps the others out for a single non blocking call only
+		sent = send(connection->fd, connection->replies, connection->replies_length, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			connection->replies_length = 0;
+			connection->replies_partial = 0;
+			connection->coalesce_deadline = 0;
+			pthread_mutex_unlock(&connection->send_lock);
+			return -1;
+		}
+
+		if (sent > 0) {
+			// find the frame the send ended in, the queue only ever holds whole frames behind the partial one
+			if ((uint64_t) sent < connection->replies_partial) {
+				connection->replies_partial -= sent;
+			} else {
+				offset = connection->replies_partial;
+				while (offset < (uint64_t) sent) {
+					offset += frame_length(connection->replies + offset);
+				}
+				connection->replies_partial = offset - sent;
+			}
+
+			connection->replies_length -= sent;
+			memmove(connection->replies, connection->replies + sent, connection->replies_length);
+		}
+
+		rc = (connection->replies_length > 0);
+	}
+
+	if (rc) {
+		deadline = latency_now() + (uint64_t) FLUSH_RETRY_USECS * 1000;
+		if (connection->coalesce_deadline == 0 || connection->coalesce_deadline > deadline) {
+			connection->coalesce_deadline = deadline;
+		} else {
+			deadline = connection->coalesce_deadline;
+		}
+	} else {
+		connection->coalesce_deadline = 0;
+	}
+
+	pthread_mutex_unlock(&connection->send_lock);
+
+	if (rc) {
+		schedule_flush(deadline);
+	}
+
+	return rc;
+}
+
+/**
+ *  @brief						the length of a queued frame including its header
+ */
+static uint64_t 
+frame_length(uint8_t *frame) {
+	uint16_t length_16;
+	uint64_t length_64;
+
+	switch (frame[1] & 0x7F) {
+		case 126:
+			memcpy(&length_16, &frame[2], sizeof(length_16));
+			return 4 + ntohs(length_16);
+		case 127:
+			memcpy(&length_64, &frame[2], sizeof(length_64));
+			return 10 + be64toh(length_64);
+		default:
+			return 2 + (frame[1] & 0x7F);
+	}
+}
 
-		connections[thread_pos] = connection;
-		con_count++;
+/**
+ *  @brief						send every queued reply with a single send call, in between data messages
+ *
+ *  @param connection 			the web socket connection struct  
+ *  @return         			0 if the queue has been sent or was empty, or -1 in case of an error
+ */
+int 
+ws_flush(ws_connection_t *connection) {
+	uint8_t *replies;
+	uint64_t length, capacity;
+	int rc;
 
-		DEBUG_PRINT("new connection. Thread ID %u\n", connection->thread_id);
+	if (connection == NULL) {
+		return -1;
 	}
 
-	return (void *) NULL;
-}
+	message_acquire(connection, 0);
 
-static void*
-ws_connection_thread(void *connection) {
-	pthread_cleanup_push(thread_cleanup_handler, connection);
+	pthread_mutex_lock(&connection->send_lock);
+	length = connection->replies_length;
+	pthread_mutex_unlock(&connection->send_lock);
 
-	ws_connection_t *ws_connection = (ws_connection_t *) connection;
-	int status;
-	struct linger sl;
+	if (length == 0) {
+		message_release(connection);
+		return 0;
+	}
 
-	status = -1;
-	sl.l_onoff = 1;
-	sl.l_linger = 2;
-	setsockopt(ws_connection->fd, SOL_SOCKET, SO_LINGER, &sl, sizeof(sl));
-	
-	while (status != 0) {
-		status = ws_handshake(connection);
+	// the slot comes first, frame_acquire sends the rest of a frame flush_replies cut short before anyone else
+	if (frame_acquire(connection, 0) == -1) {
+		message_release(connection);
+		return -1;
+	}
 
-		if (status == -2) {
-			pthread_exit(NULL);
+	// take the queue, other threads may queue new replies while this one is sent
+	pthread_mutex_lock(&connection->send_lock);
+	replies = connection->replies;
+	length = connection->replies_length;
+	capacity = connection->replies_capacity;
+	connection->replies = NULL;
+	connection->replies_length = 0;
+	connection->replies_capacity = 0;
+	connection->coalesce_deadline = 0;
+	pthread_mutex_unlock(&connection->send_lock);
+
+	rc = 0;
+	if (length > 0) {
+		rc = send_bytes(connection->fd, replies, length, 0);
+		if (rc == -1) {
+			perror("socket send");
 		}
 	}
 
-	ws_connection->status = OPEN;
-	
-	on_connection(connection);
-	
-	// 	0 if successful, -1 if the underlying socket got closed or an 
-	//  other error occured, -2 if the client sent an unmasked frame,
-	//  -3 if the client sent a message bigger than 64 KB  
-
-	int val;
-	for (;;) {
-		val = ws_process_message(ws_connection);
-		
-		if (val == RCV_DATA) {
-			on_message(ws_connection);
-		} 
+	frame_release(connection);
 
-		free(ws_connection->message);
-		ws_connection->message_length = 0; 
-		ws_connection->message = NULL;	
+	// keep the buffer for the next replies unless new ones got queued meanwhile
+	pthread_mutex_lock(&connection->send_lock);
+	if (connection->replies == NULL && replies != NULL) {
+		connection->replies = replies;
+		connection->replies_capacity = capacity;
+		replies = NULL;
 	}
+	pthread_mutex_unlock(&connection->send_lock);
 
-	pthread_cleanup_pop(1);
+	free(replies);
+	message_release(connection);
 
-	return (void *) NULL;
+	return rc;
 }
 
-/*      0                   1                   2                   3
-      0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-     +-+-+-+-+-------+-+-------------+-------------------------------+
-     |F|R|R|R| opcode|M| Payload len |    Extended payload length    |
-     |I|S|S|S|  (4)  |A|     (7)     |             (16/64)           |
-     |N|V|V|V|       |S|             |   (if payload len==126/127)   |
-     | |1|2|3|       |K|             |                               |
-     +-+-+-+-+-------+-+-------------+ - - - - - - - - - - - - - - - +
-     |     Extended payload length continued, if payload len == 127  |
-     + - - - - - - - - - - - - - - - +-------------------------------+
-     |                               |Masking-key, if MASK set to 1  |
-     +-------------------------------+-------------------------------+
-     | Masking-key (continued)       |          Payload Data         |
-     +-------------------------------- - - - - - - - - - - - - - - - +
-     :                     Payload Data continued ...                :
-     + - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - +
-     |                     Payload Data continued ...                |
-     +---------------------------------------------------------------+
-*/
-
 /**
- *  @brief                  receive a websocket message
- *
- *  @param ws_connection    ws_connection_t instance representing an open websocket connection 
- *  @return                 RCV_DATA (0) frame with data successfully received, RCV_PING (1) ping frame, RCV_PONG (2) pong frame
- * 							RCV_CON_CLOSE (3) close frame, RCV_ERR_CONNECTION_LOST (-1) if the underlying socket got closed,
- * 							RCV_ERR_PROTOCOLL (-2) protocoll error i.e. client sent an unmasked frame, RCV_ERR_PAYLOAD_SIZE (-3) payload too big                                                 
+ *  @brief						flush the reply queues whose coalescing window has ended. Sleeps until the 
+ *								earliest window of all connections ends. The due connections are only pinned under 
+ *								connections_lock and flushed without waiting for their clients afterwards
  */
+static void *
+ws_flusher_thread(void *param) {
+	struct timespec wakeup;
+	uint64_t now, next, deadline;
+	ws_connection_t **due, **grown;
+	int count, capacity;
 
-static int
-ws_process_message(ws_connection_t *ws_connection) {
-	ws_frame_header_t frame_header;
-	uint8_t raw_header[14];
-	int payload_start;
+	due = NULL;
+	capacity = 0;
 
 	for (;;) {
-		if (recv_bytes(ws_connection->fd, raw_header, 2) < 0) {
-			pthread_exit(NULL);  
-		}
-
-		frame_header.fin = raw_header[0] & 0x80;
-		frame_header.rsv = raw_header[0] & 0x70;
-		frame_header.op_code = raw_header[0] & 0x0F;
-		frame_header.masked = raw_header[1] & 0x80;	
-		frame_header.payload_length = raw_header[1] & 0x7F;
-		payload_start = 6;
-
-		if (frame_header.masked == 0 
-			|| frame_header.rsv != 0 
-			|| (((frame_header.op_code & 0x08) == 0) && 
-						((ws_connection->processed_frames == 0 && frame_header.op_code == 0) 
-					 || (ws_connection->processed_frames > 0 && frame_header.op_code != 0)))
-			|| (((frame_header.op_code & 0x08) == 0x08) && (frame_header.payload_length > 125 || frame_header.fin == 0))
-		) {
-			// close the tcp connection due to RCV_ERR_PROTOCOLL
-			pthread_exit(NULL); 
+		pthread_mutex_lock(&flusher_lock);
+		while ((now = latency_now()) < flusher_deadline) {
+			if (flusher_deadline == UINT64_MAX) {
+				pthread_cond_wait(&flusher_cond, &flusher_lock);
+			} else {
+				wakeup.tv_sec = flusher_deadline / 1000000000;
+				wakeup.tv_nsec = flusher_deadline % 1000000000;
+				pthread_cond_timedwait(&flusher_cond, &flusher_lock, &wakeup);
+			}
 		}
+		flusher_deadline = UINT64_MAX;
+		pthread_mutex_unlock(&flusher_lock);
 
-		if (ws_connection->close_sent == 1 && frame_header.op_code != OPCODE_CON_CLOSE) { return -42; }
-	
-		if (frame_header.payload_length == 126) {
-			payload_start = 8;
-		} else if (frame_header.payload_length == 127) {
-			payload_start = 14;
-		}
+		next = UINT64_MAX;
+		count = 0;
 
-		if (recv_bytes(ws_connection->fd, raw_header + 2, payload_start - 2) < 0) {
-			pthread_exit(NULL); 
-		}
-		
-		if (frame_header.payload_length == 126) {
-			frame_header.payload_length = (long) raw_header[2] << 8 | (long) raw_header[3];
-		} else if (frame_header.payload_length == 127) {
-			frame_header.payload_length = 0;
-			
-			for (int i = 0; i < 8; ++i) {
-				frame_header.payload_length |= (long) raw_header[2 + i] << 8 * (7 - i);
+		pthread_mutex_lock(&connections_lock);
+		if (capacity < max_con) {
+			grown = (ws_connection_t **) realloc(due, sizeof(ws_connection_t *) * max_con);
+			if (grown != NULL) {
+				due = grown;
+				capacity = max_con;
 			}
 		}
 
-		if (frame_header.payload_length >= MAX_FRAME_SIZE_RCV) {
-			handle_error(ws_connection, RCV_ERR_PAYLOAD_SIZE);
-			return RCV_ERR_PAYLOAD_SIZE;
-		}
-
-		frame_header.mask[0] = raw_header[payload_start - 4]; 
-		frame_header.mask[1] = raw_header[payload_start - 3];
-		frame_header.mask[2] = raw_header[payload_start - 2];
-		frame_header.mask[3] = raw_header[payload_start - 1];
-
-		switch (frame_header.op_code) {
-			case OPCODE_CONTINUATION: 
-				handle_data_frame(ws_connection, &frame_header);
-				
-				break;
-			case OPCODE_TEXT:
-				ws_connection->message_type = MESSAGE_TYPE_TXT;
-				
-				handle_data_frame(ws_connection, &frame_header);
-				break;
-			case OPCODE_BINARY:	
-				ws_connection->message_type = MESSAGE_TYPE_BIN;
-				
-				handle_data_frame(ws_connection, &frame_header);
-				break;
-			case OPCODE_CON_CLOSE:
-				// response to sent close frame received, exit immediatly
-				if (ws_connection->close_sent == 1) {
-					pthread_exit(NULL);
-				}
-
-				handle_close_frame(ws_connection, &frame_header);
-			case OPCODE_PING:
-				handle_ping_frame(ws_connection, &frame_header);
-				break;
-			case OPCODE_PONG:
-				handle_pong_frame(ws_connection, &frame_header);
-				break;
-			default:
-				// close the tcp connection due to RCV_ERR_PROTOCOLL
-				pthread_exit(NULL);
-		}
+		for (int i = 0; i < max_con; ++i) {
+			if (connections[i] == NULL || (deadline = connections[i]->coalesce_deadline) == 0) {
+				continue;
+			}
 
-		if (frame_header.fin && ((frame_header.op_code & 0x08) == 0)) {
-			if (ws_connection->message_type == MESSAGE_TYPE_TXT && !is_valid_utf8(ws_connection->message, ws_connection->message_length)) {
-				pthread_exit(NULL);
+			if (deadline <= now && count < capacity) {
+				pin_connection(connections[i]);
+				due[count++] = connections[i];
+			} else if (deadline < next) {
+				next = deadline;
 			}
-			break;
 		}
-	}
-
-	return RCV_DATA;
-}
-
-static void
-handle_data_frame(ws_connection_t *ws_connection, ws_frame_header_t *frame_header) {
-	ws_connection->processed_frames++;
-	
-	if (ws_connection->message == NULL) {
-		ws_connection->message = (uint8_t *) malloc(frame_header->payload_length);
-	} else {
-		ws_connection->message = (uint8_t *) realloc(ws_connection->message, ws_connection->message_length + frame_header->payload_length);
-	}
+		pthread_mutex_unlock(&connections_lock);
 
-	if (recv_bytes(ws_connection->fd, ws_connection->message + ws_connection->message_length, frame_header->payload_length) < 0) {
-		pthread_exit(NULL);
-	}
+		// a queue the socket didn't take completely is rescheduled by flush_replies
+		for (int i = 0; i < count; ++i) {
+			flush_replies(due[i]);
+			unpin_connection(due[i]);
+		}
 
-	for (int i = 0; i < frame_header->payload_length; ++i) {
-		ws_connection->message[i + ws_connection->message_length] ^= frame_header->mask[i % 4];
+		if (next != UINT64_MAX) {
+			schedule_flush(next);
+		}
 	}
 
-	ws_connection->message_length += frame_header->payload_length;
+	return NULL;
 }
 
+/**
+ *  @brief						wake the flusher by the given time unless it wakes up earlier anyway
+ *
+ *  @param deadline				CLOCK_MONOTONIC time in nanoseconds
+ */
 static void 
-handle_close_frame(ws_connection_t *ws_connection, ws_frame_header_t *frame_header) {
-	ws_connection->status = CLOSING;
+schedule_flush(uint64_t deadline) {
+	struct itimerspec timer;
 
-	uint8_t close_payload[40];
-	int close_payload_len;
-	uint8_t close_data[frame_header->payload_length];
-
-	if (recv_bytes(ws_connection->fd, close_data, frame_header->payload_length) < 0) {
-		pthread_exit(NULL);
-	}	
+	pthread_mutex_lock(&flusher_lock);
+	if (deadline < flusher_deadline) {
+		flusher_deadline = deadline;
 
-	for (int i = 0; i < frame_header->payload_length; ++i) {
-		close_data[i] ^= frame_header->mask[i % 4];
+		// an embedded server has no flusher, its event loop is woken by the timer
+		if (embedded) {
+			memset(&timer, 0, sizeof(timer));
+			timer.it_value.tv_sec = deadline / 1000000000;
+			timer.it_value.tv_nsec = deadline % 1000000000;
+			timerfd_settime(flush_timer, TFD_TIMER_ABSTIME, &timer, NULL);
+		} else {
+			pthread_cond_signal(&flusher_cond);
+		}
 	}
+	pthread_mutex_unlock(&flusher_lock);
+}
 
-	if (frame_header->payload_length == 0) {
-		create_close_payload(1000, close_payload, &close_payload_len); 
-	} else if (frame_header->payload_length == 1) {
-		create_close_payload(1002, close_payload, &close_payload_len); 
-	} else {
-		if(!is_valid_utf8(close_data + 2, frame_header->payload_length - 2)) {
-			pthread_exit(NULL);
-		} 
-		uint16_t close_code = close_data[0] << 8 | close_data[1];
-
-		int invalid_close_codes_size = sizeof(invalid_close_codes) / sizeof(uint16_t);
-		for (int i = 0; i < invalid_close_codes_size; ++i) {
-			if (invalid_close_codes[i] == close_code) { 
-				close_code = 1002;
-				break; 
-			}
-		} 
+/**
+ *  @brief						send a message to every open connection. In sharded mode the message is written 
+ *								once into the shared memory bus and each shard frames it for its own connections. 
+ *								The message goes through the reply queue of each connection and never waits for a 
+ *								client, clients leaving BROADCAST_BACKLOG_MAX bytes unread are disconnected
+ *
+ *  @param message_bytes		the bytes to be transmitted
+ *  @param message_length		the amount of bytes to send, at most BUS_SLOT_SIZE in sharded mode
+ *  @param message_type			MESSAGE_TYPE_TXT or MESSAGE_TYPE_BIN
+ *  @return         			0 if successful, or -1 if the message could not be published
+ */
+int 
+ws_broadcast(uint8_t *message_bytes, uint64_t message_length, uint8_t message_type) {
+	if (bus != NULL) {
+		if (message_length > BUS_SLOT_SIZE) {
+			return -1;
+		}
 
-		DEBUG_PRINT("Using code %u to close connection\n", close_code);
-		create_close_payload(close_code, close_payload, &close_payload_len); 
+		return bus_publish(bus, shard_id, message_type, message_bytes, message_length);
 	}
 
-	// connection has been properly closed ..
-	ws_send_message(ws_connection, close_payload, close_payload_len, OPCODE_CON_CLOSE);
+	deliver_broadcast(message_type, message_bytes, message_length);
 
-	pthread_exit(NULL);
+	return 0;
 }
 
 static void 
-handle_ping_frame(ws_connection_t *ws_connection, ws_frame_header_t *frame_header) {
-	uint8_t ping_data[frame_header->payload_length];
+deliver_broadcast(uint8_t type, uint8_t *bytes, uint32_t length) {
+	ws_connection_t **targets;
+	int count;
 
-	if (recv_bytes(ws_connection->fd, ping_data, frame_header->payload_length) < 0) {
-		pthread_exit(NULL);
-	}	
+	// the table is only held to pin the receivers, nobody waits for a client under it
+	pthread_mutex_lock(&connections_lock);
+	targets = (con_count > 0) ? (ws_connection_t **) malloc(sizeof(ws_connection_t *) * con_count) : NULL;
+	if (targets == NULL) {
+		pthread_mutex_unlock(&connections_lock);
+		return;
+	}
 
-	for (int i = 0; i < frame_header->payload_length; ++i) {
-		ping_data[i] ^= frame_header->mask[i % 4];
+	count = 0;
+	for (int i = 0; i < max_con; ++i) {
+		if (connections[i] != NULL && connections[i]->status == OPEN) {
+			pin_connection(connections[i]);
+			targets[count++] = connections[i];
+		}
 	}
-	
-	if (ws_send_message(ws_connection, ping_data, frame_header->payload_length, OPCODE_PONG) < 0) {
-		pthread_exit(NULL);
+	pthread_mutex_unlock(&connections_lock);
+
+	for (int i = 0; i < count; ++i) {
+		broadcast_to(targets[i], type, bytes, length);
+		unpin_connection(targets[i]);
 	}
+
+	free(targets);
 }
 
+/**
+ *  @brief						queue a broadcast for one connection and send what the socket takes. A client that 
+ *								lets BROADCAST_BACKLOG_MAX bytes pile up is cut off, so it cannot hold up the others
+ */
 static void 
-handle_pong_frame(ws_connection_t *ws_connection, ws_frame_header_t *frame_header) {
-	uint8_t pong_data[frame_header->payload_length];
+broadcast_to(ws_connection_t *connection, uint8_t type, uint8_t *bytes, uint32_t length) {
+	uint64_t backlog;
+	int rc;
 
-	if (recv_bytes(ws_connection->fd, pong_data, frame_header->payload_length) < 0) {
-		pthread_exit(NULL); 
-	}
-}
+	pthread_mutex_lock(&connection->send_lock);
 
-static void 
-handle_error(ws_connection_t *ws_connection, int close_code) {
-	uint8_t close_payload[40];
-	int close_payload_len;	
+	if (!send_allowed(connection, type)) {
+		pthread_mutex_unlock(&connection->send_lock);
+		return;
+	}
 
-	create_close_payload(close_code, close_payload, &close_payload_len); 
+	backlog = connection->replies_length;
+	rc = (backlog + length > BROADCAST_BACKLOG_MAX) ? -1 : append_reply(connection, bytes, length, type);
+	pthread_mutex_unlock(&connection->send_lock);
 
-	if (ws_send_message(ws_connection, close_payload, close_payload_len, close_code) == -1) {
-		pthread_exit(NULL);
+	if (rc == -1) {
+		// abortive, the backlog in the socket is dropped. Its own thread sees the connection end and releases it
+		struct linger sl = { 1, 0 };
+		setsockopt(connection->fd, SOL_SOCKET, SO_LINGER, &sl, sizeof(sl));
+		recorder_event(RECORDER_ERROR, 1008, connection->recorder_id, ENOBUFS);
+		shutdown(connection->fd, SHUT_RDWR);
+		return;
 	}
-	
-	ws_connection->status = CLOSING;
-	ws_connection->close_sent = 1;
-}
 
-/**
- *  @brief		wrapper function to send UTF-8 encoded text                                                
- */
-int 
-send_ws_message_txt(ws_connection_t *connection, uint8_t *bytes, uint64_t length) {
-	return ws_send_message(connection, bytes, length, OPCODE_TEXT);
+	flush_replies(connection);
 }
 
 /**
- *  @brief		wrapper function to send arbitrary binary data                                           
+ *  @brief						check whether a frame may be sent in the current state of the connection
  */
-int 
-send_ws_message_bin(ws_connection_t *connection, uint8_t *bytes, uint64_t length) {
-	return ws_send_message(connection, bytes, length, OPCODE_BINARY);
+static int 
+send_allowed(ws_connection_t *connection, uint8_t op_code) {
+	return !(connection == NULL 
+		|| connection->status == CONNECTING 
+		|| connection->status == CLOSED
+		|| (connection->status == CLOSING && connection->close_sent == 1)
+		|| (connection->status == CLOSING && op_code != OPCODE_CON_CLOSE));
 }
 
 /**
- *  @brief						send ws message
+ *  @brief						build the header of an unmasked frame
  *
- *  @param connection 			the web socket connection struct  
- *  @param message_bytes		the bytes to be transmitted over the established websocket connection
- *  @param message_length		the amount of bytes to send. Most of the time this the length of the message bytes array
- *  @param message_type			the available op codes according to the RFC
- *  @return         			0 if the message has been transmitted successfully or -1 if the underlying connection has been closed                                                  
+ *  @param frame_header			array of at least 10 bytes receiving the header
+ *  @param fin					1 for the last frame of a message
+ *  @param op_code				op code of the frame
+ *  @param payload_len			length of the frame payload
+ *  @return         			the length of the header
  */
 static int 
-ws_send_message(ws_connection_t *connection, uint8_t *message_bytes, uint64_t message_length, uint8_t message_type) {
-	if (connection == NULL 
-		|| connection->status == CONNECTING 
-		|| connection->status == CLOSED
-		|| (connection->status == CLOSING && connection->close_sent == 1)
-		|| (connection->status == CLOSING && message_type != OPCODE_CON_CLOSE)) { 
-		return -1;
-	}
-
-	pthread_mutex_lock(&lock);
-
-	int frames; // amount of frames to send
-	int header_len; 
-	uint8_t frame_header[10];
-	uint64_t payload_len;
-
-	frames = message_length / MAX_FRAME_SIZE_SND;	
-	frames += (message_length % MAX_FRAME_SIZE_SND == 0) ? 0 : 1;
-
-	if (message_length == 0) { frames = 1; }
-	header_len = 2; 
-
-	for (int i = 0; i < frames; ++i) {
-		// start packing
-		frame_header[0] = (message_length <= MAX_FRAME_SIZE_SND) ? 0x80 : 0;
-		frame_header[0] |= (i == 0) ? message_type : 0x00;
-
-		// || Buffer Size < 126  
-		// MAX_FRAME_SIZE 0x1000
-		if (message_length < 126 || MAX_FRAME_SIZE_SND < 126) {
-			frame_header[1] = payload_len = (message_length < MAX_FRAME_SIZE_SND) ? message_length : MAX_FRAME_SIZE_SND;
-		} else if (message_length <= 0xFFFF || MAX_FRAME_SIZE_SND <= 0xFFFF) {
-			frame_header[1] = 126;
-			header_len += 2;
-
-			uint16_t extended_payload_len_16 = payload_len = (message_length < MAX_FRAME_SIZE_SND) ? message_length : MAX_FRAME_SIZE_SND;
-			extended_payload_len_16 = htons(extended_payload_len_16 & 0xFFFF);
-			memcpy(&frame_header[2], &extended_payload_len_16, sizeof(extended_payload_len_16));	
-		} else {
-			frame_header[1] = 127;
-			header_len += 8;
-
-			uint64_t extended_payload_len_64 = payload_len = (message_length < MAX_FRAME_SIZE_SND) ? message_length : MAX_FRAME_SIZE_SND;
-			extended_payload_len_64 = htobe64(payload_len);
-			memcpy(&frame_header[2], &extended_payload_len_64, sizeof(extended_payload_len_64));
-		}
+build_frame_header(uint8_t *frame_header, uint8_t fin, uint8_t op_code, uint64_t payload_len) {
+	uint16_t extended_payload_len_16;
+	uint64_t extended_payload_len_64;
 
-		// send frame header
-		if (send(connection->fd, frame_header, header_len, 0) == -1) {
-			perror("socket send");
-			pthread_mutex_unlock(&lock);
-			return -1;
-		}
-
-		// send frame payload; 
-		if (send(connection->fd, message_bytes, payload_len, 0) == -1) {
-			perror("socket send");
-			pthread_mutex_unlock(&lock);
-			return -1;
-		}
+	frame_header[0] = (fin ? 0x80 : 0) | op_code;
 
-		message_bytes += MAX_FRAME_SIZE_SND;
-		message_length -= MAX_FRAME_SIZE_SND;
+	if (payload_len < 126) {
+		frame_header[1] = payload_len;
+		return 2;
+	} else if (payload_len <= 0xFFFF) {
+		frame_header[1] = 126;
+		extended_payload_len_16 = htons(payload_len);
+		memcpy(&frame_header[2], &extended_payload_len_16, sizeof(extended_payload_len_16));	
+		return 4;
 	}
 
-	pthread_mutex_unlock(&lock);
+	frame_header[1] = 127;
+	extended_payload_len_64 = htobe64(payload_len);
+	memcpy(&frame_header[2], &extended_payload_len_64, sizeof(extended_payload_len_64));
 
-	return 0;
+	return 10;
 }
 
 /**
@@ -564,22 +4336,50 @@ ws_send_message(ws_connection_t *connection, uint8_t *message_bytes, uint64_t me
  */
 static int
 ws_handshake(ws_connection_t *con) {
-	char method[20], http_version[20], data[2048], http_response[200];
+	char *data;
+	int rc;
+
+	// the request is only needed during the handshake, keep it off the small connection stack
+	data = (char *) pool_get();
+	if (data == NULL) {
+		return -2;
+	}
+
+	rc = ws_process_handshake(con, data);
+	pool_put(data);
+
+	recorder_event(RECORDER_HANDSHAKE, -rc, con->recorder_id, con->fd);
+
+	return rc;
+}
+
+static int
+ws_process_handshake(ws_connection_t *con, char *data) {
+	char method[20], http_version[20], http_response[200];
 	http_header_t *request_headers, response_headers[3];
 	int hcount, status, ec;
 	char *sec_websocket_key;
+	int qos_class;
 
 	int numbytes;
 	
 	status = 0;
+	qos_class = -1;
 
-	numbytes = recv(con->fd, data, 2048, 0);
+	while ((numbytes = recv(con->fd, data, POOL_BUFFER_SIZE - 1, 0)) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		wait_fd(con->fd, POLLIN);
+	}
 	if(numbytes == -1) {
 		perror("socket recv");
 		return -1;
 	} else if (numbytes == 0) {
 		return -2;
 	}
+	data[numbytes] = '\0';
+
+	if (con->capture_id) {
+		capture_write(con->capture_id, CAPTURE_HANDSHAKE, 0, (uint8_t *) data, numbytes);
+	}
 
 	ec = parse_http_request(data, method, http_version, &request_headers, &hcount);
 	if (ec == -1) {
@@ -616,8 +4416,14 @@ ws_handshake(ws_connection_t *con) {
 			status |= ORIGIN;
 		} else if (!strcmp(request_headers[i].header, "Sec-WebSocket-Protocol")) {
 			;
-		} if (!strcmp(request_headers[i].header, "Sec-WebSocket-Extension")) {
+		} else if (!strcmp(request_headers[i].header, "Sec-WebSocket-Extension")) {
 			;
+		} else if (qos_header != NULL && !strcasecmp(request_headers[i].header, qos_header)) {
+			for (int j = 0; j < QOS_CLASSES; ++j) {
+				if (!strcmp(request_headers[i].value, qos_names[j])) {
+					qos_class = j;
+				}
+			}
 		}
 	}	
 
@@ -646,6 +4452,10 @@ ws_handshake(ws_connection_t *con) {
 		perror("socket send");
 	}
 
+	if (qos_class != -1) {
+		ws_set_qos(con, qos_class);
+	}
+
 	free(request_headers);
 	return 0;
 }
@@ -699,6 +4509,7 @@ void create_close_payload(int code, uint8_t *close_payload, int *close_payload_l
 	*close_payload_len = strlen(websocket_close_codes[i].reason);
 
 	memcpy(close_payload + 2, websocket_close_codes[i].reason, *close_payload_len);
+	*close_payload_len += 2;
 }
 
 static void init_connections(int start_pos) {
@@ -707,22 +4518,107 @@ static void init_connections(int start_pos) {
 	}
 }
 
-static void thread_cleanup_handler(void *arg) {
-	ws_connection_t *ws_connection = (ws_connection_t *) arg;
-	DEBUG_PRINT("connection for thread with id %u terminated\n", ws_connection->thread_id);
-	
+/**
+ *  @brief                  close the socket of a connection and free it
+ *
+ *  @param ws_connection    the connection, no longer registered afterwards
+ *  @param drain_flags      flags of the recv calls reading what the client still sends after the shutdown. 0 
+ *                          waits for the client to close, MSG_DONTWAIT only takes what has arrived
+ */
+static void 
+release_connection(ws_connection_t *ws_connection, int drain_flags) {
+	unregister_connection(ws_connection);
+	admission_release(&ws_connection->cold->remote_addr.sa);
+	if (ws_connection->capture_id) {
+		capture_write(ws_connection->capture_id, CAPTURE_DISCONNECT, 0, NULL, 0);
+	}
+	recorder_event(RECORDER_DISCONNECT, 0, ws_connection->recorder_id, ws_connection->messages_sent);
 	shutdown(ws_connection->fd, SHUT_WR);
 
-	uint8_t temp[65536];
+	uint8_t temp[512];
 	ssize_t bytes_read;
-	while ((bytes_read = recv(ws_connection->fd, temp, sizeof(temp), 0)) > 0) {
+	while ((bytes_read = recv(ws_connection->fd, temp, sizeof(temp), drain_flags)) > 0) {
 		;
 	}
 
-	connections[ws_connection->thread_id] = NULL;
 	ws_connection->status = CLOSED;
-	if (ws_connection->message != NULL)	free(ws_connection->message); 
+	segments_record(ws_connection->fd, ws_connection->messages_sent);
+	release_message(ws_connection);
+	release_batch(ws_connection);
+	free(ws_connection->cold->batch);
+
+	// a broadcast or the flusher may still hold the connection, the last of them frees it
+	unpin_connection(ws_connection);
+}
+
+/**
+ *  @brief                  append an unmasked inbound frame to the capture log if the connection is sampled
+ */
+static void 
+capture_frame(ws_connection_t *ws_connection, ws_frame_header_t *frame_header, uint8_t *payload) {
+	if (ws_connection->capture_id) {
+		capture_write(ws_connection->capture_id, CAPTURE_FRAME, (frame_header->fin ? 0x80 : 0) | frame_header->op_code, 
+			payload, frame_header->payload_length);
+	}
+}
+
+/**
+ *  @brief                  free the messages handed to on_messages
+ */
+static void 
+release_batch(ws_connection_t *ws_connection) {
+	for (uint32_t i = 0; i < ws_connection->cold->batch_count; ++i) {
+		// a spilled message has been trimmed to its length when it was complete
+		release_buffer(ws_connection->cold->batch[i].data, spill_size(ws_connection->cold->batch[i].length), ws_connection->cold->batch[i].storage);
+	}
+
+	ws_connection->cold->batch_count = 0;
+}
+
+/**
+ *  @brief                  free a message buffer according to where it lives
+ *
+ *  @param data             the buffer, may be NULL
+ *  @param capacity         its size, only needed for spilled messages
+ *  @param storage          one of the values of enum ws_storage
+ */
+static void 
+release_buffer(uint8_t *data, uint64_t capacity, uint8_t storage) {
+	switch (storage) {
+		case STORAGE_POOL:
+			pool_put(data);
+			break;
+		case STORAGE_SPILL:
+			spill_release(data, capacity);
+			break;
+		default:
+			free(data);
+	}
+}
+
+/**
+ *  @brief                  free the buffers of the last received message, pooled buffers go back to the pool
+ */
+static void 
+release_message(ws_connection_t *ws_connection) {
+	for (uint32_t i = 0; i < ws_connection->segment_count; ++i) {
+		release_buffer(ws_connection->segments[i].data, ws_connection->segments[i].capacity, ws_connection->segments[i].storage);
+	}
+
+	// the file of an incomplete spilled message
+	if (ws_connection->spill_fd != -1) {
+		close(ws_connection->spill_fd);
+		ws_connection->spill_fd = -1;
+	}
+
+	// a long chain gives its descriptors back, idle connections only keep the inline ones
+	if (ws_connection->segments != ws_connection->cold->inline_segments) {
+		free(ws_connection->segments);
+		ws_connection->segments = ws_connection->cold->inline_segments;
+		ws_connection->segment_capacity = INLINE_SEGMENTS;
+	}
 
-	close(ws_connection->fd);
-	free(ws_connection);
+	ws_connection->message = NULL;
+	ws_connection->message_length = 0;
+	ws_connection->segment_count = 0;
 }
@@ -0,0 +1,218 @@
+/***************************************************************************//**
+
+  @file         zerocopy.c
+
+  @author       Robert Eikmanns
+
+  @date         Monday, 19 October 2026
+
+  @brief        MSG_ZEROCOPY transmit path. The kernel sends straight from the pages of 
+                the caller and reports on the socket error queue once it doesn't need 
+                them anymore. The buffers are tracked per socket and given back to their 
+                owners when the error queue is read, nobody waits for the notifications
+
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+
+#include "zerocopy.h"
+
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define 	SO_EE_ORIGIN_ZEROCOPY		5
+#endif
+
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define 	SO_EE_CODE_ZEROCOPY_COPIED	1
+#endif
+
+static int read_completions(int fd, zerocopy_state_t *state);
+
+/**
+ *  @brief                  allow MSG_ZEROCOPY sends on a socket
+ *
+ *  @param fd               the socket   
+ *  @return                 0 if successful, or -1 if the kernel doesn't support zero copy sends
+ */
+int 
+zerocopy_enable(int fd) {
+	int on;
+
+	on = 1;
+
+	return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on));
+}
+
+/**
+ *  @brief                  send bytes without copying them into the kernel. The bytes must not be modified 
+ *                          until their buffer has been released, see zerocopy_track
+ *
+ *  @param fd               socket with zero copy enabled
+ *  @param mem              pointer to the bytes to send 
+ *  @param length           amount of bytes to send 
+ *  @param flags            additional flags passed to send
+ *  @param state            zero copy bookkeeping of the socket
+ *  @return                 0 if successful, or -1 in case of an error
+ */
+int 
+zerocopy_send(int fd, uint8_t *mem, uint64_t length, int flags, zerocopy_state_t *state) {
+	ssize_t numbytes;
+
+	while (length) {
+		numbytes = send(fd, mem, length, flags | MSG_ZEROCOPY);
+
+		if (numbytes == -1) {
+			if (errno == EINTR) continue;
+
+			// out of option memory for pinned pages, copy this chunk instead
+			if (errno == ENOBUFS) {
+				numbytes = send(fd, mem, length, flags);
+				if (numbytes == -1) return -1;
+			} else {
+				return -1;
+			}
+		} else {
+			// every successful zero copy send gets its own completion id
+			state->sent++;
+		}
+
+		mem += numbytes;
+		length -= numbytes;
+	}
+
+	return 0;
+}
+
+/**
+ *  @brief                  wrap a buffer for zerocopy_track
+ *
+ *  @param data             the buffer
+ *  @param release          called with context and data once the kernel is done with the buffer
+ *  @param context          passed to release
+ *  @return                 the wrapper, or NULL if out of memory
+ */
+zerocopy_buffer_t *
+zerocopy_buffer(uint8_t *data, zerocopy_release_t release, void *context) {
+	zerocopy_buffer_t *buffer;
+
+	buffer = (zerocopy_buffer_t *) malloc(sizeof(zerocopy_buffer_t));
+	if (buffer != NULL) {
+		buffer->data = data;
+		buffer->release = release;
+		buffer->context = context;
+		buffer->next = NULL;
+	}
+
+	return buffer;
+}
+
+/**
+ *  @brief                  hand a buffer to the socket after the last zerocopy_send from it, it is released 
+ *                          once all sends issued so far are completed
+ *
+ *  @param state            zero copy bookkeeping of the socket
+ *  @param buffer           the buffer, owned by the state afterwards
+ */
+void 
+zerocopy_track(zerocopy_state_t *state, zerocopy_buffer_t *buffer) {
+	buffer->end = state->sent;
+	buffer->next = NULL;
+
+	if (state->tail != NULL) {
+		state->tail->next = buffer;
+	} else {
+		state->head = buffer;
+	}
+	state->tail = buffer;
+}
+
+/**
+ *  @brief                  read the completion notifications that arrived so far without waiting, and take the 
+ *                          buffers the kernel is done with off the socket
+ *
+ *  @param fd               socket with zero copy enabled
+ *  @param state            zero copy bookkeeping of the socket
+ *  @return                 the released buffers for zerocopy_release, NULL if there are none
+ */
+zerocopy_buffer_t *
+zerocopy_reap(int fd, zerocopy_state_t *state) {
+	zerocopy_buffer_t *done, *last;
+
+	if (state->head == NULL) {
+		return NULL;
+	}
+
+	read_completions(fd, state);
+
+	// completion ids are handed out in order and tcp completes them in order
+	done = state->head;
+	last = NULL;
+	while (state->head != NULL && (int32_t) (state->completed - state->head->end) >= 0) {
+		last = state->head;
+		state->head = state->head->next;
+	}
+
+	if (last == NULL) {
+		return NULL;
+	}
+
+	last->next = NULL;
+	if (state->head == NULL) {
+		state->tail = NULL;
+	}
+
+	return done;
+}
+
+/**
+ *  @brief                  give a list of buffers back to their owners
+ *
+ *  @param buffers          returned by zerocopy_reap, or the head of a state whose socket is closed
+ */
+void 
+zerocopy_release(zerocopy_buffer_t *buffers) {
+	zerocopy_buffer_t *next;
+
+	while (buffers != NULL) {
+		next = buffers->next;
+		buffers->release(buffers->context, buffers->data);
+		free(buffers);
+		buffers = next;
+	}
+}
+
+static int 
+read_completions(int fd, zerocopy_state_t *state) {
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct sock_extended_err *serr;
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_storage))];
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+			return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+		}
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			serr = (struct sock_extended_err *) CMSG_DATA(cmsg);
+
+			if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+				continue;
+			}
+
+			// notifications cover the inclusive range of completion ids ee_info .. ee_data
+			state->completed += serr->ee_data - serr->ee_info + 1;
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				state->copied = 1;
+			}
+		}
+	}
+}
@@ -0,0 +1,45 @@
+/***************************************************************************//**
+
+  @file         zerocopy.h
+
+  @author       Robert Eikmanns
+
+  @date         Monday, 19 October 2026
+
+  @brief        Declarations for the MSG_ZEROCOPY transmit path
+
+*******************************************************************************/
+
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include <stdint.h>
+
+// gives a buffer back to its owner once the kernel doesn't read from it anymore
+typedef void (*zerocopy_release_t)(void *context, uint8_t *buffer);
+
+// a buffer the kernel may still be sending from
+typedef struct zerocopy_buffer {
+	uint8_t *data;
+	zerocopy_release_t release;
+	void *context;
+	uint32_t end;			// the buffer is free once this many sends of the socket are completed
+	struct zerocopy_buffer *next;
+} zerocopy_buffer_t;
+
+typedef struct {
+	uint32_t sent;			// zero copy sends issued on the socket
+	uint32_t completed;		// sends the kernel reported as done
+	uint8_t copied;			// the kernel fell back to copying, e.g. on loopback
+	zerocopy_buffer_t *head;	// buffers still in use by the kernel, oldest first
+	zerocopy_buffer_t *tail;
+} zerocopy_state_t;
+
+int zerocopy_enable(int fd);
+int zerocopy_send(int fd, uint8_t *mem, uint64_t length, int flags, zerocopy_state_t *state);
+zerocopy_buffer_t *zerocopy_buffer(uint8_t *data, zerocopy_release_t release, void *context);
+void zerocopy_track(zerocopy_state_t *state, zerocopy_buffer_t *buffer);
+zerocopy_buffer_t *zerocopy_reap(int fd, zerocopy_state_t *state);
+void zerocopy_release(zerocopy_buffer_t *buffers);
+
+#endif